@@ -21,7 +21,7 @@ enum {
 };
 
 static void
-cmd_look(struct cl_peer *peer, const char *cmd, int mode, int argc, const char *argv[])
+cmd_look(struct cl_peer *peer, const char *cmd, int mode, int argc, const char *argv[], const size_t argl[])
 {
 	assert(peer != NULL);
 	assert(cmd != NULL);
@@ -30,6 +30,7 @@ cmd_look(struct cl_peer *peer, const char *cmd, int mode, int argc, const char *
 
 	(void) cmd;
 	(void) argv;
+	(void) argl;
 	(void) mode;
 
 	if (argc != 0) {
@@ -41,7 +42,7 @@ cmd_look(struct cl_peer *peer, const char *cmd, int mode, int argc, const char *
 }
 
 static void
-cmd_go(struct cl_peer *peer, const char *cmd, int mode, int argc, const char *argv[])
+cmd_go(struct cl_peer *peer, const char *cmd, int mode, int argc, const char *argv[], const size_t argl[])
 {
 	assert(peer != NULL);
 	assert(cmd != NULL);
@@ -50,6 +51,7 @@ cmd_go(struct cl_peer *peer, const char *cmd, int mode, int argc, const char *ar
 
 	(void) cmd;
 	(void) argv;
+	(void) argl;
 	(void) mode;
 
 	if (argc != 0) {
@@ -61,7 +63,7 @@ cmd_go(struct cl_peer *peer, const char *cmd, int mode, int argc, const char *ar
 }
 
 static void
-cmd_quit(struct cl_peer *peer, const char *cmd, int mode, int argc, const char *argv[])
+cmd_quit(struct cl_peer *peer, const char *cmd, int mode, int argc, const char *argv[], const size_t argl[])
 {
 	assert(peer != NULL);
 	assert(cmd != NULL);
@@ -70,6 +72,7 @@ cmd_quit(struct cl_peer *peer, const char *cmd, int mode, int argc, const char *
 
 	(void) cmd;
 	(void) argv;
+	(void) argl;
 	(void) mode;
 
 	if (argc != 0) {
@@ -81,7 +84,7 @@ cmd_quit(struct cl_peer *peer, const char *cmd, int mode, int argc, const char *
 }
 
 static void
-cmd_help(struct cl_peer *peer, const char *cmd, int mode, int argc, const char *argv[])
+cmd_help(struct cl_peer *peer, const char *cmd, int mode, int argc, const char *argv[], const size_t argl[])
 {
 	assert(peer != NULL);
 	assert(cmd != NULL);
@@ -90,6 +93,7 @@ cmd_help(struct cl_peer *peer, const char *cmd, int mode, int argc, const char *
 
 	(void) cmd;
 	(void) argv;
+	(void) argl;
 
 	if (argc != 0) {
 		cl_printf(peer, "invalid cardinality");
@@ -0,0 +1,15 @@
+/*
+ * Copyright 2012-2017 Katherine Flavel
+ *
+ * See LICENCE for the full copyright terms.
+ */
+
+/*
+ * routergen: router.c built without its compiled tree, to generate that
+ * tree from the same commands[] at build time. See main() in router.c.
+ */
+
+#define ROUTER_GEN
+
+#include "router.c"
+
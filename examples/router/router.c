@@ -23,11 +23,11 @@
 
 #include <assert.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
-#include <stdint.h>	/* XXX: C99, for SIZE_MAX */
 #include <limits.h>
 #include <errno.h>
 
@@ -39,15 +39,6 @@
 # define HAVE_SALEN
 #endif
 
-/* XXX: va_copy is C99; this workaround is not portable */
-#ifndef va_copy
-# if defined(__GNUC__) || defined(__clang__)
-#  define va_copy(dst, src) __builtin_va_copy(dst, src)
-# else
-#  define va_copy(dst, src) ((dst) = (src))
-# endif
-#endif
-
 #define MOTD "This is an example command server for libcl. Type help for help."
 
 #define USERNAME "alice"
@@ -55,6 +46,14 @@
 
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
+/* queued output per peer, past which we stop reading from it */
+#define OUTPUT_LIMIT 65536
+
+/* how often time passes for each peer, by cl_tick(), in milliseconds */
+#define TICK_MS 250
+
+#define HISTORY_DIR "."
+
 enum {
 	MODE_CONNECTED = 1 << 0,
 	MODE_DISABLED  = 1 << 1,
@@ -75,9 +74,16 @@ struct peer {
 	struct cl_peer *peer;
 	char item[32];
 
+	/* input cl_read() has yet to consume, see feed() */
+	char in[BUFSIZ];
+	size_t inoff;
+	size_t inlen;
+
 	struct peer *next;
 };
 
+#ifndef ROUTER_GEN
+
 static struct peer *
 addpeer(struct peer **peers, int fd, struct cl_peer *peer)
 {
@@ -93,8 +99,10 @@ addpeer(struct peer **peers, int fd, struct cl_peer *peer)
 		return NULL;
 	}
 
-	new->fd   = fd;
-	new->peer = peer;
+	new->fd    = fd;
+	new->peer  = peer;
+	new->inoff = 0;
+	new->inlen = 0;
 
 	new->next = *peers;
 	*peers = new;
@@ -118,6 +126,32 @@ findpeer(struct peer *peers, int fd)
 	return NULL;
 }
 
+/*
+ * cl_read() stops after a command which leaves more than OUTPUT_LIMIT
+ * queued; the rest of the input is kept, and given again once drained.
+ */
+static int
+feed(struct peer *q)
+{
+	ssize_t r;
+
+	assert(q != NULL);
+
+	while (q->inlen > 0 && cl_pending_output(q->peer) <= OUTPUT_LIMIT) {
+		r = cl_read(q->peer, q->in + q->inoff, q->inlen);
+		if (-1 == r) {
+			return -1;
+		}
+
+		q->inoff += r;
+		q->inlen -= r;
+	}
+
+	return 0;
+}
+
+#endif
+
 static int
 validate_name(struct cl_peer *p, int id, const char *value)
 {
@@ -156,7 +190,7 @@ motd(struct cl_peer *p)
 }
 
 static void
-cmd_motd(struct cl_peer *p, const char *cmd, int mode, int argc, const char *argv[])
+cmd_motd(struct cl_peer *p, const char *cmd, int mode, int argc, const char *argv[], const size_t argl[])
 {
 	assert(p != NULL);
 	assert(cmd != NULL);
@@ -169,6 +203,7 @@ cmd_motd(struct cl_peer *p, const char *cmd, int mode, int argc, const char *arg
 	(void) cmd;
 	(void) mode;
 	(void) argv;
+	(void) argl;
 
 	if (argc != 0) {
 		cl_printf(p, "invalid cardinality\n");
@@ -179,7 +214,7 @@ cmd_motd(struct cl_peer *p, const char *cmd, int mode, int argc, const char *arg
 }
 
 static void
-cmd_login(struct cl_peer *p, const char *cmd, int mode, int argc, const char *argv[])
+cmd_login(struct cl_peer *p, const char *cmd, int mode, int argc, const char *argv[], const size_t argl[])
 {
 	const char *user;
 	const char *pass;
@@ -196,6 +231,7 @@ cmd_login(struct cl_peer *p, const char *cmd, int mode, int argc, const char *ar
 	(void) cmd;
 	(void) mode;
 	(void) argv;
+	(void) argl;
 
 	if (argc != 0) {
 		cl_printf(p, "invalid cardinality\n");
@@ -211,6 +247,11 @@ cmd_login(struct cl_peer *p, const char *cmd, int mode, int argc, const char *ar
 	if (0 == strcmp(user, USERNAME) && 0 == strcmp(pass, PASSWORD)) {
 		cl_set_mode(p, MODE_DISABLED);
 		attempts = 0;
+
+		if (-1 == cl_set_history_key(p, user)) {
+			perror("cl_set_history_key");
+		}
+
 		return;
 	}
 
@@ -227,7 +268,7 @@ cmd_login(struct cl_peer *p, const char *cmd, int mode, int argc, const char *ar
 }
 
 static void
-cmd_enable(struct cl_peer *p, const char *cmd, int mode, int argc, const char *argv[])
+cmd_enable(struct cl_peer *p, const char *cmd, int mode, int argc, const char *argv[], const size_t argl[])
 {
 	const char *pass;
 	static int attempts;
@@ -243,6 +284,7 @@ cmd_enable(struct cl_peer *p, const char *cmd, int mode, int argc, const char *a
 	(void) cmd;
 	(void) mode;
 	(void) argv;
+	(void) argl;
 
 	if (argc != 0) {
 		cl_printf(p, "invalid cardinality\n");
@@ -270,7 +312,7 @@ cmd_enable(struct cl_peer *p, const char *cmd, int mode, int argc, const char *a
 }
 
 static void
-cmd_config_term(struct cl_peer *p, const char *cmd, int mode, int argc, const char *argv[])
+cmd_config_term(struct cl_peer *p, const char *cmd, int mode, int argc, const char *argv[], const size_t argl[])
 {
 	assert(p != NULL);
 	assert(cmd != NULL);
@@ -283,6 +325,7 @@ cmd_config_term(struct cl_peer *p, const char *cmd, int mode, int argc, const ch
 	(void) cmd;
 	(void) mode;
 	(void) argv;
+	(void) argl;
 
 	if (argc != 0) {
 		cl_printf(p, "invalid cardinality\n");
@@ -294,7 +337,7 @@ cmd_config_term(struct cl_peer *p, const char *cmd, int mode, int argc, const ch
 
 /* argv[] are arguments after the "enable" command: "enable x y z". nothing to do with fields */
 static void
-cmd_config(struct cl_peer *p, const char *cmd, int mode, int argc, const char *argv[])
+cmd_config(struct cl_peer *p, const char *cmd, int mode, int argc, const char *argv[], const size_t argl[])
 {
 	assert(p != NULL);
 	assert(cmd != NULL);
@@ -315,7 +358,7 @@ cmd_config(struct cl_peer *p, const char *cmd, int mode, int argc, const char *a
 		return;
 	}
 
-	assert(strlen(argv[0]) != 0);	/* because libcl doesn't permit "" here */
+	assert(argl[0] != 0);	/* because libcl doesn't permit "" here */
 
 	/* TODO: hacky to pass FIELD_USERNAME here */
 	if (!validate_name(p, FIELD_USERNAME, argv[0])) {
@@ -329,9 +372,9 @@ cmd_config(struct cl_peer *p, const char *cmd, int mode, int argc, const char *a
 
 		assert(peer != NULL);
 		assert(argv[0] != NULL);
-		assert(strlen(argv[0]) > 0);
+		assert(argl[0] > 0 && argl[0] <= INT_MAX);
 
-		snprintf(peer->item, sizeof peer->item, "%s", argv[0]);
+		snprintf(peer->item, sizeof peer->item, "%.*s", (int) argl[0], argv[0]);
 	}
 
 	switch (cmd[0]) {
@@ -342,7 +385,7 @@ cmd_config(struct cl_peer *p, const char *cmd, int mode, int argc, const char *a
 }
 
 static void
-cmd_exit(struct cl_peer *p, const char *cmd, int mode, int argc, const char *argv[])
+cmd_exit(struct cl_peer *p, const char *cmd, int mode, int argc, const char *argv[], const size_t argl[])
 {
 	assert(p != NULL);
 	assert(cmd != NULL);
@@ -353,6 +396,7 @@ cmd_exit(struct cl_peer *p, const char *cmd, int mode, int argc, const char *arg
 
 	(void) cmd;
 	(void) argv;
+	(void) argl;
 
 	if (argc != 0) {
 		cl_printf(p, "invalid cardinality\n");
@@ -373,7 +417,7 @@ cmd_exit(struct cl_peer *p, const char *cmd, int mode, int argc, const char *arg
 }
 
 static void
-cmd_help(struct cl_peer *p, const char *cmd, int mode, int argc, const char *argv[])
+cmd_help(struct cl_peer *p, const char *cmd, int mode, int argc, const char *argv[], const size_t argl[])
 {
 	assert(p != NULL);
 	assert(cmd != NULL);
@@ -384,6 +428,7 @@ cmd_help(struct cl_peer *p, const char *cmd, int mode, int argc, const char *arg
 
 	(void) cmd;
 	(void) argv;
+	(void) argl;
 
 	if (argc != 0) {
 		cl_printf(p, "invalid cardinality\n");
@@ -456,60 +501,59 @@ const struct cl_command commands[] = {
 	{ "help", ~0U, 0, cmd_help, NULL }
 };
 
-static int
-vpeerprintf(struct cl_peer *p, const char *fmt, va_list ap)
-{
-	struct peer *peer;
-	va_list ap1;
-	char a[1024];
-	char *buf = a;
-	int n;
-
-	assert(p != NULL);
-	assert(fmt != NULL);
+#ifdef ROUTER_GEN
 
-	peer = cl_get_opaque(p);
+/*
+ * Built as routergen (see gen.c), which writes the source for router_tree.
+ * router is linked with its output, and so never depends on a tree it made
+ * itself; cl_create_static() rejects a tree compiled from other commands.
+ */
+int
+main(void)
+{
+	struct cl_tree *tree;
 
-	assert(peer != NULL);
-	assert(peer->fd != -1);
+	tree = cl_create(sizeof commands / sizeof *commands, commands,
+		sizeof fields / sizeof *fields, fields,
+		NULL, motd, printprompt, cl_visible, NULL);
+	if (tree == NULL) {
+		perror("cl_create");
+		return 1;
+	}
 
-	/* XXX: va_copy is C99 */
-	/* XXX: also broken as an argument on macos/amd64 */
-	va_copy(ap1, ap);
+	if (-1 == cl_compile(tree, stdout, "router_tree", "commands")) {
+		perror("cl_compile");
+		return 1;
+	}
 
-	/* XXX: vsnprintf is C99 */
-	n = vsnprintf(a, sizeof a, fmt, ap);
+	cl_destroy(tree);
 
-	if (n == 0) {
-		return 0;
-	}
+	return 0;
+}
 
-	if (n > SSIZE_MAX) {
-		errno = EINVAL;
-		return -1;
-	}
+#else
 
-	assert(n != -1);
-	assert(n < SIZE_MAX);
-	assert(n < SSIZE_MAX);
+/* generated from commands[] by routergen, at build time */
+extern const struct cl_static router_tree;
 
-	if (n > sizeof a) {
-		buf = malloc(n + 1);
-		if (buf == NULL) {
-			return -1;
-		}
+static ssize_t
+peerwrite(struct cl_peer *p, const void *data, size_t len)
+{
+	struct peer *peer;
 
-		vsnprintf(buf, n + 1, fmt, ap1);
-		va_end(ap1);
-	}
+	assert(p != NULL);
+	assert(data != NULL);
 
-	n = (int) write(peer->fd, buf, n);
+	peer = cl_get_opaque(p);
 
-	if (buf != a) {
-		free(buf);
-	}
+	assert(peer != NULL);
+	assert(peer->fd != -1);
 
-	return n;
+	/*
+	 * libcl has done the formatting; this is a whole response at a time.
+	 * The socket is non-blocking, and libcl queues whatever isn't written.
+	 */
+	return write(peer->fd, data, len);
 }
 
 int
@@ -521,11 +565,21 @@ main(int argc, char **argv)
 	struct sockaddr_in sin;
 	struct cl_tree *tree;
 
-	tree = cl_create(sizeof commands / sizeof *commands, commands,
+	tree = cl_create_static(&router_tree,
+		sizeof commands / sizeof *commands, commands,
 		sizeof fields / sizeof *fields, fields,
-		NULL, motd, printprompt, cl_visible, vpeerprintf);
+		NULL, motd, printprompt, cl_visible, NULL);
 	if (tree == NULL) {
-		perror("cl_create");
+		perror("cl_create_static");
+		return 1;
+	}
+
+	cl_set_help(tree, CL_HELP_WORDS);
+	cl_set_write(tree, peerwrite);
+	cl_set_output_limit(tree, OUTPUT_LIMIT);
+
+	if (-1 == cl_set_history(tree, HISTORY_DIR, 0)) {
+		perror("cl_set_history");
 		return 1;
 	}
 
@@ -611,15 +665,63 @@ main(int argc, char **argv)
 
 		for (;;) {
 			int i;
-			fd_set curr;
+			fd_set curr, wr;
+			struct peer *q;
+			struct timeval tv;
 
 			curr = master;
+			FD_ZERO(&wr);
+
+			/*
+			 * Peers with output queued are waited on for writing, and those
+			 * with a good deal of it aren't read from until it has drained.
+			 */
+			for (q = peers; q != NULL; q = q->next) {
+				size_t n;
+
+				if (!FD_ISSET(q->fd, &master)) {
+					continue;
+				}
+
+				n = cl_pending_output(q->peer);
+
+				if (n > 0) {
+					FD_SET(q->fd, &wr);
+				}
+
+				if (n > OUTPUT_LIMIT || q->inlen > 0) {
+					FD_CLR(q->fd, &curr);
+				}
+			}
+
+			/* woken now and then even when idle, so that peers' waits expire */
+			tv.tv_sec  = 0;
+			tv.tv_usec = TICK_MS * 1000L;
+
+			if (-1 == select(maxfd + 1, &curr, &wr, NULL, &tv)) {
+				if (errno == EINTR) {
+					continue;
+				}
 
-			if (-1 == select(maxfd + 1, &curr, NULL, NULL, NULL)) {
 				perror("select");
 				return 1;
 			}
 
+			for (q = peers; q != NULL; q = q->next) {
+				if (!FD_ISSET(q->fd, &wr)) {
+					continue;
+				}
+
+				if (-1 == cl_writable(q->peer)) {
+					perror("cl_writable");
+
+					/* TODO: remove peer from peers ll */
+					FD_CLR(q->fd, &master);
+					FD_CLR(q->fd, &curr);
+					close(q->fd);
+				}
+			}
+
 			if (FD_ISSET(s, &curr)) {
 				struct cl_peer *peer;
 				struct peer *new;
@@ -630,6 +732,11 @@ main(int argc, char **argv)
 					return 1;
 				}
 
+				if (-1 == fcntl(i, F_SETFL, fcntl(i, F_GETFL) | O_NONBLOCK)) {
+					perror("fcntl");
+					return 1;
+				}
+
 				FD_SET(i, &master);
 				maxfd = MAX(maxfd, i);
 
@@ -656,14 +763,26 @@ main(int argc, char **argv)
 
 			for (i = 0; i <= maxfd; ++i) {
 				struct cl_peer *peer;
-				char buf[BUFSIZ];
 				ssize_t n;
 
 				if (i == s || !FD_ISSET(i, &curr)) {
 					continue;
 				}
 
-				n = read(i, buf, sizeof buf);
+				peer = findpeer(peers, i);
+
+				assert(peer != NULL);
+
+				q = cl_get_opaque(peer);
+
+				assert(q != NULL);
+				assert(q->inlen == 0);
+
+				n = read(i, q->in, sizeof q->in);
+				if (-1 == n && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+					continue;
+				}
+
 				if (-1 == n) {
 					perror("read");
 					FD_CLR(i, &master);
@@ -677,11 +796,10 @@ main(int argc, char **argv)
 					continue;
 				}
 
-				peer = findpeer(peers, i);
-
-				assert(peer != NULL);
+				q->inoff = 0;
+				q->inlen = (size_t) n;
 
-				if (-1 == cl_read(peer, buf, (size_t) n)) {
+				if (-1 == feed(q)) {
 					perror("cl_read");
 
 					/* TODO: remove peer from peers ll */
@@ -690,6 +808,34 @@ main(int argc, char **argv)
 					continue;
 				}
 			}
+
+			/*
+			 * For example, a telnet peer which never gives its terminal type
+			 * is given its motd and prompt once cl_set_ttype_timeout() passes.
+			 */
+			for (q = peers; q != NULL; q = q->next) {
+				if (!FD_ISSET(q->fd, &master)) {
+					continue;
+				}
+
+				if (-1 == cl_tick(q->peer)) {
+					perror("cl_tick");
+
+					/* TODO: remove peer from peers ll */
+					FD_CLR(q->fd, &master);
+					close(q->fd);
+					continue;
+				}
+
+				/* output may have drained by any of the above */
+				if (-1 == feed(q)) {
+					perror("cl_read");
+
+					/* TODO: remove peer from peers ll */
+					FD_CLR(q->fd, &master);
+					close(q->fd);
+				}
+			}
 		}
 	}
 
@@ -702,3 +848,5 @@ main(int argc, char **argv)
 	return 0;
 }
 
+#endif
+
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2012-2017 Katherine Flavel
+ *
+ * See LICENCE for the full copyright terms.
+ */
+
+#ifndef LIBCL_STATIC_H
+#define LIBCL_STATIC_H
+
+#include <stddef.h>
+
+/*
+ * The layout of a command tree, as emitted by cl_compile().
+ *
+ * This is exposed only so that the generated source may be compiled. It is
+ * not intended to be constructed or inspected by hand, and it may change
+ * between versions of libcl; generated trees must be regenerated to match.
+ */
+
+struct cl_command;
+
+struct cl_trie_command {
+	const struct cl_command *const *usage; /* in the order given */
+	size_t count;
+	int modes;
+};
+
+struct cl_trie_word {
+	const struct cl_trie *end; /* the node at which this word ends */
+	const char *s; /* not null terminated */
+	size_t len;
+};
+
+struct cl_trie {
+	const char *label; /* not null terminated */
+	unsigned short len;
+	unsigned short count;
+	const struct cl_trie *edge; /* count edges, ordered by first character */
+
+	const struct cl_trie_command *command;
+
+	/* per-mode tables, see tally() */
+	int modes; /* commands at or beneath this node */
+	int once;  /* exactly one word ending reachable within this word */
+	int many;  /* more than one */
+
+	/* word endings reachable from here within this word, see within() */
+	const struct cl_trie_word *word;
+	size_t word_count;
+};
+
+/*
+ * A compiled tree, for cl_create_static().
+ *
+ *  root          - The root of the trie.
+ *
+ *  command_count - The number of elements present in commands[].
+ *
+ *  commands      - The command specifications from which the tree was
+ *                  compiled. Nodes refer to elements of this array.
+ *
+ *  field_count   - The number of fields the tree was compiled with.
+ *
+ *  sum           - A checksum of the commands and fields the tree was
+ *                  compiled from, checked by cl_create_static().
+ */
+struct cl_static {
+	const struct cl_trie *root;
+	size_t command_count;
+	const struct cl_command *commands;
+	size_t field_count;
+	unsigned long sum;
+};
+
+#endif
@@ -8,9 +8,11 @@
 #define LIBCL_TREE_H
 
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <stddef.h>
 #include <stdarg.h>
+#include <stdio.h>
 
 /*
  * I/O protocol. This informs cl_read()'s parsing of bytes passed in.
@@ -32,6 +34,7 @@ enum cl_io {
 
 struct cl_peer;
 struct cl_tree;
+struct cl_static;
 
 /*
  * Specification of a single field. Each field has a unique ID, which must be a
@@ -115,10 +118,14 @@ struct cl_command {
 	 *  argv    - Argument vector. Each element is a string of a user-given argument
 	 *            following the command. These are vervatim as the user entered,
 	 *            but with whitespace trimmed.
+	 *            Storage persists until the callback returns.
+	 *
+	 *  argl    - Argument lengths. Each element is the length of the
+	 *            corresponding element in argv, excluding its terminator.
 	 *
  	 */
 	void (*callback)(struct cl_peer *p, const char *command, int mode,
-		int argc, const char *argv[]);
+		int argc, const char *argv[], const size_t argl[]);
 
 	const char *usage;
 };
@@ -169,6 +176,7 @@ struct cl_command {
  *                Typically this will involve application-specific data
  *                retrieved by cl_get_opaque(). Returns the number of bytes
  *                printed, or -1 on error.
+ *                May be NULL if a write callback is given by cl_set_write().
  *
  * Storage for the commands and fields arrays is required to persist until a
  * call to cl_destroy().
@@ -182,6 +190,124 @@ struct cl_tree *cl_create(size_t command_count, const struct cl_command commands
 	int (*vprintf)(struct cl_peer *p, const char *fmt, va_list ap));
 void cl_destroy(struct cl_tree *t);
 
+/*
+ * Construct a command tree from one compiled ahead of time by cl_compile().
+ * This behaves as cl_create(), except that no work is done to build the tree;
+ * the compiled tree is used in place, and is shared as read-only data between
+ * processes. cl_destroy() must still be called, but does not free the
+ * compiled tree.
+ *
+ *  st - The compiled tree, which refers to elements of the commands array.
+ *
+ * The remaining arguments are as for cl_create(). The compiled tree must
+ * have been generated from these same commands and fields, by the same
+ * version of libcl. A tree compiled from a different commands array, or
+ * from different commands or fields (for example, one not regenerated
+ * after commands[] was edited), is rejected with errno set to EINVAL.
+ */
+struct cl_tree *cl_create_static(const struct cl_static *st,
+	size_t command_count, const struct cl_command commands[],
+	size_t field_count, const struct cl_field fields[],
+	const char *(*ttype)(struct cl_peer *p),
+	int (*motd)(struct cl_peer *p),
+	int (*printprompt)(struct cl_peer *p, int mode),
+	int (*visible)(struct cl_peer *p, int mode, int modes),
+	int (*vprintf)(struct cl_peer *p, const char *fmt, va_list ap));
+
+/*
+ * Emit C source for a command tree, suitable for cl_create_static().
+ * This is intended to be run at build time, typically by a make target
+ * which regenerates the source whenever the commands array changes.
+ *
+ * Returns 0 on success, or -1 on error.
+ *
+ *  t        - A command tree constructed by cl_create().
+ *
+ *  f        - The stream to which the source is written.
+ *
+ *  name     - A C identifier for the struct cl_static defined by the source.
+ *
+ *  commands - The C identifier of the commands array given to cl_create().
+ *             This must have external linkage, as the generated source
+ *             refers to its elements.
+ */
+int cl_compile(const struct cl_tree *t, FILE *f, const char *name, const char *commands);
+
+/*
+ * Context help, as shown when the user presses '?' part-way through a line.
+ *
+ *  CL_HELP_COMMANDS - List every command beginning with the text entered
+ *                     so far. This is the default.
+ *
+ *  CL_HELP_WORDS    - List only the distinct words which may complete the
+ *                     current word, or which may follow it, in the style
+ *                     of router command lines. Each word is listed once,
+ *                     regardless of how many commands continue from it.
+ *
+ */
+enum cl_help {
+	CL_HELP_COMMANDS,
+	CL_HELP_WORDS
+};
+
+/*
+ * Set the style of context help for all peers of a command tree.
+ * See enum cl_help for details.
+ *
+ *  t    - The command tree.
+ *
+ *  help - The style of help.
+ *
+ */
+void cl_set_help(struct cl_tree *t, enum cl_help help);
+
+/*
+ * Set a callback to which output for all peers of a command tree is given
+ * as bytes, in place of the vprintf callback passed to cl_create(). Output is
+ * formatted by libcl into a buffer per peer, and handed over when flushed;
+ * see cl_flush(). This saves the application formatting anything itself.
+ *
+ * The callback is passed an arbitary sequence of bytes (i.e. not neccessarily
+ * a null-terminated string), in the spirit of write(2). It returns the number
+ * of bytes written, or -1 on error. As for a non-blocking write(2), it may
+ * write fewer bytes than given, or return -1 with errno set to EAGAIN; the
+ * remainder is queued, and sent on a later cl_flush() or cl_writable().
+ * The same applies to the vprintf callback.
+ *
+ *  t     - The command tree.
+ *
+ *  write - The callback, or NULL to use vprintf.
+ *
+ */
+void cl_set_write(struct cl_tree *t,
+	ssize_t (*write)(struct cl_peer *p, const void *data, size_t len));
+
+/*
+ * Keep command history in files, so that it persists across sessions.
+ * Each peer has its own history in memory until given a key by
+ * cl_set_history_key(), from then on its history is kept in the file of
+ * that name in the given directory, and shared with every other session
+ * given the same key (typically the user's name).
+ *
+ * The file is mapped into memory, and so opening it does no reading.
+ * Commands are appended as they are entered, and the file is written back
+ * to disk periodically, without ever waiting for it. The file does not grow
+ * past the given size; when full, the older half of its history is dropped.
+ * An existing file keeps the size it was created with.
+ *
+ * Returns 0, or -1 on error.
+ *
+ *  t    - The command tree.
+ *
+ *  dir  - The directory in which history files are kept, or NULL for none.
+ *         The directory is required to exist.
+ *
+ *  size - The size of each history file in bytes, or 0 for the least
+ *         permitted (16KiB).
+ *
+ */
+int cl_set_history(struct cl_tree *t, const char *dir, size_t size);
+
 /*
  * Accept a new peer. This is an analogue of POSIX's accept(2) on a listening
  * socket. A new peer instance is returned, or NULL on error.
@@ -202,7 +328,19 @@ void cl_destroy(struct cl_tree *t);
  *
  */
 struct cl_peer *cl_accept(struct cl_tree *t, enum cl_io io);
-void cl_close(struct cl_peer *p);
+
+/*
+ * Close a peer, freeing its resources. Output still queued for the peer is
+ * first sent by cl_flush(), so the write callback may be called from here.
+ * The peer is closed regardless; whatever cannot be sent is dropped.
+ *
+ * Returns 0, or -1 with errno set if queued output could not all be sent.
+ * errno is EAGAIN if the write would have blocked.
+ *
+ *  p - The peer to close. p is freed, whether or not an error is returned.
+ *
+ */
+int cl_close(struct cl_peer *p);
 
 /*
  * Indicate a peer is ready to perform I/O. This is required to be called after
@@ -215,6 +353,22 @@ void cl_close(struct cl_peer *p);
  */
 int cl_ready(struct cl_peer *p);
 
+/*
+ * Move a peer's command history to the file for the given key, in the
+ * directory given to cl_set_history(). Commands entered so far are carried
+ * over. This would typically be called once a user has logged in.
+ *
+ * Returns 0, or -1 on error, with errno set. The peer keeps its history in
+ * memory if the file cannot be opened.
+ *
+ *  p   - The peer.
+ *
+ *  key - The name of the history file. It may not contain a slash, or
+ *        begin with a dot.
+ *
+ */
+int cl_set_history_key(struct cl_peer *p, const char *key);
+
 /*
  * Associate and retrieve application-specific data with a peer. This pointer is
  * passed opaquely through the API. It is intended to be retrieved within
@@ -242,10 +396,19 @@ const char *cl_get_field(struct cl_peer *p, int id);
 /*
  * Print to the user.
  *
- * This will cause an arbitary number of calls (possibly none) to the vprintf
- * callback passed to cl_create().
+ * Output is formatted into a buffer per peer, and passed to the write callback
+ * given to cl_set_write() (or else the vprintf callback given to cl_create())
+ * when flushed. See cl_flush().
+ *
+ * Within a command's callback, when the user gave output filters after the
+ * command (for example "show log | include error | count"), printed text is
+ * filtered a line at a time before it is sent. Available filters are
+ * "include <regex>", "exclude <regex>", "begin <regex>" and "count",
+ * which may be abbreviated. Patterns are POSIX extended regular expressions.
+ * A line is held only until its newline, or until the callback returns.
  *
  * Returns the number of bytes successfully printed, or -1 on error.
+ * For filtered output, this counts the bytes given, whether sent or not.
  *
  *  p        - The peer to which to print.
  *
@@ -255,6 +418,27 @@ const char *cl_get_field(struct cl_peer *p, int id);
 int cl_vprintf(struct cl_peer *p, const char *fmt, va_list ap);
 int cl_printf(struct cl_peer *p, const char *fmt, ...);
 
+/*
+ * Write bytes to the user, as for cl_printf(), but without formatting.
+ * The data is an arbitary sequence of bytes, which may include '\0'.
+ *
+ * Small writes are buffered with other output. Large writes are passed on
+ * from the caller's storage when flushed, rather than being copied.
+ *
+ * Returns the number of bytes successfully written, or -1 on error.
+ *
+ *  p      - The peer to which to write.
+ *
+ *  data   - A pointer to the first byte of a sequence of len bytes to write.
+ *
+ *  len    - The number of bytes to write.
+ *
+ *  iov    - An array of iovcnt buffers, written in order, as per writev(2).
+ *
+ */
+ssize_t cl_write(struct cl_peer *p, const void *data, size_t len);
+ssize_t cl_writev(struct cl_peer *p, const struct iovec *iov, int iovcnt);
+
 /*
  * Pass a sequence of incoming bytes from the user to libcl for reading.
  * The bytes passed are an arbitary sequence (i.e. not neccessarily a
@@ -265,6 +449,13 @@ int cl_printf(struct cl_peer *p, const char *fmt, ...);
  * If enough data is given to complete a command, cl_read() guarentees to
  * consume the entire byte sequence representing that command.
  *
+ * While more output is queued for the peer than the limit given by
+ * cl_set_output_limit(), no input is consumed and 0 is returned. A read
+ * which runs a command leaving the queue past that limit stops after the
+ * command, and returns the number of bytes consumed up to there. Either
+ * way, the application should keep the rest of the data, and give it again
+ * once cl_writable() has drained the queue. See cl_pending_output().
+ *
  *  p    - The peer responsible for instantiating this call.
  *
  *  data - A pointer to the first byte of a sequence of len bytes to consume.
@@ -275,6 +466,95 @@ int cl_printf(struct cl_peer *p, const char *fmt, ...);
  */
 ssize_t cl_read(struct cl_peer *p, const void *data, size_t len);
 
+/*
+ * Send any output buffered for a peer, by way of the write callback given to
+ * cl_set_write(), or else the vprintf callback passed to cl_create(). This is
+ * typically one call, but a large amount of output may be passed in several.
+ *
+ * Output is flushed automatically after each command's response and its
+ * prompt, and before returning from cl_ready() and cl_read(). Applications
+ * need only call cl_flush() after printing to a peer by cl_printf() outside
+ * of those, for example for asynchronous notifications.
+ *
+ * Returns the number of bytes written, or -1 on error.
+ *
+ *  p - The peer to flush.
+ *
+ */
+int cl_flush(struct cl_peer *p);
+
+/*
+ * Indicate that a peer's connection may be written to again, after the write
+ * (or vprintf) callback would have blocked. Queued output is sent, as far as
+ * the callback will accept it.
+ *
+ * This is intended for use with a non-blocking event loop: while
+ * cl_pending_output() is non-zero, wait for the connection to become
+ * writable, and then call cl_writable().
+ *
+ * Returns 0, or -1 on error.
+ *
+ *  p - The peer which is writable.
+ *
+ */
+int cl_writable(struct cl_peer *p);
+
+/*
+ * Returns the number of bytes of output queued for a peer, which have yet to
+ * be accepted by the write (or vprintf) callback.
+ *
+ *  p - The peer.
+ *
+ */
+size_t cl_pending_output(struct cl_peer *p);
+
+/*
+ * Set the number of bytes of output which may be queued for each peer of a
+ * command tree before cl_read() stops consuming input from that peer. The
+ * default is 64KiB.
+ *
+ * This is not a limit on the size of the queue: output is never discarded,
+ * and a command's callback may queue more than this. Rather, no further
+ * commands are read (and so no further output is made) until the queue has
+ * drained below the limit.
+ *
+ *  t     - The command tree.
+ *
+ *  limit - The number of bytes.
+ *
+ */
+void cl_set_output_limit(struct cl_tree *t, size_t limit);
+
+/*
+ * Set how long to wait for a telnet peer to give its terminal type, for all
+ * peers of a command tree. The motd and first prompt wait on the answer, and
+ * input given meanwhile is held until then (up to a small bound). A peer
+ * which refuses or does not answer in time is given the terminal type from
+ * the ttype callback passed to cl_create() instead. The default is two
+ * seconds.
+ *
+ * The wait is timed out by cl_tick() or cl_read(), whichever comes first.
+ *
+ *  t  - The command tree.
+ *
+ *  ms - The time to wait in milliseconds, or 0 to wait indefinitely.
+ *
+ */
+void cl_set_ttype_timeout(struct cl_tree *t, unsigned ms);
+
+/*
+ * Let time pass for a peer. Applications are to call this periodically for
+ * each peer (say, every few hundred milliseconds, when their event loop is
+ * otherwise idle), so that waits such as for cl_set_ttype_timeout() expire
+ * even when no input comes. Any output made as a result is flushed.
+ *
+ * Returns 0, or -1 on error.
+ *
+ *  p - The peer.
+ *
+ */
+int cl_tick(struct cl_peer *p);
+
 /*
  * Change the current mode for a given peer.
  *
@@ -313,17 +593,23 @@ void cl_again(struct cl_peer *p);
  * intended to provide a mechanism for requesting help on specific topics, e.g.
  * by way of a "help such-and-such" command.
  *
+ * Returns 0, or -1 on error, with errno set.
+ *
  *  p    - The peer responsible for instantiating this call.
  *
  *  mode - An application-specific mode.
  *
  */
-void cl_help(struct cl_peer *p, int mode);
+int cl_help(struct cl_peer *p, int mode);
 
 /*
  * Returns true if the given single-bit mode is within a set of modes masked
  * together. This function is provided for convenience, suitable for use as
  * cl_create()'s visible() callback. See cl_create() for details.
+ *
+ * When given as the visible() callback, abbreviated words are resolved from
+ * per-mode tables computed by cl_create(), rather than by searching the tree.
+ * This requires the mode passed to cl_set_mode() to be a single bit.
  */
 int cl_visible(struct cl_peer *p, int mode, int modes);
 
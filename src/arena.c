@@ -0,0 +1,152 @@
+/*
+ * Copyright 2012-2017 Katherine Flavel
+ *
+ * See LICENCE for the full copyright terms.
+ */
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "internal.h"
+
+/*
+ * Storage for the duration of one command: its arguments, argv and field
+ * values. Allocations are taken in order from a block, and all released
+ * together by arena_reset(). Blocks are never moved, so pointers remain
+ * valid until the reset.
+ *
+ * When one block does not suffice, another is chained on. The next reset
+ * replaces the chain with a single block large enough for the lot, so once
+ * a peer has seen its largest command, no further allocation is made.
+ */
+
+union align {
+	long l;
+	double d;
+	void *p;
+	void (*f)(void);
+};
+
+struct block {
+	struct block *next;
+	size_t size;
+	size_t used;
+	union align data[1];
+};
+
+struct arena {
+	struct block *head;
+};
+
+static struct block *
+block_create(size_t size)
+{
+	struct block *new;
+
+	new = malloc(offsetof(struct block, data) + size);
+	if (new == NULL) {
+		return NULL;
+	}
+
+	new->next = NULL;
+	new->size = size;
+	new->used = 0;
+
+	return new;
+}
+
+struct arena *
+arena_create(void)
+{
+	struct arena *new;
+
+	new = malloc(sizeof *new);
+	if (new == NULL) {
+		return NULL;
+	}
+
+	new->head = NULL;
+
+	return new;
+}
+
+void
+arena_destroy(struct arena *a)
+{
+	struct block *b, *next;
+
+	assert(a != NULL);
+
+	for (b = a->head; b != NULL; b = next) {
+		next = b->next;
+		free(b);
+	}
+
+	free(a);
+}
+
+void *
+arena_alloc(struct arena *a, size_t n)
+{
+	const size_t blocksz = 256;
+	struct block *b;
+	void *p;
+
+	assert(a != NULL);
+
+	n = (n + sizeof (union align) - 1) / sizeof (union align) * sizeof (union align);
+
+	b = a->head;
+
+	if (b == NULL || b->size - b->used < n) {
+		size_t size;
+
+		size = b == NULL ? blocksz : b->size * 2;
+		if (size < n) {
+			size = n;
+		}
+
+		b = block_create(size);
+		if (b == NULL) {
+			return NULL;
+		}
+
+		b->next = a->head;
+		a->head = b;
+	}
+
+	p = (char *) b->data + b->used;
+	b->used += n;
+
+	return p;
+}
+
+void
+arena_reset(struct arena *a)
+{
+	struct block *b, *next;
+	size_t size;
+
+	assert(a != NULL);
+
+	if (a->head == NULL) {
+		return;
+	}
+
+	if (a->head->next == NULL) {
+		a->head->used = 0;
+		return;
+	}
+
+	size = 0;
+
+	for (b = a->head; b != NULL; b = next) {
+		next = b->next;
+		size += b->size;
+		free(b);
+	}
+
+	/* if this fails, we'll try again on the next arena_alloc() */
+	a->head = block_create(size);
+}
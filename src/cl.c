@@ -7,13 +7,16 @@
 #define _POSIX_SOURCE
 
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <cl/tree.h>
+#include <cl/static.h>
 
 #include <assert.h>
 #include <stddef.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <limits.h>
 
@@ -53,7 +56,8 @@ findchain(enum cl_io io)
 }
 
 struct cl_tree *
-cl_create(size_t command_count, const struct cl_command commands[],
+cl_create_static(const struct cl_static *st,
+	size_t command_count, const struct cl_command commands[],
 	size_t field_count, const struct cl_field fields[],
 	const char *(*ttype)(struct cl_peer *p),
 	int (*motd)(struct cl_peer *p),
@@ -61,50 +65,113 @@ cl_create(size_t command_count, const struct cl_command commands[],
 	int (*visible)(struct cl_peer *p, int mode, int modes),
 	int (*vprintf)(struct cl_peer *p, const char *fmt, va_list ap))
 {
-	size_t i;
 	struct cl_tree *new;
+	size_t i;
 
-	/* TODO: assert(command_count < SIZE_MAX); */
+	assert(st != NULL);
+	assert(st->root != NULL);
+	assert((st->command_count == 0) == (st->commands == NULL));
 	assert((command_count == 0) == (commands == NULL));
 	assert((field_count   == 0) == (fields   == NULL));
 	assert(printprompt != NULL);
 
+	/* a tree compiled from anything else would refer to the wrong commands */
+	if (st->command_count != command_count || st->commands != commands
+	|| st->field_count != field_count
+	|| st->sum != compile_sum(command_count, commands, field_count, fields)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
 	new = malloc(sizeof *new);
 	if (new == NULL) {
 		return NULL;
 	}
 
-	new->root          = NULL;
+	new->root          = st->root;
+	new->trie          = NULL;
 	new->ttype         = ttype;
 	new->motd          = motd;
 	new->printprompt   = printprompt;
 	new->visible       = visible;
 	new->vprintf       = vprintf;
+	new->write         = NULL;
+	new->output_limit  = 65536;
+	new->ttype_timeout = 2000;
+	new->helpmode      = CL_HELP_COMMANDS;
+	new->histdir       = NULL;
+	new->histsize      = 0;
 
 	new->commands      = commands;
 	new->command_count = command_count;
 	new->fields        = fields;
 	new->field_count   = field_count;
 
-	for (i = 0; i < command_count; i++) {
-		struct trie *node;
+	for (i = 0; i < sizeof new->help / sizeof *new->help; i++) {
+		new->help[i].trie = NULL;
+		new->help[i].s    = NULL;
+	}
 
-		/* things to assert about .command: does not start with space;
-		 * all alnum or ' '; all isprint; no non-' ' whitespace; is not empty */
-		node = trie_add(&new->root, commands[i].command, &commands[i]);
-		if (node == NULL) {
-			cl_destroy(new);
-			return NULL;
-		}
+	return new;
+}
+
+struct cl_tree *
+cl_create(size_t command_count, const struct cl_command commands[],
+	size_t field_count, const struct cl_field fields[],
+	const char *(*ttype)(struct cl_peer *p),
+	int (*motd)(struct cl_peer *p),
+	int (*printprompt)(struct cl_peer *p, int mode),
+	int (*visible)(struct cl_peer *p, int mode, int modes),
+	int (*vprintf)(struct cl_peer *p, const char *fmt, va_list ap))
+{
+	struct cl_static st;
+	struct cl_tree *new;
+	struct cl_trie *trie;
+
+	/* TODO: assert(command_count < SIZE_MAX); */
+	assert((command_count == 0) == (commands == NULL));
+
+	trie = trie_create(command_count, commands);
+	if (trie == NULL) {
+		return NULL;
 	}
 
+	st.root          = trie;
+	st.command_count = command_count;
+	st.commands      = commands;
+	st.field_count   = field_count;
+	st.sum           = compile_sum(command_count, commands, field_count, fields);
+
+	new = cl_create_static(&st, command_count, commands, field_count, fields,
+		ttype, motd, printprompt, visible, vprintf);
+	if (new == NULL) {
+		trie_destroy(trie);
+		return NULL;
+	}
+
+	new->trie = trie;
+
 	return new;
 }
 
 void
 cl_destroy(struct cl_tree *t)
 {
-	(void) t;
+	size_t i;
+
+	assert(t != NULL);
+	assert(t->root != NULL);
+
+	for (i = 0; i < sizeof t->help / sizeof *t->help; i++) {
+		free(t->help[i].s);
+	}
+
+	if (t->trie != NULL) {
+		trie_destroy(t->trie);
+	}
+
+	free(t->histdir);
+	free(t);
 }
 
 struct cl_peer *
@@ -147,12 +214,33 @@ cl_accept(struct cl_tree *t, enum cl_io io)
 		return NULL;
 	}
 
+	new->fctx = filter_create();
+	if (new->fctx == NULL) {
+		free(new->chctx);
+		read_destroy(new->rctx);
+		edit_destroy(new->ectx);
+		free(new);
+		return NULL;
+	}
+
+	new->hctx = hist_create();
+	if (new->hctx == NULL) {
+		free(new->chctx);
+		read_destroy(new->rctx);
+		edit_destroy(new->ectx);
+		filter_destroy(new->fctx);
+		free(new);
+		return NULL;
+	}
+
 	new->tree   = t;
 	new->mode   = 0;
 	new->ttype  = NULL;
 	new->tctx   = NULL;
 	new->opaque = NULL;
 
+	new->stalled = 0;
+
 	for (i = 0; i < new->chain->n; i++) {
 		new->chctx[i].ioapi = new->chain->ioapi[i];
 		new->chctx[i].ioctx = NULL;
@@ -178,6 +266,8 @@ cl_ready(struct cl_peer *p)
 	 * chain through when they are ready, which may not happen within this .create() call.
 	 * eg. for telnet's case, on cl_read()ing in data (hopefully with TTYPE present) */
 
+	assert(p->tree->vprintf != NULL || p->tree->write != NULL);
+
 	tail = &p->chctx[p->chain->n - 1];
 
 	assert(tail->ioapi != NULL);
@@ -187,21 +277,36 @@ cl_ready(struct cl_peer *p)
 		return -1;
 	}
 
+	if (-1 == cl_flush(p)) {
+		return -1;
+	}
+
 	return 0;
 }
 
-void
+int
 cl_close(struct cl_peer *p)
 {
 	struct cl_chctx *head;
+	int r;
 
 	assert(p != NULL);
-	assert(p->tctx != NULL);
 	assert(p->rctx != NULL);
+	assert(p->ectx != NULL);
 	assert(p->chain != NULL);
 
-	term_destroy(p->tctx);
+	/* sent while the peer is whole; io_end drops whatever is left */
+	r = cl_flush(p);
+	if (r != -1 && cl_pending_output(p) > 0) {
+		errno = EAGAIN;
+		r = -1;
+	}
+
+	/* p->tctx is destroyed by io_start */
 	read_destroy(p->rctx);
+	edit_destroy(p->ectx);
+	filter_destroy(p->fctx);
+	hist_destroy(p->hctx);
 
 	head = &p->chctx[0];
 
@@ -212,6 +317,8 @@ cl_close(struct cl_peer *p)
 
 	free(p->chctx);
 	free(p);
+
+	return r == -1 ? -1 : 0;
 }
 
 void
@@ -260,6 +367,11 @@ cl_vprintf(struct cl_peer *p, const char *fmt, va_list ap)
 	assert(head->ioapi != NULL);
 	assert(head->ioapi->vprintf != NULL);
 
+	/* output from a command given with filters */
+	if (filter_active(p->fctx)) {
+		return filter_vprintf(p, fmt, ap);
+	}
+
 	return head->ioapi->vprintf(p, head, fmt, ap);
 }
 
@@ -272,7 +384,6 @@ cl_printf(struct cl_peer *p, const char *fmt, ...)
 	assert(p != NULL);
 	assert(p->tctx != NULL);
 	assert(p->tree != NULL);
-	assert(p->tree->vprintf != NULL);
 	assert(fmt != NULL);
 
 	va_start(ap, fmt);
@@ -282,10 +393,70 @@ cl_printf(struct cl_peer *p, const char *fmt, ...)
 	return n;
 }
 
+ssize_t
+cl_write(struct cl_peer *p, const void *data, size_t len)
+{
+	struct cl_chctx *head;
+
+	assert(p != NULL);
+	assert(p->tctx != NULL);
+	assert(data != NULL || len == 0);
+
+	if (filter_active(p->fctx)) {
+		return filter_write(p, data, len);
+	}
+
+	head = &p->chctx[0];
+
+	assert(head->ioapi != NULL);
+	assert(head->ioapi->write != NULL);
+
+	return head->ioapi->write(p, head, data, len);
+}
+
+ssize_t
+cl_writev(struct cl_peer *p, const struct iovec *iov, int iovcnt)
+{
+	struct cl_chctx *head;
+	ssize_t n, r;
+	int i;
+
+	assert(p != NULL);
+	assert(p->tctx != NULL);
+	assert(iov != NULL || iovcnt == 0);
+
+	if (filter_active(p->fctx)) {
+		n = 0;
+
+		for (i = 0; i < iovcnt; i++) {
+			if (iov[i].iov_len > (size_t) (SSIZE_MAX - n)) {
+				break;
+			}
+
+			r = filter_write(p, iov[i].iov_base, iov[i].iov_len);
+			if (r == -1) {
+				return -1;
+			}
+
+			n += r;
+		}
+
+		return n;
+	}
+
+	head = &p->chctx[0];
+
+	assert(head->ioapi != NULL);
+	assert(head->ioapi->writev != NULL);
+
+	return head->ioapi->writev(p, head, iov, iovcnt);
+}
+
 ssize_t
 cl_read(struct cl_peer *p, const void *data, size_t len)
 {
 	struct cl_chctx *tail;
+	ssize_t n;
 
 	assert(p != NULL);
 	assert(p->tree != NULL);
@@ -297,12 +468,179 @@ cl_read(struct cl_peer *p, const void *data, size_t len)
 		return 0;
 	}
 
+	/* backpressure; the application is to try again after cl_writable() */
+	if (cl_pending_output(p) > p->tree->output_limit) {
+		return 0;
+	}
+
+	/* the layers end the read early when set, by getc_main() */
+	p->stalled = 0;
+
 	tail = &p->chctx[p->chain->n - 1];
 
 	assert(tail->ioapi != NULL);
 	assert(tail->ioapi->read != NULL);
 
-	return tail->ioapi->read(p, tail, data, len);
+	n = tail->ioapi->read(p, tail, data, len);
+
+	/* echo for whatever was typed, and anything printed along the way */
+	if (-1 == cl_flush(p)) {
+		return -1;
+	}
+
+	return n;
+}
+
+int
+cl_flush(struct cl_peer *p)
+{
+	struct cl_chctx *head;
+
+	assert(p != NULL);
+	assert(p->chctx != NULL);
+
+	head = &p->chctx[0];
+
+	assert(head->ioapi != NULL);
+	assert(head->ioapi->flush != NULL);
+
+	return head->ioapi->flush(p, head);
+}
+
+int
+cl_writable(struct cl_peer *p)
+{
+	assert(p != NULL);
+
+	if (-1 == cl_flush(p)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+size_t
+cl_pending_output(struct cl_peer *p)
+{
+	struct cl_chctx *head;
+
+	assert(p != NULL);
+	assert(p->chctx != NULL);
+
+	head = &p->chctx[0];
+
+	assert(head->ioapi != NULL);
+	assert(head->ioapi->pending != NULL);
+
+	return head->ioapi->pending(p, head);
+}
+
+void
+cl_set_output_limit(struct cl_tree *t, size_t limit)
+{
+	assert(t != NULL);
+
+	t->output_limit = limit;
+}
+
+void
+cl_set_ttype_timeout(struct cl_tree *t, unsigned ms)
+{
+	assert(t != NULL);
+
+	t->ttype_timeout = ms;
+}
+
+int
+cl_tick(struct cl_peer *p)
+{
+	struct cl_chctx *head;
+
+	assert(p != NULL);
+	assert(p->chctx != NULL);
+
+	head = &p->chctx[0];
+
+	assert(head->ioapi != NULL);
+	assert(head->ioapi->tick != NULL);
+
+	if (-1 == head->ioapi->tick(p, head)) {
+		return -1;
+	}
+
+	/* a peer may have become ready, with its motd and prompt to send */
+	if (-1 == cl_flush(p)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+cl_set_history(struct cl_tree *t, const char *dir, size_t size)
+{
+	char *s;
+
+	assert(t != NULL);
+
+	s = NULL;
+
+	if (dir != NULL) {
+		s = malloc(strlen(dir) + 1);
+		if (s == NULL) {
+			return -1;
+		}
+
+		strcpy(s, dir);
+	}
+
+	free(t->histdir);
+
+	t->histdir  = s;
+	t->histsize = size;
+
+	return 0;
+}
+
+int
+cl_set_history_key(struct cl_peer *p, const char *key)
+{
+	char *path;
+	size_t n;
+	int r;
+
+	assert(p != NULL);
+	assert(p->tree != NULL);
+	assert(p->hctx != NULL);
+	assert(key != NULL);
+
+	if (p->tree->histdir == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* the key names a file in the directory, and nothing else */
+	if (*key == '\0' || *key == '.' || strchr(key, '/') != NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	n = strlen(p->tree->histdir);
+
+	path = malloc(n + 1 + strlen(key) + 1);
+	if (path == NULL) {
+		return -1;
+	}
+
+	strcpy(path, p->tree->histdir);
+	path[n] = '/';
+	strcpy(path + n + 1, key);
+
+	r = hist_open(p->hctx, path, p->tree->histsize);
+
+	free(path);
+
+	return r;
 }
 
 void
@@ -313,19 +651,36 @@ cl_set_mode(struct cl_peer *p, int mode)
 	p->mode = mode;
 }
 
+void
+cl_set_write(struct cl_tree *t,
+	ssize_t (*write)(struct cl_peer *p, const void *data, size_t len))
+{
+	assert(t != NULL);
+
+	t->write = write;
+}
+
+void
+cl_set_help(struct cl_tree *t, enum cl_help help)
+{
+	assert(t != NULL);
+
+	t->helpmode = help;
+}
+
 void
 cl_again(struct cl_peer *p)
 {
 	(void) p;
 }
 
-void
+int
 cl_help(struct cl_peer *p, int mode)
 {
 	assert(p != NULL);
 	assert(p->tree != NULL);
 
-	trie_help(p, p->tree->root, mode);
+	return trie_help(p, p->tree->root, mode);
 }
 
 /* You don't have to use this; if you provide your own then your modes needn't
@@ -0,0 +1,361 @@
+/*
+ * Copyright 2012-2017 Katherine Flavel
+ *
+ * See LICENCE for the full copyright terms.
+ */
+
+#include <cl/tree.h>
+#include <cl/static.h>
+
+#include <assert.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "internal.h"
+
+static size_t
+count(const struct cl_trie *trie)
+{
+	size_t i, n;
+
+	assert(trie != NULL);
+
+	n = 1;
+
+	for (i = 0; i < trie->count; i++) {
+		n += count(&trie->edge[i]);
+	}
+
+	return n;
+}
+
+static void
+str(FILE *f, const char *s, size_t len)
+{
+	size_t i;
+
+	assert(f != NULL);
+	assert(s != NULL);
+
+	fprintf(f, "\n\t\"");
+
+	for (i = 0; i < len; i++) {
+		unsigned char c = s[i];
+
+		if (c == '\"' || c == '\\' || c < ' ' || c > '~') {
+			fprintf(f, "\\%03o", c);
+		} else {
+			fprintf(f, "%c", c);
+		}
+	}
+
+	fprintf(f, "\"");
+}
+
+static void
+mode(FILE *f, int modes)
+{
+	assert(f != NULL);
+
+	if (modes == INT_MIN) {
+		fprintf(f, "INT_MIN");
+	} else {
+		fprintf(f, "%d", modes);
+	}
+}
+
+/* FNV-1a, 32 bits; integers by value, so as not to depend on the host */
+static unsigned long
+fnv(unsigned long h, const char *s, size_t n)
+{
+	size_t i;
+
+	assert(s != NULL || n == 0);
+
+	for (i = 0; i < n; i++) {
+		h ^= (unsigned char) s[i];
+		h  = (h * 16777619UL) & 0xffffffffUL;
+	}
+
+	return h;
+}
+
+static unsigned long
+fnv_int(unsigned long h, int v)
+{
+	char b[4];
+	unsigned u;
+
+	u = (unsigned) v;
+
+	b[0] = (char) (u       & 0xff);
+	b[1] = (char) (u >>  8 & 0xff);
+	b[2] = (char) (u >> 16 & 0xff);
+	b[3] = (char) (u >> 24 & 0xff);
+
+	return fnv(h, b, sizeof b);
+}
+
+/*
+ * A checksum of everything a compiled tree is built from: each command's
+ * words, modes and fields, and each field's ID and name. Usage text and
+ * callbacks are read from the commands array at runtime, and so may
+ * differ freely.
+ */
+unsigned long
+compile_sum(size_t command_count, const struct cl_command commands[],
+	size_t field_count, const struct cl_field fields[])
+{
+	unsigned long h;
+	size_t i;
+
+	assert((command_count == 0) == (commands == NULL));
+	assert((field_count   == 0) == (fields   == NULL));
+
+	h = 2166136261UL;
+
+	for (i = 0; i < command_count; i++) {
+		assert(commands[i].command != NULL);
+
+		h = fnv(h, commands[i].command, strlen(commands[i].command) + 1);
+		h = fnv_int(h, commands[i].modes);
+		h = fnv_int(h, commands[i].fields);
+	}
+
+	for (i = 0; i < field_count; i++) {
+		assert(fields[i].name != NULL);
+
+		h = fnv_int(h, fields[i].id);
+		h = fnv(h, fields[i].name, strlen(fields[i].name) + 1);
+	}
+
+	return h;
+}
+
+/*
+ * Nodes are emitted breadth-first from a queue, so that each node's edges
+ * are contiguous, as the trie requires. Labels, commands and usages are
+ * numbered in the same order, which lets every reference be computed in
+ * one pass.
+ *
+ * Words are emitted in their existing order, since each node refers to a
+ * run of them. Both built and compiled tries keep their nodes in a single
+ * array beginning at the root, so the root gives a node's position in the
+ * original, and the queue gives its position as emitted.
+ */
+int
+cl_compile(const struct cl_tree *t, FILE *f, const char *name, const char *commands)
+{
+	const struct cl_trie **q;
+	const struct cl_trie_word *w;
+	size_t *order;
+	size_t i, j, n;
+	size_t label, edge, command, usage, words, text;
+
+	assert(t != NULL);
+	assert(t->root != NULL);
+	assert(f != NULL);
+	assert(name != NULL);
+	assert(commands != NULL);
+
+	n = count(t->root);
+
+	q = malloc(sizeof *q * n);
+	if (q == NULL) {
+		return -1;
+	}
+
+	order = malloc(sizeof *order * n);
+	if (order == NULL) {
+		free(q);
+		return -1;
+	}
+
+	q[0] = t->root;
+
+	for (i = 0, j = 1; i < n; i++) {
+		size_t k;
+
+		for (k = 0; k < q[i]->count; k++) {
+			q[j++] = &q[i]->edge[k];
+		}
+	}
+
+	assert(j == n);
+
+	/* every ending belongs to the region for exactly one word */
+	for (i = 0, words = 0; i < n; i++) {
+		assert(q[i] >= t->root && q[i] < t->root + n);
+
+		order[q[i] - t->root] = i;
+
+		if (i == 0 || q[i]->label[0] == ' ') {
+			words += q[i]->word_count;
+		}
+	}
+
+	w = t->root->word;
+
+	fprintf(f, "/* generated by cl_compile(); do not edit */\n");
+	fprintf(f, "\n");
+	fprintf(f, "#include <limits.h>\n");
+	fprintf(f, "#include <stddef.h>\n");
+	fprintf(f, "\n");
+	fprintf(f, "#include <cl/tree.h>\n");
+	fprintf(f, "#include <cl/static.h>\n");
+	fprintf(f, "\n");
+	fprintf(f, "extern const struct cl_command %s[];\n", commands);
+	fprintf(f, "\n");
+
+	fprintf(f, "static const char %s_label[] =", name);
+
+	for (i = 0; i < n; i++) {
+		if (q[i]->len == 0) {
+			continue;
+		}
+
+		str(f, q[i]->label, q[i]->len);
+	}
+
+	fprintf(f, "\n\t\"\";\n");
+	fprintf(f, "\n");
+
+	fprintf(f, "static const char %s_text[] =", name);
+
+	for (i = 0; i < words; i++) {
+		if (w[i].len == 0) {
+			continue;
+		}
+
+		str(f, w[i].s, w[i].len);
+	}
+
+	fprintf(f, "\n\t\"\";\n");
+	fprintf(f, "\n");
+
+	fprintf(f, "static const struct cl_trie %s_node[%lu];\n", name, (unsigned long) n);
+	fprintf(f, "\n");
+
+	fprintf(f, "static const struct cl_trie_word %s_word[] = {\n", name);
+
+	for (i = 0, text = 0; i < words; i++) {
+		assert(w[i].end >= t->root && w[i].end < t->root + n);
+
+		fprintf(f, "\t{ &%s_node[%lu], %s_text + %lu, %lu },\n", name,
+			(unsigned long) order[w[i].end - t->root],
+			name, (unsigned long) text, (unsigned long) w[i].len);
+
+		text += w[i].len;
+	}
+
+	if (words == 0) {
+		fprintf(f, "\t{ NULL, NULL, 0 }\n");
+	}
+
+	fprintf(f, "};\n");
+	fprintf(f, "\n");
+
+	fprintf(f, "static const struct cl_command *const %s_usage[] = {\n", name);
+
+	for (i = 0, usage = 0; i < n; i++) {
+		size_t k;
+
+		if (q[i]->command == NULL) {
+			continue;
+		}
+
+		for (k = 0; k < q[i]->command->count; k++) {
+			assert(q[i]->command->usage[k] >= t->commands);
+			assert(q[i]->command->usage[k] < t->commands + t->command_count);
+
+			fprintf(f, "\t&%s[%lu],\n", commands,
+				(unsigned long) (q[i]->command->usage[k] - t->commands));
+
+			usage++;
+		}
+	}
+
+	if (usage == 0) {
+		fprintf(f, "\tNULL\n");
+	}
+
+	fprintf(f, "};\n");
+	fprintf(f, "\n");
+
+	fprintf(f, "static const struct cl_trie_command %s_command[] = {\n", name);
+
+	for (i = 0, command = 0, usage = 0; i < n; i++) {
+		if (q[i]->command == NULL) {
+			continue;
+		}
+
+		fprintf(f, "\t{ &%s_usage[%lu], %lu, ", name,
+			(unsigned long) usage, (unsigned long) q[i]->command->count);
+		mode(f, q[i]->command->modes);
+		fprintf(f, " },\n");
+
+		usage += q[i]->command->count;
+		command++;
+	}
+
+	if (command == 0) {
+		fprintf(f, "\t{ NULL, 0, 0 }\n");
+	}
+
+	fprintf(f, "};\n");
+	fprintf(f, "\n");
+
+	fprintf(f, "static const struct cl_trie %s_node[%lu] = {\n", name, (unsigned long) n);
+
+	for (i = 0, label = 0, edge = 1, command = 0; i < n; i++) {
+		fprintf(f, "\t{ %s_label + %lu, %u, %u, ", name,
+			(unsigned long) label, q[i]->len, q[i]->count);
+
+		if (q[i]->count == 0) {
+			fprintf(f, "NULL, ");
+		} else {
+			fprintf(f, "&%s_node[%lu], ", name, (unsigned long) edge);
+		}
+
+		if (q[i]->command == NULL) {
+			fprintf(f, "NULL, ");
+		} else {
+			fprintf(f, "&%s_command[%lu], ", name, (unsigned long) command++);
+		}
+
+		mode(f, q[i]->modes);
+		fprintf(f, ", ");
+		mode(f, q[i]->once);
+		fprintf(f, ", ");
+		mode(f, q[i]->many);
+		fprintf(f, ", &%s_word[%lu], %lu },\n", name,
+			(unsigned long) (q[i]->word - w), (unsigned long) q[i]->word_count);
+
+		label += q[i]->len;
+		edge  += q[i]->count;
+	}
+
+	fprintf(f, "};\n");
+	fprintf(f, "\n");
+
+	fprintf(f, "const struct cl_static %s = {\n", name);
+	fprintf(f, "\t%s_node,\n", name);
+	fprintf(f, "\t%lu,\n", (unsigned long) t->command_count);
+	fprintf(f, "\t%s,\n", t->command_count == 0 ? "NULL" : commands);
+	fprintf(f, "\t%lu,\n", (unsigned long) t->field_count);
+	fprintf(f, "\t%luUL\n", compile_sum(t->command_count, t->commands,
+		t->field_count, t->fields));
+	fprintf(f, "};\n");
+
+	free(order);
+	free(q);
+
+	if (ferror(f)) {
+		return -1;
+	}
+
+	return 0;
+}
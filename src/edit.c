@@ -9,48 +9,941 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
 
 #include "internal.h"
 
+/*
+ * The line is held in a gap buffer: text before the gap is at the start of
+ * buf, and text after the gap is at the end of buf. Edits are made at the
+ * gap, which is moved to the cursor first; only the text between the two
+ * is moved, and typing at the end of the line (where the gap usually is)
+ * moves nothing at all.
+ *
+ * Where the line is wanted whole, the gap is moved to the end, and the line
+ * is terminated there. There is always room for the terminator.
+ */
 struct editctx {
-	size_t count;
 	char *buf;
+	size_t size;
+	size_t count; /* length of the line, excluding the gap */
+	size_t gap;   /* offset of the gap, which is size - count long */
+	size_t cur;   /* cursor, as an offset into the line */
+
+	/*
+	 * Tokens for the line, each with its position in the trie. These are
+	 * kept current as characters are appended and deleted at the end of
+	 * the line. Only the last token is ever lexed again, so that help,
+	 * completion, ^W and dispatch can use what is known already rather
+	 * than walking the line.
+	 *
+	 * An edit elsewhere drops the tokens from the edit point on, and sets
+	 * dirty; the rest of the line is lexed again only once it is needed.
+	 */
+	struct edit_tok *tok;
+	size_t tok_count;
+	size_t tok_size;
+	int dirty;
+
+	/*
+	 * The age of the history line being shown, or 0 for the line being
+	 * entered, which is kept aside meanwhile. While searching, the line
+	 * shown is the current match. The age is as it was when the line was
+	 * found; hist_age() gives it as it is now.
+	 */
+	size_t hist;
+	int search;
+	char *stash;
+	size_t stash_len;
+	size_t stash_size;
+
+	unsigned tabs; /* consecutive completions with nothing to add */
 };
 
-static int
-append(struct editctx *ectx, const char *s)
-{
-	const size_t blocksz = 64;
-	size_t n;
+/* move the gap to the given offset */
+static void
+move(struct editctx *e, size_t pos)
+{
+	size_t gaplen;
+
+	assert(e != NULL);
+	assert(pos <= e->count);
+
+	gaplen = e->size - e->count;
+
+	if (pos < e->gap) {
+		memmove(e->buf + pos + gaplen, e->buf + pos, e->gap - pos);
+	} else if (pos > e->gap) {
+		memmove(e->buf + e->gap, e->buf + e->gap + gaplen, pos - e->gap);
+	}
+
+	e->gap = pos;
+}
+
+/* room for n more bytes, and a terminator */
+static int
+reserve(struct editctx *e, size_t n)
+{
+	size_t size;
+	char *tmp;
+
+	assert(e != NULL);
+
+	if (e->count + n < e->size) {
+		return 0;
+	}
+
+	size = e->size == 0 ? 64 : e->size;
+	while (size <= e->count + n) {
+		size *= 2;
+	}
+
+	/* with the gap at the end, realloc() keeps the text where it is */
+	move(e, e->count);
+
+	tmp = realloc(e->buf, size);
+	if (tmp == NULL) {
+		return -1;
+	}
+
+	e->buf  = tmp;
+	e->size = size;
+
+	return 0;
+}
+
+/* the line in full, terminated */
+static const char *
+text(struct editctx *e)
+{
+	assert(e != NULL);
+
+	if (e->buf == NULL) {
+		return "";
+	}
+
+	move(e, e->count);
+
+	e->buf[e->count] = '\0';
+
+	return e->buf;
+}
+
+/* the character at offset i */
+static char
+at(const struct editctx *e, size_t i)
+{
+	assert(e != NULL);
+	assert(i < e->count);
+
+	if (i < e->gap) {
+		return e->buf[i];
+	}
+
+	return e->buf[i + e->size - e->count];
+}
+
+/* insert at the cursor, leaving the cursor after the inserted text */
+static int
+put(struct editctx *e, const char *s, size_t n)
+{
+	assert(e != NULL);
+	assert(s != NULL);
+
+	if (-1 == reserve(e, n)) {
+		return -1;
+	}
+
+	move(e, e->cur);
+
+	memcpy(e->buf + e->gap, s, n);
+
+	e->gap   += n;
+	e->count += n;
+	e->cur   += n;
+
+	return 0;
+}
+
+/* remove n characters from the given offset, leaving the cursor there */
+static void
+cut(struct editctx *e, size_t pos, size_t n)
+{
+	assert(e != NULL);
+	assert(pos + n <= e->count);
+
+	move(e, pos);
+
+	/* the gap simply grows over them */
+	e->count -= n;
+	e->cur    = pos;
+}
+
+/* echo the line between the given offsets, which may straddle the gap */
+static int
+echo(struct cl_peer *p, size_t from, size_t to)
+{
+	const struct editctx *e;
+	size_t n;
+
+	assert(p != NULL);
+	assert(p->ectx != NULL);
+
+	e = p->ectx;
+
+	assert(from <= to && to <= e->count);
+
+	if (from < e->gap) {
+		n = (to < e->gap ? to : e->gap) - from;
+
+		if (-1 == cl_write(p, e->buf + from, n)) {
+			return -1;
+		}
+
+		from += n;
+	}
+
+	if (from < to) {
+		if (-1 == cl_write(p, e->buf + from + e->size - e->count, to - from)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Redraw from the cursor to the end of the line, after an edit there, and
+ * return the cursor to where it was. Only the changed tail is sent; stale
+ * stands for the characters which were shown past the new end of the line.
+ */
+static int
+redraw(struct cl_peer *p, size_t stale)
+{
+	const struct editctx *e;
+	struct cl_chctx *head;
+
+	assert(p != NULL);
+	assert(p->ectx != NULL);
+
+	e    = p->ectx;
+	head = &p->chctx[0];
+
+	if (-1 == echo(p, e->cur, e->count)) {
+		return -1;
+	}
+
+	if (stale > 0) {
+		if (-1 == head->ioapi->send(p, head, OUT_DELETE_TO_EOL, stale)) {
+			return -1;
+		}
+	}
+
+	if (e->count > e->cur) {
+		if (-1 == head->ioapi->send(p, head, OUT_CURSOR_LEFT, e->count - e->cur)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* one character along the trie; a position part-way along a label is kept by *off */
+static const struct cl_trie *
+edit_walk(const struct cl_trie *trie, size_t *off, char c)
+{
+	assert(trie != NULL);
+	assert(off != NULL);
+
+	if (*off < trie->len) {
+		if (trie->label[*off] != c) {
+			return NULL;
+		}
+
+		(*off)++;
+
+		return trie;
+	}
+
+	*off = 1;
+
+	return trie_walk(trie, &c, 1);
+}
+
+/*
+ * The command or space at which a word ends; either it is given in full,
+ * or it is an unambiguous abbreviation.
+ */
+static const struct cl_trie *
+edit_resolve(struct cl_peer *p, const struct edit_tok *tok)
+{
+	const struct cl_trie *t;
+
+	assert(p != NULL);
+	assert(tok != NULL);
+
+	if (tok->type != TOK_WORD || tok->trie == NULL) {
+		return NULL;
+	}
+
+	t = NULL;
+
+	if (tok->off == tok->trie->len) {
+		t = trie_exact(p, tok->trie, p->mode);
+	}
+
+	if (t == NULL) {
+		t = trie_run(p, tok->trie, p->mode, ' ');
+	}
+
+	return t;
+}
+
+/* where the word following a resolved word starts */
+static const struct cl_trie *
+edit_next(const struct cl_trie *run)
+{
+	if (run == NULL) {
+		return NULL;
+	}
+
+	if (run->label[0] == ' ') {
+		return run;
+	}
+
+	return trie_walk(run, " ", 1);
+}
+
+
+/*
+ * Lex from the given offset to the end of the line, adding tokens.
+ * The offset is required to fall between tokens.
+ */
+static int
+edit_lex(struct cl_peer *p, size_t from)
+{
+	struct editctx *e;
+	struct lex_tok tok;
+	const char *buf, *src;
+
+	assert(p != NULL);
+	assert(p->tree != NULL);
+	assert(p->tree->root != NULL);
+	assert(p->ectx != NULL);
+
+	e = p->ectx;
+
+	assert(from <= e->count);
+
+	if (from == e->count) {
+		return 0;
+	}
+
+	buf = text(e);
+	src = buf + from;
+
+	while (lex_next(&tok, &src, buf + e->count, NULL) != NULL) {
+		struct edit_tok *t;
+		const char *s;
+
+		if (e->tok_count == e->tok_size) {
+			struct edit_tok *tmp;
+
+			tmp = realloc(e->tok, sizeof *e->tok * (e->tok_size + 8));
+			if (tmp == NULL) {
+				return -1;
+			}
+
+			e->tok       = tmp;
+			e->tok_size += 8;
+		}
+
+		t = &e->tok[e->tok_count];
+
+		t->type  = tok.type;
+		t->start = tok.src.start - buf;
+		t->end   = tok.src.end   - buf;
+		t->run   = NULL;
+
+		/* the previous token is complete now, so it may be resolved */
+		if (e->tok_count == 0) {
+			t->word = p->tree->root;
+		} else {
+			struct edit_tok *prev = &e->tok[e->tok_count - 1];
+
+			prev->run = edit_resolve(p, prev);
+			t->word   = edit_next(prev->run);
+		}
+
+		t->trie = NULL;
+		t->off  = 0;
+
+		if (t->type == TOK_WORD && t->word != NULL) {
+			t->trie = t->word;
+			t->off  = t->word->len;
+
+			for (s = tok.src.start; s < tok.src.end && t->trie != NULL; s++) {
+				t->trie = edit_walk(t->trie, &t->off, *s);
+			}
+		}
+
+		e->tok_count++;
+	}
+
+	return 0;
+}
+
+/*
+ * Drop the tokens which an edit at the given offset may have changed.
+ * A token ending there is dropped too, since it may continue.
+ */
+static void
+edit_invalidate(struct editctx *e, size_t pos)
+{
+	assert(e != NULL);
+
+	while (e->tok_count > 0 && e->tok[e->tok_count - 1].end >= pos) {
+		e->tok_count--;
+	}
+
+	e->dirty = 1;
+}
+
+/* lex whatever follows the tokens which remain */
+static int
+edit_sync(struct cl_peer *p)
+{
+	struct editctx *e;
+
+	assert(p != NULL);
+	assert(p->ectx != NULL);
+
+	e = p->ectx;
+
+	if (!e->dirty) {
+		return 0;
+	}
+
+	e->dirty = 0;
+
+	return edit_lex(p, e->tok_count == 0 ? 0 : e->tok[e->tok_count - 1].end);
+}
+
+/*
+ * Whitespace appended after a complete token changes nothing, and word
+ * characters appended to a word just carry on along the trie. Otherwise
+ * the last token is lexed again, since (for example) a quote may begin a
+ * string which swallows it.
+ *
+ * Text inserted before the end of the line is echoed along with the rest
+ * of the line after it, and the tokens from there on are left to be lexed
+ * when next they are needed.
+ */
+static int
+edit_insert(struct cl_peer *p, const char *s, size_t n, enum edit_flags flags)
+{
+	struct editctx *e;
+	struct edit_tok *last;
+	size_t count, i;
+	int space, word;
+
+	assert(p != NULL);
+	assert(p->ectx != NULL);
+	assert(s != NULL);
+
+	e = p->ectx;
+
+	count = e->cur;
+
+	if (-1 == put(e, s, n)) {
+		return -1;
+	}
+
+	if (flags & EDIT_ECHO) {
+		if (-1 == cl_write(p, s, n)) {
+			return -1;
+		}
+
+		if (e->cur < e->count && -1 == redraw(p, 0)) {
+			return -1;
+		}
+	}
+
+	if (e->cur < e->count || e->dirty) {
+		edit_invalidate(e, count);
+
+		if (e->cur < e->count) {
+			return 0;
+		}
+
+		return edit_sync(p);
+	}
+
+	space = 1;
+	word  = 1;
+
+	for (i = 0; i < n; i++) {
+		if (!lex_space(s[i])) {
+			space = 0;
+		}
+
+		if (!lex_word(s[i])) {
+			word = 0;
+		}
+	}
+
+	last = e->tok_count == 0 ? NULL : &e->tok[e->tok_count - 1];
+
+	if (last == NULL || last->end < count) {
+		return edit_lex(p, count);
+	}
+
+	if (space && last->type != TOK_ERROR) {
+		return 0;
+	}
+
+	if (word && last->type == TOK_WORD) {
+		for (i = 0; i < n && last->trie != NULL; i++) {
+			last->trie = edit_walk(last->trie, &last->off, s[i]);
+		}
+
+		last->end = e->count;
+		last->run = NULL;
+
+		return 0;
+	}
+
+	e->tok_count--;
+
+	return edit_lex(p, last->start);
+}
+
+/*
+ * Remove n characters from the given offset, which is at or before the
+ * cursor, and redraw. At the end of the line, the tokens are brought up
+ * to date straight away, as only the last is affected.
+ */
+static int
+edit_remove(struct cl_peer *p, size_t pos, size_t n, enum edit_flags flags)
+{
+	struct editctx *e;
+	struct cl_chctx *head;
+	size_t back;
+
+	assert(p != NULL);
+	assert(p->ectx != NULL);
+
+	e    = p->ectx;
+	head = &p->chctx[0];
+
+	assert(pos <= e->cur);
+	assert(pos + n <= e->count);
+
+	if (n == 0) {
+		return 0;
+	}
+
+	back = e->cur - pos;
+
+	cut(e, pos, n);
+
+	edit_invalidate(e, pos);
+
+	if (flags & EDIT_ECHO) {
+		if (e->cur == e->count && back == n) {
+			if (-1 == head->ioapi->send(p, head, OUT_BACKSPACE_AND_DELETE, n)) {
+				return -1;
+			}
+		} else {
+			if (back > 0 && -1 == head->ioapi->send(p, head, OUT_CURSOR_LEFT, back)) {
+				return -1;
+			}
+
+			if (-1 == redraw(p, n)) {
+				return -1;
+			}
+		}
+	}
+
+	if (e->cur < e->count) {
+		return 0;
+	}
+
+	return edit_sync(p);
+}
+
+/* move the cursor to the given offset */
+static int
+edit_move(struct cl_peer *p, size_t pos, enum edit_flags flags)
+{
+	struct editctx *e;
+	struct cl_chctx *head;
+
+	assert(p != NULL);
+	assert(p->ectx != NULL);
+
+	e    = p->ectx;
+	head = &p->chctx[0];
+
+	assert(pos <= e->count);
+
+	if (flags & EDIT_ECHO) {
+		if (pos < e->cur) {
+			if (-1 == head->ioapi->send(p, head, OUT_CURSOR_LEFT, e->cur - pos)) {
+				return -1;
+			}
+		} else if (pos > e->cur) {
+			/* the characters passed over are as short as any sequence */
+			if (-1 == echo(p, e->cur, pos)) {
+				return -1;
+			}
+		}
+	}
+
+	e->cur = pos;
+
+	if (e->cur < e->count) {
+		return 0;
+	}
+
+	return edit_sync(p);
+}
+
+/* the start of the word before the cursor, or the end of the word after it */
+static size_t
+edit_word(const struct editctx *e, int dir)
+{
+	size_t i;
+
+	assert(e != NULL);
+
+	i = e->cur;
+
+	if (dir < 0) {
+		while (i > 0 && lex_space(at(e, i - 1))) {
+			i--;
+		}
+
+		while (i > 0 && !lex_space(at(e, i - 1))) {
+			i--;
+		}
+	} else {
+		while (i < e->count && lex_space(at(e, i))) {
+			i++;
+		}
+
+		while (i < e->count && !lex_space(at(e, i))) {
+			i++;
+		}
+	}
+
+	return i;
+}
+
+/*
+ * Replace the line, leaving the cursor at the given offset. Only what
+ * differs from the line shown is redrawn: the cursor moves back to the
+ * end of the prefix the two lines share, and the rest is written over.
+ */
+static int
+edit_replace(struct cl_peer *p, const char *s, size_t n, size_t cur, enum edit_flags flags)
+{
+	struct editctx *e;
+	struct cl_chctx *head;
+	size_t k, count;
+
+	assert(p != NULL);
+	assert(p->ectx != NULL);
+	assert(s != NULL || n == 0);
+	assert(cur <= n);
+
+	e    = p->ectx;
+	head = &p->chctx[0];
+
+	for (k = 0; k < n && k < e->count; k++) {
+		if (at(e, k) != s[k]) {
+			break;
+		}
+	}
+
+	if (k == n && k == e->count) {
+		return edit_move(p, cur, flags);
+	}
+
+	if (-1 == edit_move(p, k, flags)) {
+		return -1;
+	}
+
+	count = e->count;
+
+	cut(e, k, e->count - k);
+
+	if (n > k && -1 == put(e, s + k, n - k)) {
+		return -1;
+	}
+
+	edit_invalidate(e, k);
+
+	if (flags & EDIT_ECHO) {
+		if (n > k && -1 == cl_write(p, s + k, n - k)) {
+			return -1;
+		}
+
+		if (count > n && -1 == head->ioapi->send(p, head, OUT_DELETE_TO_EOL, count - n)) {
+			return -1;
+		}
+
+		if (cur < n && -1 == head->ioapi->send(p, head, OUT_CURSOR_LEFT, n - cur)) {
+			return -1;
+		}
+	}
+
+	e->cur = cur;
 
-	assert(ectx != NULL);
-	assert(s != NULL);
+	if (e->cur < e->count) {
+		return 0;
+	}
+
+	return edit_sync(p);
+}
 
-	n = strlen(s);
+/* keep the line being entered aside, while history is shown in its place */
+static int
+edit_stash(struct editctx *e)
+{
+	assert(e != NULL);
 
-	assert(n != 0);
-	assert(n < blocksz);
+	if (e->hist != 0 || e->search) {
+		return 0;
+	}
 
-/* TODO: check again... */
-	if ((ectx->count + n - 1) % blocksz < n) {
+	if (e->count > e->stash_size) {
 		char *tmp;
 
-		tmp = realloc(ectx->buf, ectx->count + blocksz);
+		tmp = realloc(e->stash, e->count);
 		if (tmp == NULL) {
 			return -1;
 		}
 
-		ectx->buf = tmp;
+		e->stash      = tmp;
+		e->stash_size = e->count;
+	}
+
+	/* an empty line has no stash allocated, and nothing to copy to it */
+	if (e->count > 0) {
+		memcpy(e->stash, text(e), e->count);
+	}
+
+	e->stash_len = e->count;
+
+	return 0;
+}
+
+/* show the history line of the given age, or the stashed line for 0 */
+static int
+edit_recall(struct cl_peer *p, size_t age, enum edit_flags flags)
+{
+	struct editctx *e;
+	const char *s;
+	size_t n;
+
+	assert(p != NULL);
+	assert(p->ectx != NULL);
+	assert(p->hctx != NULL);
+
+	e = p->ectx;
+
+	/* stashed first, so e->hist is left as it was for hist_age() on error */
+	if (-1 == edit_stash(e)) {
+		return -1;
+	}
+
+	if (age == 0) {
+		s = e->stash;
+		n = e->stash_len;
+	} else {
+		s = hist_get(p->hctx, age, &n);
+		if (s == NULL) {
+			return 0;
+		}
+	}
+
+	e->hist = age;
+
+	return edit_replace(p, s, n, n, flags);
+}
+
+/* show the current search match, with the cursor at the query */
+static int
+edit_match(struct cl_peer *p, enum edit_flags flags)
+{
+	const char *s;
+	size_t age, at, n;
+
+	assert(p != NULL);
+	assert(p->ectx != NULL);
+	assert(p->hctx != NULL);
+
+	s = hist_search_match(p->hctx, &n, &age, &at);
+	if (s == NULL) {
+		return 0;
+	}
+
+	assert(at <= n);
+
+	p->ectx->hist = age;
+
+	return edit_replace(p, s, n, at, flags);
+}
+
+/*
+ * Incremental reverse search. Characters typed extend the query, and
+ * the line shown narrows to the newest match; ^R again goes to the next
+ * older match. ^C returns to the line as it was, and anything else ends
+ * the search leaving the match in place, and is then handled as usual.
+ * Returns 1 for an event the search did not consume.
+ */
+static int
+edit_search(struct cl_peer *p, const struct cl_event *event, enum edit_flags flags)
+{
+	struct editctx *e;
+	int r;
+
+	assert(p != NULL);
+	assert(p->ectx != NULL);
+	assert(p->hctx != NULL);
+	assert(event != NULL);
+
+	e = p->ectx;
+
+	assert(e->search);
+
+	switch (event->type) {
+	case UI_HIST_SEARCH:
+		r = hist_search_next(p->hctx);
+		break;
+
+	case UI_BACKSPACE:
+		r = hist_search_pop(p->hctx, 1);
+		break;
+
+	case UI_TEXT:
+		r = hist_search_push(p->hctx, event->u.text.s, event->u.text.n);
+		break;
+
+	case UI_CANCEL:
+		e->search = 0;
+		return edit_recall(p, 0, flags);
+
+	case UI_CODEPOINT:
+		if ((unsigned char) event->u.utf8[0] >= ' ' && event->u.utf8[0] != '\177') {
+			r = hist_search_push(p->hctx, event->u.utf8, strlen(event->u.utf8));
+			break;
+		}
+
+		/* FALLTHROUGH */
+
+	default:
+		e->search = 0;
+		return 1;
 	}
 
-	memcpy(ectx->buf + ectx->count, s, n + 1);
+	if (r == -1) {
+		return -1;
+	}
 
-	ectx->count += n;
+	if (-1 == edit_match(p, flags)) {
+		return -1;
+	}
 
 	return 0;
 }
 
+/*
+ * The trie position for the end of the line, and the length of the word
+ * being entered there. If the line has left the trie, *lost is set, and
+ * the furthest position reached is given for the sake of help.
+ */
+static const struct cl_trie *
+edit_trie(struct cl_peer *p, size_t *len, int *lost)
+{
+	const struct edit_tok *t;
+	const struct cl_trie *next;
+	struct editctx *e;
+	size_t i;
+
+	assert(p != NULL);
+	assert(p->tree != NULL);
+	assert(p->ectx != NULL);
+	assert(!p->ectx->dirty);
+	assert(len != NULL);
+	assert(lost != NULL);
+
+	e = p->ectx;
+
+	*len  = 0;
+	*lost = 0;
+
+	if (e->tok_count == 0) {
+		return p->tree->root;
+	}
+
+	/* the last token still on the trie; the first always is */
+	for (i = e->tok_count; e->tok[i - 1].word == NULL; i--) {
+		assert(i > 1);
+	}
+
+	t = &e->tok[i - 1];
+
+	if (t->trie == NULL) {
+		*lost = 1;
+		return t->word;
+	}
+
+	if (i < e->tok_count) {
+		*lost = 1;
+		return t->trie;
+	}
+
+	if (t->end == e->count) {
+		*len = t->end - t->start;
+		return t->trie;
+	}
+
+	next = edit_next(edit_resolve(p, t));
+	if (next == NULL) {
+		*lost = 1;
+		return t->trie;
+	}
+
+	return next;
+}
+
+const struct edit_tok *
+edit_tokens(struct cl_peer *p, size_t *n, const char **buf)
+{
+	struct editctx *e;
+
+	assert(p != NULL);
+	assert(p->ectx != NULL);
+	assert(!p->ectx->dirty);
+	assert(n != NULL);
+	assert(buf != NULL);
+
+	e = p->ectx;
+
+	/* the last token is not resolved until another follows it */
+	if (e->tok_count > 0) {
+		struct edit_tok *last = &e->tok[e->tok_count - 1];
+
+		last->run = edit_resolve(p, last);
+	}
+
+	*n   = e->tok_count;
+	*buf = text(e);
+
+	return e->tok;
+}
+
 struct editctx *
 edit_create(void)
 {
@@ -61,8 +954,24 @@ edit_create(void)
 		return NULL;
 	}
 
-	new->count = 0;
 	new->buf   = NULL;
+	new->size  = 0;
+	new->count = 0;
+	new->gap   = 0;
+	new->cur   = 0;
+
+	new->tok       = NULL;
+	new->tok_count = 0;
+	new->tok_size  = 0;
+	new->dirty     = 0;
+
+	new->hist       = 0;
+	new->search     = 0;
+	new->stash      = NULL;
+	new->stash_len  = 0;
+	new->stash_size = 0;
+
+	new->tabs = 0;
 
 	return new;
 }
@@ -72,207 +981,330 @@ edit_destroy(struct editctx *ectx)
 {
 	assert(ectx != NULL);
 
+	free(ectx->stash);
+	free(ectx->tok);
 	free(ectx->buf);
 	free(ectx);
 }
 
-char *
-edit_release(struct editctx *ectx)
+/*
+ * The line as entered, or NULL if empty. Storage persists until the next
+ * edit; the buffer is kept for the next line, rather than given away.
+ */
+const char *
+edit_line(struct editctx *ectx, size_t *n)
 {
-	char *p;
-
 	assert(ectx != NULL);
+	assert(n != NULL);
+
+	*n = ectx->count;
 
 	if (ectx->count == 0) {
 		return NULL;
 	}
 
-	p = ectx->buf;
+	return text(ectx);
+}
 
-	ectx->count = 0;
-	ectx->buf = NULL;
+void
+edit_clear(struct editctx *ectx)
+{
+	assert(ectx != NULL);
 
-	return p;
+	ectx->count     = 0;
+	ectx->gap       = 0;
+	ectx->cur       = 0;
+	ectx->tok_count = 0;
+	ectx->dirty     = 0;
+	ectx->hist      = 0;
+	ectx->search    = 0;
 }
 
 static int
-edit_backspace(struct cl_peer *p, size_t n)
+edit_backspace(struct cl_peer *p, size_t n, enum edit_flags flags)
 {
 	assert(p != NULL);
 	assert(p->ectx != NULL);
-	assert(n > 0);
 
-	if (p->ectx->count == 0) {
+	if (p->ectx->cur == 0) {
 		return 0;
 	}
 
-	/* XXX: this should walk back n unicode characters worth, not just n bytes */
-
-	assert(p->ectx->buf != NULL);
-	assert(p->ectx->count >= n);
-
-	p->ectx->count -= n;
-	p->ectx->buf[p->ectx->count] = '\0';
-
-	if (n == 1) {
-		if (-1 == p->chctx->ioapi->send(p, p->chctx + 0, OUT_BACKSPACE_AND_DELETE)) {
-			return -1;
-		}
+	assert(n > 0);
 
-		return 0;
-	}
+	/* XXX: this should walk back n unicode characters worth, not just n bytes */
 
-	/* XXX: placeholder for "go left X characters and delete to EOL */
-	while (n-- > 0) {
-		if (-1 == p->chctx->ioapi->send(p, p->chctx + 0, OUT_BACKSPACE_AND_DELETE)) {
-			return -1;
-		}
-	}
+	assert(p->ectx->cur >= n);
 
-	return 0;
+	return edit_remove(p, p->ectx->cur - n, n, flags);
 }
 
 static int
-edit_backword(struct cl_peer *p)
+edit_backword(struct cl_peer *p, enum edit_flags flags)
 {
-	struct lex_tok tok[2];
-	const char *src;
-	size_t i;
+	struct editctx *e;
+	size_t keep;
 
 	assert(p != NULL);
 	assert(p->ectx != NULL);
 
-	if (p->ectx->count == 0) {
+	e = p->ectx;
+
+	if (e->cur == 0) {
 		return 0;
 	}
 
-	assert(p->ectx->buf != NULL);
+	/* within the line there are no tokens to go by */
+	if (e->cur < e->count) {
+		keep = edit_word(e, -1);
 
-	src = p->ectx->buf;
-
-	tok[0].src.start = tok[0].src.end = src;
-	tok[1].src.start = tok[1].src.end = src;
+		return edit_remove(p, keep, e->cur - keep, flags);
+	}
 
-	for (i = 0; lex_next(&tok[i], &src, NULL) != NULL; i = !i) {
-		if (tok[i].type == TOK_ERROR) {
-			break;
-		}
+	if (-1 == edit_sync(p)) {
+		return -1;
 	}
 
+	keep = 0;
+
 	/* leave a single trailing space if we're just deleting one
 	 * token, as long as it's not SOL */
-	if (tok[i].src.end != tok[i].src.start) {
-		tok[i].src.end += isspace((unsigned char) *tok[i].src.end);
+	if (e->tok_count > 1) {
+		keep = e->tok[e->tok_count - 2].end;
+
+		if (lex_space(at(e, keep))) {
+			keep++;
+		}
 	}
 
-	return edit_backspace(p, strlen(tok[i].src.end));
+	assert(keep < e->count);
+
+	return edit_backspace(p, e->count - keep, flags);
 }
 
-static const struct trie *
-edit_walk(struct cl_peer *p, const struct trie *trie, const char *src)
+/*
+ * Extend the current word to the longest prefix it shares with every
+ * word which could complete it, and finish the word if only one could.
+ * When there is nothing to add, a second attempt lists the candidates.
+ */
+static int
+edit_complete(struct cl_peer *p, enum edit_flags flags)
 {
-	struct lex_tok tok;
+	const struct cl_trie *trie;
+	const char *s;
+	size_t n, len, typed;
+	int lost;
 
 	assert(p != NULL);
-	assert(trie != NULL);
+	assert(p->ectx != NULL);
 
-	if (p->ectx->count == 0) {
-		return trie;
+	/* completion is for the end of the line */
+	if (-1 == edit_move(p, p->ectx->count, flags)) {
+		return -1;
 	}
 
-	assert(src != NULL);
+	trie = edit_trie(p, &typed, &lost);
 
-	while (lex_next(&tok, &src, NULL) != NULL) {
-		const struct trie *t;
+	if (lost) {
+		return 0;
+	}
 
-		if (tok.type != TOK_WORD) {
-			break;
+	n = trie_prefix(p, trie, p->mode, &s, &len);
+	if (n == 0) {
+		return 0;
+	}
+
+	assert(len >= typed);
+
+	if (len > typed) {
+		p->ectx->tabs = 0;
+
+		if (-1 == edit_insert(p, s + typed, len - typed, flags)) {
+			return -1;
 		}
 
-		t = trie_walk(trie, tok.src.start, tok.src.end - tok.src.start);
-		if (t == NULL) {
-			break;
+		if (n > 1) {
+			return 0;
 		}
+	}
 
-		trie = t;
+	if (n == 1) {
+		p->ectx->tabs = 0;
 
-		t = trie_walk(trie, " ", 1);
-		if (t == NULL) {
-			break;
-		}
+		return edit_insert(p, " ", 1, flags);
+	}
 
-		trie = t;
+	if (++p->ectx->tabs < 2) {
+		return 0;
 	}
 
-	assert(trie != NULL);
+	cl_printf(p, "\n");
+
+	if (-1 == trie_words(p, trie, p->mode)) {
+		return -1;
+	}
+
+	p->tree->printprompt(p, p->mode);
+
+	if (p->ectx->count > 0) {
+		cl_printf(p, "%s", text(p->ectx));
+	}
 
-	return trie;
+	return 0;
 }
 
 int
 edit_push(struct cl_peer *p, const struct cl_event *event, enum edit_flags flags)
 {
+	struct editctx *e;
+
 	assert(p != NULL);
 	assert(p->tree != NULL);
 	assert(p->tree->root != NULL);
 	assert(p->ectx != NULL);
 	assert(event != NULL);
 
+	e = p->ectx;
+
+	if (event->type != UI_CODEPOINT || event->u.utf8[0] != '\t') {
+		e->tabs = 0;
+	}
+
+	if (e->search) {
+		int r;
+
+		r = edit_search(p, event, flags);
+		if (r != 1) {
+			return r;
+		}
+	}
+
 	switch (event->type) {
 	case UI_CODEPOINT:
 		break;
 
+	case UI_TEXT:
+		/* a run of text at once (pasted, or from a plain peer), echoed in one write */
+		return edit_insert(p, event->u.text.s, event->u.text.n, flags);
+
 	case UI_BACKSPACE:
-		return edit_backspace(p, 1);
+		return edit_backspace(p, 1, flags);
 
 	case UI_DELETE_LINE:
-		return edit_backspace(p, p->ectx->count);
+		return edit_backspace(p, e->cur, flags);
 
 	case UI_DELETE_WORD:
-		return edit_backword(p);
+		return edit_backword(p, flags);
 
 	case UI_DELETE:
+		if (e->cur == e->count) {
+			return 0;
+		}
+
+		/* XXX: this should be one unicode character, not one byte */
+		return edit_remove(p, e->cur, 1, flags);
+
 	case UI_DELETE_TO_EOL:
+		return edit_remove(p, e->cur, e->count - e->cur, flags);
+
 	case UI_CANCEL:	/* ^C to abort current command */
 		/* TODO: not implemented */
 		return 0;
 
 	case UI_HIST_PREV:
+		if (~flags & EDIT_HIST) {
+			return 0;
+		}
+
+		return edit_recall(p, hist_age(p->hctx, e->hist) + 1, flags);
+
 	case UI_HIST_NEXT:
 		if (~flags & EDIT_HIST) {
 			return 0;
 		}
 
-		/* TODO: not implemented */
+		if (e->hist == 0) {
+			return 0;
+		}
+
+		return edit_recall(p, hist_age(p->hctx, e->hist) - 1, flags);
+
+	case UI_HIST_SEARCH:
+		if (~flags & EDIT_HIST) {
+			return 0;
+		}
+
+		if (-1 == edit_stash(e)) {
+			return -1;
+		}
+
+		hist_search_begin(p->hctx);
+		e->search = 1;
+
 		return 0;
 
 	case UI_CURSOR_LEFT:
+		if (e->cur == 0) {
+			return 0;
+		}
+
+		return edit_move(p, e->cur - 1, flags);
+
 	case UI_CURSOR_RIGHT:
+		if (e->cur == e->count) {
+			return 0;
+		}
+
+		return edit_move(p, e->cur + 1, flags);
+
 	case UI_CURSOR_LEFT_WORD:
+		return edit_move(p, edit_word(e, -1), flags);
+
 	case UI_CURSOR_RIGHT_WORD:
+		return edit_move(p, edit_word(e, +1), flags);
+
 	case UI_CURSOR_EOL:
-	case UI_CURSOR_SOL:
-		if (~flags & EDIT_ECHO) {
-			return 0;
-		}
+		return edit_move(p, e->count, flags);
 
-		/* TODO: not implemented */
-		return 0;
+	case UI_CURSOR_SOL:
+		return edit_move(p, 0, flags);
 
 	case UI_HELP:
 		if (~flags & EDIT_TRIE) {
 			return 0;
 		}
 
+		/* help is for the end of the line */
+		if (-1 == edit_move(p, e->count, flags)) {
+			return -1;
+		}
+
 		cl_printf(p, "?\n");
 
-		trie_help(p, edit_walk(p, p->tree->root, p->ectx->buf), p->mode);
+		{
+			const struct cl_trie *trie;
+			size_t len;
+			int lost;
+			int r;
+
+			trie = edit_trie(p, &len, &lost);
+
+			if (p->tree->helpmode == CL_HELP_WORDS) {
+				r = trie_words(p, trie, p->mode);
+			} else {
+				r = trie_help(p, trie, p->mode);
+			}
+
+			if (r == -1) {
+				return -1;
+			}
+		}
 
 		{
 			p->tree->printprompt(p, p->mode);
 
-			if (p->ectx->count > 0) {
-				cl_printf(p, "%s", p->ectx->buf);
+			if (e->count > 0) {
+				cl_printf(p, "%s", text(e));
 			}
 		}
 
@@ -286,36 +1318,33 @@ edit_push(struct cl_peer *p, const struct cl_event *event, enum edit_flags flags
 		return 0;
 
 	case '\n':
+		/* the tokens are wanted whole for dispatch */
+		if (-1 == edit_sync(p)) {
+			return -1;
+		}
+
 		return 1;
 
 	case '\t':
 		if (flags & EDIT_TRIE) {
-			/* TODO: tab completion not implemented */
+			return edit_complete(p, flags);
 		}
 
 		return 0;
 
 	case '?':
 		if (flags & EDIT_TRIE) {
-			struct cl_event e;
+			struct cl_event ev;
 
-			e.type = UI_HELP;
+			ev.type = UI_HELP;
 
-			return edit_push(p, &e, flags);
+			return edit_push(p, &ev, flags);
 		}
 
 		/* FALLTHROUGH */
 
 	default:
-		if (flags & EDIT_ECHO) {
-			cl_printf(p, "%s", event->u.utf8);
-		}
-
-		if (-1 == append(p->ectx, event->u.utf8)) {
-			return -1;
-		}
-
-		return 0;
+		return edit_insert(p, event->u.utf8, strlen(event->u.utf8), flags);
 	}
 }
 
@@ -0,0 +1,499 @@
+/*
+ * Copyright 2012-2017 Katherine Flavel
+ *
+ * See LICENCE for the full copyright terms.
+ */
+
+#define _POSIX_SOURCE
+
+#include <cl/tree.h>
+
+#include <sys/types.h>
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <limits.h>
+#include <regex.h>
+
+#include "internal.h"
+
+/*
+ * Output filters, as given after a command:
+ *
+ *  show log | include error | count
+ *
+ * While a command's callback runs, its output is broken into lines here,
+ * and each line is passed through the filters in turn. Lines which survive
+ * are sent on down the chain immediately, so nothing is held beyond the
+ * current line, and output which is filtered away is never sent to the
+ * peer at all.
+ *
+ * Patterns are POSIX extended regular expressions, compiled once when the
+ * command line is parsed, and freed when the command is done.
+ */
+
+enum filter_type {
+	FILTER_INCLUDE,
+	FILTER_EXCLUDE,
+	FILTER_BEGIN,
+	FILTER_COUNT
+};
+
+struct stage {
+	enum filter_type type;
+	regex_t re;
+	unsigned long n; /* FILTER_BEGIN: lines matched; FILTER_COUNT: lines seen */
+};
+
+struct filterctx {
+	int active;
+
+	struct stage *stage;
+	size_t count;
+	size_t size;
+
+	/* the current line, as yet unterminated */
+	char *buf;
+	size_t len;
+	size_t bufsz;
+};
+
+static const struct {
+	const char *name;
+	enum filter_type type;
+	int pattern;
+} filters[] = {
+	{ "include", FILTER_INCLUDE, 1 },
+	{ "exclude", FILTER_EXCLUDE, 1 },
+	{ "begin",   FILTER_BEGIN,   1 },
+	{ "count",   FILTER_COUNT,   0 }
+};
+
+struct filterctx *
+filter_create(void)
+{
+	struct filterctx *new;
+
+	new = malloc(sizeof *new);
+	if (new == NULL) {
+		return NULL;
+	}
+
+	new->active = 0;
+
+	new->stage = NULL;
+	new->count = 0;
+	new->size  = 0;
+
+	new->buf   = NULL;
+	new->len   = 0;
+	new->bufsz = 0;
+
+	return new;
+}
+
+static void
+reset(struct filterctx *f)
+{
+	size_t i;
+
+	assert(f != NULL);
+
+	for (i = 0; i < f->count; i++) {
+		if (f->stage[i].type != FILTER_COUNT) {
+			regfree(&f->stage[i].re);
+		}
+	}
+
+	f->active = 0;
+	f->count  = 0;
+	f->len    = 0;
+}
+
+void
+filter_destroy(struct filterctx *f)
+{
+	assert(f != NULL);
+
+	reset(f);
+
+	free(f->stage);
+	free(f->buf);
+	free(f);
+}
+
+/*
+ * Unique prefixes of filter names are accepted, as for commands.
+ */
+static int
+findfilter(const char *s, size_t n)
+{
+	size_t i;
+	int r;
+
+	assert(s != NULL);
+
+	r = -1;
+
+	for (i = 0; i < sizeof filters / sizeof *filters; i++) {
+		if (n > strlen(filters[i].name) || 0 != strncmp(filters[i].name, s, n)) {
+			continue;
+		}
+
+		if (r != -1) {
+			return -1;
+		}
+
+		r = i;
+	}
+
+	return r;
+}
+
+/*
+ * Parse the filters following a pipe token, lexed from the same source and
+ * into the same storage as the command's arguments. Returns 0 (having said
+ * why) for a line which should not be run.
+ */
+int
+filter_parse(struct cl_peer *p, const char **src, const char *end, char **dst)
+{
+	struct filterctx *f;
+	struct lex_tok tok;
+	struct stage *st;
+	int i, e;
+
+	assert(p != NULL);
+	assert(p->fctx != NULL);
+	assert(src != NULL && *src != NULL);
+	assert(end != NULL);
+	assert(dst != NULL && *dst != NULL);
+
+	f = p->fctx;
+
+	assert(!f->active);
+	assert(f->count == 0);
+
+	do {
+		if (f->count > 0 && f->stage[f->count - 1].type == FILTER_COUNT) {
+			cl_printf(p, "count must be the last filter\n");
+			return 0;
+		}
+
+		if (lex_next(&tok, src, end, dst) == NULL) {
+			cl_printf(p, "filter expected\n");
+			return 0;
+		}
+
+		if (tok.type != TOK_WORD) {
+			cl_printf(p, "syntax error at: %.*s\n",
+				(int) (tok.src.end - tok.src.start), tok.src.start);
+			return 0;
+		}
+
+		i = findfilter(tok.dst.start, tok.dst.end - tok.dst.start);
+		if (i == -1) {
+			cl_printf(p, "unknown filter: %s\n", tok.dst.start);
+			return 0;
+		}
+
+		if (f->count == f->size) {
+			size_t size;
+
+			size = f->size == 0 ? 4 : f->size * 2;
+
+			st = realloc(f->stage, sizeof *f->stage * size);
+			if (st == NULL) {
+				return -1;
+			}
+
+			f->stage = st;
+			f->size  = size;
+		}
+
+		st = &f->stage[f->count];
+
+		st->type = filters[i].type;
+		st->n    = 0;
+
+		if (filters[i].pattern) {
+			if (lex_next(&tok, src, end, dst) == NULL
+			|| (tok.type != TOK_WORD && tok.type != TOK_STRING)) {
+				cl_printf(p, "%s: pattern expected\n", filters[i].name);
+				return 0;
+			}
+
+			e = regcomp(&st->re, tok.dst.start, REG_EXTENDED | REG_NOSUB);
+			if (e != 0) {
+				char msg[128];
+
+				regerror(e, &st->re, msg, sizeof msg);
+				cl_printf(p, "%s: %s\n", filters[i].name, msg);
+				return 0;
+			}
+		}
+
+		f->count++;
+
+		if (lex_next(&tok, src, end, dst) == NULL) {
+			return 1;
+		}
+	} while (tok.type == TOK_PIPE);
+
+	cl_printf(p, "syntax error at: %.*s\n",
+		(int) (tok.src.end - tok.src.start), tok.src.start);
+
+	return 0;
+}
+
+int
+filter_active(const struct filterctx *f)
+{
+	assert(f != NULL);
+
+	return f->active;
+}
+
+void
+filter_begin(struct filterctx *f)
+{
+	assert(f != NULL);
+	assert(!f->active);
+
+	f->active = f->count > 0;
+	f->len    = 0;
+}
+
+/*
+ * Pass one line through the filters, and on down the chain if it survives.
+ * The line is terminated in place for regexec(); there is always room.
+ */
+static int
+line(struct cl_peer *p, char *s, size_t n, int nl)
+{
+	struct filterctx *f;
+	struct cl_chctx *head;
+	struct stage *st;
+	size_t i;
+	char c;
+
+	assert(p != NULL);
+	assert(p->fctx != NULL);
+	assert(s != NULL);
+
+	f = p->fctx;
+
+	c = s[n];
+	s[n] = '\0';
+
+	for (i = 0; i < f->count; i++) {
+		st = &f->stage[i];
+
+		switch (st->type) {
+		case FILTER_INCLUDE:
+			if (0 != regexec(&st->re, s, 0, NULL, 0)) {
+				goto drop;
+			}
+			continue;
+
+		case FILTER_EXCLUDE:
+			if (0 == regexec(&st->re, s, 0, NULL, 0)) {
+				goto drop;
+			}
+			continue;
+
+		case FILTER_BEGIN:
+			if (st->n == 0 && 0 != regexec(&st->re, s, 0, NULL, 0)) {
+				goto drop;
+			}
+			st->n++;
+			continue;
+
+		case FILTER_COUNT:
+			st->n++;
+			goto drop;
+		}
+	}
+
+	s[n] = c;
+
+	head = &p->chctx[0];
+
+	assert(head->ioapi != NULL);
+	assert(head->ioapi->write != NULL);
+
+	if (-1 == head->ioapi->write(p, head, s, n + (nl ? 1 : 0))) {
+		return -1;
+	}
+
+	return 0;
+
+drop:
+
+	s[n] = c;
+
+	return 0;
+}
+
+/* room for n more bytes, and a terminator, which line() relies on */
+static int
+reserve(struct filterctx *f, size_t n)
+{
+	size_t size;
+	char *tmp;
+
+	assert(f != NULL);
+
+	if (f->len + n < f->bufsz) {
+		return 0;
+	}
+
+	size = f->bufsz == 0 ? 128 : f->bufsz;
+	while (size <= f->len + n) {
+		size *= 2;
+	}
+
+	tmp = realloc(f->buf, size);
+	if (tmp == NULL) {
+		return -1;
+	}
+
+	f->buf   = tmp;
+	f->bufsz = size;
+
+	return 0;
+}
+
+/* pass on each line completed by the n bytes just appended */
+static int
+lines(struct cl_peer *p, struct filterctx *f, size_t n)
+{
+	char *s, *nl;
+
+	assert(p != NULL);
+	assert(f != NULL);
+
+	/* only the new text can hold a newline */
+	s = f->buf;
+	n += f->len;
+
+	for (nl = f->buf + f->len; (nl = memchr(nl, '\n', n - (nl - f->buf))) != NULL; nl++) {
+		if (-1 == line(p, s, nl - s, 1)) {
+			return -1;
+		}
+
+		s = nl + 1;
+	}
+
+	f->len = n - (s - f->buf);
+	memmove(f->buf, s, f->len);
+
+	return 0;
+}
+
+int
+filter_vprintf(struct cl_peer *p, const char *fmt, va_list ap)
+{
+	struct filterctx *f;
+	int r;
+
+	assert(p != NULL);
+	assert(p->fctx != NULL);
+	assert(fmt != NULL);
+
+	f = p->fctx;
+
+	assert(f->active);
+
+	for (;;) {
+		r = fmt_vsnprintf(f->buf == NULL ? NULL : f->buf + f->len, f->bufsz - f->len, fmt, ap);
+
+		if (r < 0) {
+			return -1;
+		}
+
+		if ((size_t) r < f->bufsz - f->len) {
+			break;
+		}
+
+		if (-1 == reserve(f, r)) {
+			return -1;
+		}
+	}
+
+	if (-1 == lines(p, f, r)) {
+		return -1;
+	}
+
+	return r;
+}
+
+ssize_t
+filter_write(struct cl_peer *p, const void *data, size_t len)
+{
+	struct filterctx *f;
+
+	assert(p != NULL);
+	assert(p->fctx != NULL);
+	assert(data != NULL || len == 0);
+
+	f = p->fctx;
+
+	assert(f->active);
+
+	if (len > SSIZE_MAX) {
+		len = SSIZE_MAX;
+	}
+
+	if (-1 == reserve(f, len)) {
+		return -1;
+	}
+
+	memcpy(f->buf + f->len, data, len);
+
+	if (-1 == lines(p, f, len)) {
+		return -1;
+	}
+
+	return len;
+}
+
+/*
+ * The command is done; any unterminated line is filtered as it stands,
+ * and counts are given.
+ */
+int
+filter_end(struct cl_peer *p)
+{
+	struct filterctx *f;
+	size_t i;
+	int r;
+
+	assert(p != NULL);
+	assert(p->fctx != NULL);
+
+	f = p->fctx;
+	r = 0;
+
+	if (f->active) {
+		if (f->len > 0 && -1 == line(p, f->buf, f->len, 0)) {
+			r = -1;
+		}
+
+		f->active = 0;
+
+		for (i = 0; i < f->count; i++) {
+			if (f->stage[i].type == FILTER_COUNT) {
+				cl_printf(p, "Count: %lu lines\n", f->stage[i].n);
+			}
+		}
+	}
+
+	reset(f);
+
+	return r;
+}
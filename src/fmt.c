@@ -0,0 +1,47 @@
+/*
+ * Copyright 2012-2017 Katherine Flavel
+ *
+ * See LICENCE for the full copyright terms.
+ */
+
+/* for vsnprintf(), which SUSv2 has ahead of C99 */
+#define _XOPEN_SOURCE 500
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "internal.h"
+
+/*
+ * va_copy() is C99. Before that, most compilers provide __va_copy(), and
+ * elsewhere a va_list is a plain pointer (or scalar), which may be assigned.
+ */
+#ifndef va_copy
+# ifdef __va_copy
+#  define va_copy(dst, src) __va_copy((dst), (src))
+# else
+#  define va_copy(dst, src) ((dst) = (src))
+# endif
+#endif
+
+/*
+ * vsnprintf() on a copy of ap, so that the caller may format again into a
+ * larger buffer given the length returned.
+ */
+int
+fmt_vsnprintf(char *s, size_t n, const char *fmt, va_list ap)
+{
+	va_list aq;
+	int r;
+
+	assert(s != NULL || n == 0);
+	assert(fmt != NULL);
+
+	va_copy(aq, ap);
+	r = vsnprintf(s, n, fmt, aq);
+	va_end(aq);
+
+	return r;
+}
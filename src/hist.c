@@ -0,0 +1,888 @@
+/*
+ * Copyright 2012-2017 Katherine Flavel
+ *
+ * See LICENCE for the full copyright terms.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <cl/tree.h>
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+/*
+ * Command history, per peer. Lines are appended to a log of fixed size,
+ * which is either allocated once, or else mapped from a file shared by
+ * every session given the same key; see cl_set_history_key().
+ *
+ * Each record is the line's text followed by its length in two bytes, so
+ * the log is walked backwards from its end, newest first, and nothing need
+ * be read when a file is opened. Records are only ever appended; when the
+ * log is full, it is compacted by moving the newest half down to the start,
+ * and the rest is forgotten.
+ *
+ * Lines are numbered by age; 1 is the most recent. Every append makes each
+ * line older by one, whichever session appends, so an age is good only for
+ * the count of records it was found with. Within a generation, an age is
+ * brought up to date by the records added since; see aged().
+ *
+ * A file is written to under an fcntl() lock, since other processes may be
+ * appending to it too. Its contents are trusted no further than that: the
+ * writeback is asynchronous and unordered, so after a crash a record may be
+ * counted before it reached the disk. Every length is checked as the log
+ * is walked, and a record which does not fit is taken as the end of the
+ * history. The next compaction drops it and everything older.
+ */
+
+#define HIST_SIZE  16384
+#define HIST_LINE  4096  /* longest line kept; at most a quarter of the log */
+#define HIST_SYNC  16    /* appends between writebacks for a file */
+#define HIST_MAGIC "libcl-h1"
+
+struct histhdr {
+	char magic[8];
+	unsigned long size;  /* bytes of log following the header */
+	unsigned long used;
+	unsigned long count; /* records */
+	unsigned long gen;   /* compactions, for anything holding offsets */
+};
+
+/* an occurrence of the search query */
+struct hit {
+	size_t age;
+	size_t off; /* of the record */
+	size_t len;
+	size_t at;
+};
+
+struct histctx {
+	struct histhdr *hdr;
+	char *log;
+
+	int fd;          /* -1 when allocated */
+	size_t mapsz;
+	unsigned pending;
+
+	/* the last record found, since lines are mostly visited in turn */
+	size_t walk_age;
+	size_t walk_end;
+	unsigned long walk_count;
+	unsigned long walk_gen;
+
+	/* the log as it was when an age was last handed out; see hist_age() */
+	unsigned long seen_count;
+	unsigned long seen_gen;
+
+	/*
+	 * Incremental search. The hits are every occurrence of the query,
+	 * newest first; a character added to the query need only be checked
+	 * at each hit, and the hits which fail are dropped.
+	 */
+	char *q;
+	size_t qlen;
+	size_t qsize;
+
+	struct hit *hit;
+	size_t hit_count;
+	size_t hit_size;
+	size_t match; /* index into hit[] */
+	unsigned long hit_count_at; /* records in the log when scanned */
+	unsigned long hit_gen;
+};
+
+static void
+init(struct histhdr *hdr, size_t size)
+{
+	assert(hdr != NULL);
+
+	memcpy(hdr->magic, HIST_MAGIC, sizeof hdr->magic);
+	hdr->size  = size;
+	hdr->used  = 0;
+	hdr->count = 0;
+	hdr->gen   = 0;
+}
+
+struct histctx *
+hist_create(void)
+{
+	struct histctx *new;
+
+	new = malloc(sizeof *new);
+	if (new == NULL) {
+		return NULL;
+	}
+
+	new->hdr = malloc(sizeof *new->hdr + HIST_SIZE);
+	if (new->hdr == NULL) {
+		free(new);
+		return NULL;
+	}
+
+	init(new->hdr, HIST_SIZE);
+
+	new->log     = (char *) (new->hdr + 1);
+	new->fd      = -1;
+	new->mapsz   = 0;
+	new->pending = 0;
+
+	new->walk_age = 0;
+
+	new->seen_count = 0;
+	new->seen_gen   = 0;
+
+	new->q     = NULL;
+	new->qlen  = 0;
+	new->qsize = 0;
+
+	new->hit       = NULL;
+	new->hit_count = 0;
+	new->hit_size  = 0;
+	new->match     = 0;
+	new->hit_count_at = 0;
+	new->hit_gen   = 0;
+
+	return new;
+}
+
+static void
+release(struct histctx *h)
+{
+	assert(h != NULL);
+
+	if (h->fd == -1) {
+		free(h->hdr);
+		return;
+	}
+
+	/* writeback is left to the kernel; closing never waits for the disk */
+	(void) msync(h->hdr, h->mapsz, MS_ASYNC);
+	(void) munmap(h->hdr, h->mapsz);
+	(void) close(h->fd);
+}
+
+void
+hist_destroy(struct histctx *h)
+{
+	assert(h != NULL);
+
+	release(h);
+
+	free(h->q);
+	free(h->hit);
+	free(h);
+}
+
+/* the header of a log of the given size, as far as it can be checked */
+static int
+sane(const struct histhdr *hdr, size_t size)
+{
+	assert(hdr != NULL);
+
+	return 0 == memcmp(hdr->magic, HIST_MAGIC, sizeof hdr->magic)
+		&& hdr->size == size && hdr->used <= hdr->size
+		&& hdr->count <= hdr->used / 3;
+}
+
+/* a file's log is locked around changes; an allocated log needs none */
+static int
+lock(int fd, short type)
+{
+	struct flock fl;
+
+	if (fd == -1) {
+		return 0;
+	}
+
+	fl.l_type   = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start  = 0;
+	fl.l_len    = 0;
+
+	while (-1 == fcntl(fd, F_SETLKW, &fl)) {
+		if (errno != EINTR) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * The record ending at the given offset, starting at *off. Returns 0 if
+ * there is no such record, or if it doesn't fit within the log.
+ */
+static int
+prev(const struct histhdr *hdr, const char *log, size_t end,
+	size_t *off, size_t *len)
+{
+	const unsigned char *t;
+
+	assert(hdr != NULL);
+	assert(log != NULL);
+	assert(off != NULL);
+	assert(len != NULL);
+
+	if (end < 2 || end > hdr->used || hdr->used > hdr->size) {
+		return 0;
+	}
+
+	t = (const unsigned char *) log + end - 2;
+
+	*len = (size_t) t[0] << 8 | t[1];
+
+	if (*len > end - 2) {
+		return 0;
+	}
+
+	*off = end - 2 - *len;
+
+	return 1;
+}
+
+/*
+ * An age found when the log held the given count of records, as it is now.
+ * Records are only appended within a generation, so each one since makes
+ * the line a year older. A compaction leaves no telling how many records
+ * were appended around it, and the age is then kept as it was.
+ */
+static size_t
+aged(const struct histhdr *hdr, size_t age, unsigned long count, unsigned long gen)
+{
+	assert(hdr != NULL);
+
+	if (age == 0 || gen != hdr->gen || count > hdr->count) {
+		return age;
+	}
+
+	return age + (hdr->count - count);
+}
+
+/* the record of the given age; returns 0 if the log ends before it */
+static int
+find(struct histctx *h, size_t age, size_t *off, size_t *len)
+{
+	size_t a, end;
+
+	assert(h != NULL);
+	assert(age > 0);
+	assert(off != NULL);
+	assert(len != NULL);
+
+	if (age > h->hdr->count) {
+		return 0;
+	}
+
+	a   = 1;
+	end = h->hdr->used;
+
+	/* the cached record's offset stands for as long as its age can be told */
+	if (h->walk_age > 0 && h->walk_gen == h->hdr->gen
+	&& h->walk_count <= h->hdr->count) {
+		size_t w;
+
+		w = aged(h->hdr, h->walk_age, h->walk_count, h->walk_gen);
+		if (w <= age) {
+			a   = w;
+			end = h->walk_end;
+		}
+	}
+
+	for (;;) {
+		if (!prev(h->hdr, h->log, end, off, len)) {
+			return 0;
+		}
+
+		if (a == age) {
+			break;
+		}
+
+		end = *off;
+		a++;
+	}
+
+	h->walk_age   = age;
+	h->walk_end   = end;
+	h->walk_count = h->hdr->count;
+	h->walk_gen   = h->hdr->gen;
+
+	return 1;
+}
+
+/* keep the newest records which fit in half the log */
+static void
+compact(struct histhdr *hdr, char *log)
+{
+	size_t end, off, len, count;
+
+	assert(hdr != NULL);
+	assert(log != NULL);
+
+	end   = hdr->used;
+	count = 0;
+
+	while (end > 0) {
+		/* a bad record ends the history; it and anything older are dropped */
+		if (!prev(hdr, log, end, &off, &len)) {
+			break;
+		}
+
+		if (hdr->used - off > hdr->size / 2) {
+			break;
+		}
+
+		end = off;
+		count++;
+	}
+
+	memmove(log, log + end, hdr->used - end);
+
+	hdr->used  -= end;
+	hdr->count  = count;
+	hdr->gen++;
+}
+
+static void
+append(struct histhdr *hdr, char *log, const char *s, size_t n)
+{
+	unsigned char *t;
+
+	assert(hdr != NULL);
+	assert(log != NULL);
+	assert(s != NULL);
+	assert(n <= HIST_LINE && n + 2 <= hdr->size / 4);
+
+	if (hdr->used + n + 2 > hdr->size) {
+		compact(hdr, log);
+	}
+
+	memcpy(log + hdr->used, s, n);
+
+	t = (unsigned char *) log + hdr->used + n;
+	t[0] = n >> 8;
+	t[1] = n & 0xff;
+
+	/* the record is complete before it is counted */
+	hdr->used += n + 2;
+	hdr->count++;
+}
+
+/*
+ * Blank lines are not kept, and neither is a line the same as the one
+ * before it, nor a line too long for the log.
+ */
+int
+hist_add(struct histctx *h, const char *s, size_t n)
+{
+	size_t i, size, off, len;
+
+	assert(h != NULL);
+	assert(s != NULL);
+
+	for (i = 0; i < n; i++) {
+		if (!lex_space(s[i])) {
+			break;
+		}
+	}
+
+	size = h->fd == -1 ? HIST_SIZE : h->mapsz - sizeof *h->hdr;
+
+	if (i == n || n > HIST_LINE || n + 2 > size / 4) {
+		return 0;
+	}
+
+	if (-1 == lock(h->fd, F_WRLCK)) {
+		return -1;
+	}
+
+	/* another process may have left the header in any state */
+	if (!sane(h->hdr, size)) {
+		init(h->hdr, size);
+	}
+
+	if (find(h, 1, &off, &len) && len == n && 0 == memcmp(h->log + off, s, n)) {
+		return lock(h->fd, F_UNLCK);
+	}
+
+	append(h->hdr, h->log, s, n);
+
+	if (-1 == lock(h->fd, F_UNLCK)) {
+		return -1;
+	}
+
+	/* a file is written back now and then, and never waited for */
+	if (h->fd != -1 && ++h->pending >= HIST_SYNC) {
+		h->pending = 0;
+
+		if (-1 == msync(h->hdr, h->mapsz, MS_ASYNC)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Switch to a log kept in the given file, creating it of the given size
+ * if need be. An existing file keeps the size it was made with. Lines
+ * entered so far are carried over, oldest first.
+ */
+int
+hist_open(struct histctx *h, const char *path, size_t size)
+{
+	struct histhdr *hdr;
+	struct stat st;
+	size_t mapsz, age;
+	int fd;
+
+	assert(h != NULL);
+	assert(path != NULL);
+
+	if (size < HIST_SIZE) {
+		size = HIST_SIZE;
+	}
+
+	fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (fd == -1) {
+		return -1;
+	}
+
+	if (-1 == fstat(fd, &st)) {
+		goto error;
+	}
+
+	if ((size_t) st.st_size >= sizeof *hdr + HIST_SIZE) {
+		mapsz = st.st_size;
+	} else {
+		mapsz = sizeof *hdr + size;
+
+		if (-1 == ftruncate(fd, mapsz)) {
+			goto error;
+		}
+	}
+
+	hdr = mmap(NULL, mapsz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) {
+		goto error;
+	}
+
+	if (-1 == lock(fd, F_WRLCK)) {
+		(void) munmap(hdr, mapsz);
+		goto error;
+	}
+
+	/* a log which isn't ours, or which doesn't add up, is started afresh */
+	if (!sane(hdr, mapsz - sizeof *hdr)) {
+		init(hdr, mapsz - sizeof *hdr);
+	}
+
+	for (age = h->hdr->count; age > 0; age--) {
+		size_t off, len;
+
+		if (!find(h, age, &off, &len)) {
+			continue;
+		}
+
+		append(hdr, (char *) (hdr + 1), h->log + off, len);
+	}
+
+	if (-1 == lock(fd, F_UNLCK)) {
+		(void) munmap(hdr, mapsz);
+		goto error;
+	}
+
+	release(h);
+
+	h->hdr     = hdr;
+	h->log     = (char *) (hdr + 1);
+	h->fd      = fd;
+	h->mapsz   = mapsz;
+	h->pending = 0;
+
+	h->walk_age   = 0;
+	h->hit_count  = 0;
+	h->seen_count = hdr->count;
+	h->seen_gen   = hdr->gen;
+
+	return 0;
+
+error:
+
+	{
+		int e;
+
+		e = errno;
+		(void) close(fd);
+		errno = e;
+	}
+
+	return -1;
+}
+
+/*
+ * An age handed out by hist_get() or hist_search_match(), as it is now;
+ * other sessions sharing the log may have appended to it meanwhile.
+ * 0, for no line, stays 0.
+ */
+size_t
+hist_age(const struct histctx *h, size_t age)
+{
+	assert(h != NULL);
+
+	return aged(h->hdr, age, h->seen_count, h->seen_gen);
+}
+
+/* the line of the given age, or NULL if there is none so old */
+const char *
+hist_get(struct histctx *h, size_t age, size_t *n)
+{
+	size_t off;
+
+	assert(h != NULL);
+	assert(age > 0);
+	assert(n != NULL);
+
+	if (!find(h, age, &off, n)) {
+		return NULL;
+	}
+
+	h->seen_count = h->hdr->count;
+	h->seen_gen   = h->hdr->gen;
+
+	return h->log + off;
+}
+
+void
+hist_search_begin(struct histctx *h)
+{
+	assert(h != NULL);
+
+	h->qlen      = 0;
+	h->hit_count = 0;
+	h->match     = 0;
+}
+
+static int
+addhit(struct histctx *h, size_t age, size_t off, size_t len, size_t at)
+{
+	struct hit *hit;
+
+	assert(h != NULL);
+
+	if (h->hit_count == h->hit_size) {
+		struct hit *tmp;
+		size_t size;
+
+		size = h->hit_size == 0 ? 32 : h->hit_size * 2;
+
+		tmp = realloc(h->hit, sizeof *h->hit * size);
+		if (tmp == NULL) {
+			return -1;
+		}
+
+		h->hit      = tmp;
+		h->hit_size = size;
+	}
+
+	hit = &h->hit[h->hit_count];
+
+	hit->age = age;
+	hit->off = off;
+	hit->len = len;
+	hit->at  = at;
+
+	h->hit_count++;
+
+	return 0;
+}
+
+/* the first hit at least as old as the given age, else the first hit */
+static size_t
+seek(const struct histctx *h, size_t age)
+{
+	size_t i;
+
+	assert(h != NULL);
+	assert(h->hit_count > 0);
+
+	for (i = 0; i < h->hit_count; i++) {
+		if (h->hit[i].age >= age) {
+			return i;
+		}
+	}
+
+	return 0;
+}
+
+/* find every occurrence of the query; this is the only walk over the log */
+static int
+scan(struct histctx *h)
+{
+	size_t age, end;
+
+	assert(h != NULL);
+	assert(h->qlen > 0);
+
+	h->hit_count    = 0;
+	h->hit_count_at = h->hdr->count;
+	h->hit_gen      = h->hdr->gen;
+
+	end = h->hdr->used;
+
+	for (age = 1; age <= h->hdr->count; age++) {
+		const char *s, *p;
+		size_t off, len;
+
+		if (!prev(h->hdr, h->log, end, &off, &len)) {
+			break;
+		}
+
+		end = off;
+
+		if (len < h->qlen) {
+			continue;
+		}
+
+		s = h->log + off;
+
+		for (p = s; (p = memchr(p, h->q[0], len - h->qlen + 1 - (p - s))) != NULL; p++) {
+			if (0 != memcmp(p, h->q, h->qlen)) {
+				continue;
+			}
+
+			if (-1 == addhit(h, age, off, len, p - s)) {
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Hits hold offsets into the log, which stay good as lines are appended,
+ * but not when another session sharing the log compacts it.
+ */
+static int
+refresh(struct histctx *h)
+{
+	size_t age;
+
+	assert(h != NULL);
+
+	if (h->hit_count == 0 || h->hit_gen == h->hdr->gen) {
+		return 0;
+	}
+
+	age = aged(h->hdr, h->hit[h->match].age, h->hit_count_at, h->hit_gen);
+
+	if (-1 == scan(h)) {
+		return -1;
+	}
+
+	if (h->hit_count > 0) {
+		h->match = seek(h, age);
+	}
+
+	return 0;
+}
+
+/* the current match, if any, and where the query falls within it */
+const char *
+hist_search_match(struct histctx *h, size_t *n, size_t *age, size_t *at)
+{
+	const struct hit *hit;
+
+	assert(h != NULL);
+	assert(n != NULL);
+	assert(age != NULL);
+	assert(at != NULL);
+
+	if (h->hit_count == 0) {
+		return NULL;
+	}
+
+	assert(h->match < h->hit_count);
+	assert(h->hit_gen == h->hdr->gen);
+
+	hit = &h->hit[h->match];
+
+	*n   = hit->len;
+	*age = aged(h->hdr, hit->age, h->hit_count_at, h->hit_gen);
+	*at  = hit->at;
+
+	h->seen_count = h->hdr->count;
+	h->seen_gen   = h->hdr->gen;
+
+	return h->log + hit->off;
+}
+
+/*
+ * Extend the query. Returns 0, leaving everything as it was, if nothing
+ * from the current match on has the longer query.
+ */
+int
+hist_search_push(struct histctx *h, const char *s, size_t n)
+{
+	size_t age, qlen, i, j, k;
+
+	assert(h != NULL);
+	assert(s != NULL);
+
+	if (n == 0) {
+		return 1;
+	}
+
+	if (-1 == refresh(h)) {
+		return -1;
+	}
+
+	if (h->qlen + n > h->qsize) {
+		size_t size;
+		char *tmp;
+
+		size = h->qsize == 0 ? 32 : h->qsize;
+		while (size < h->qlen + n) {
+			size *= 2;
+		}
+
+		tmp = realloc(h->q, size);
+		if (tmp == NULL) {
+			return -1;
+		}
+
+		h->q     = tmp;
+		h->qsize = size;
+	}
+
+	age  = h->hit_count == 0 ? 1 : h->hit[h->match].age;
+	qlen = h->qlen;
+
+	memcpy(h->q + h->qlen, s, n);
+	h->qlen += n;
+
+	if (qlen == 0) {
+		if (-1 == scan(h)) {
+			h->qlen = qlen;
+			return -1;
+		}
+
+		if (h->hit_count == 0) {
+			h->qlen = qlen;
+			return 0;
+		}
+
+		h->match = seek(h, age);
+
+		return 1;
+	}
+
+	/* the first hit to survive which is at least as old as the current match */
+	k = h->hit_count;
+
+	for (i = 0; i < h->hit_count; i++) {
+		const struct hit *hit = &h->hit[i];
+
+		if (hit->age >= age && hit->at + h->qlen <= hit->len
+		&& 0 == memcmp(h->log + hit->off + hit->at + qlen, s, n)) {
+			k = i;
+			break;
+		}
+	}
+
+	if (k == h->hit_count) {
+		h->qlen = qlen;
+		return 0;
+	}
+
+	for (i = 0, j = 0; i < h->hit_count; i++) {
+		const struct hit *hit = &h->hit[i];
+
+		if (hit->at + h->qlen > hit->len
+		|| 0 != memcmp(h->log + hit->off + hit->at + qlen, s, n)) {
+			continue;
+		}
+
+		if (i == k) {
+			h->match = j;
+		}
+
+		h->hit[j++] = *hit;
+	}
+
+	h->hit_count = j;
+
+	return 1;
+}
+
+/* shorten the query by n bytes, keeping to the current match if possible */
+int
+hist_search_pop(struct histctx *h, size_t n)
+{
+	size_t age;
+
+	assert(h != NULL);
+
+	if (n > h->qlen) {
+		n = h->qlen;
+	}
+
+	age = h->hit_count == 0 ? 1
+		: aged(h->hdr, h->hit[h->match].age, h->hit_count_at, h->hit_gen);
+
+	h->qlen -= n;
+
+	if (h->qlen == 0) {
+		h->hit_count = 0;
+		h->match     = 0;
+		return 0;
+	}
+
+	if (-1 == scan(h)) {
+		return -1;
+	}
+
+	if (h->hit_count > 0) {
+		h->match = seek(h, age);
+	}
+
+	return 0;
+}
+
+/* the next older line with the query; returns 0 if there is none */
+int
+hist_search_next(struct histctx *h)
+{
+	size_t i;
+
+	assert(h != NULL);
+
+	if (-1 == refresh(h)) {
+		return -1;
+	}
+
+	if (h->hit_count == 0) {
+		return 0;
+	}
+
+	for (i = h->match + 1; i < h->hit_count; i++) {
+		if (h->hit[i].age > h->hit[h->match].age) {
+			h->match = i;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
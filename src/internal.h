@@ -8,13 +8,18 @@
 #define LIBCL_INTERNAL_H
 
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <limits.h>
 #include <stddef.h>
 #include <stdarg.h>
 
+#include <cl/tree.h>
+#include <cl/static.h>
+
 enum ui_event {
 	UI_CODEPOINT,
+	UI_TEXT,
 	UI_HELP,
 
 	UI_BACKSPACE,
@@ -26,6 +31,7 @@ enum ui_event {
 
 	UI_HIST_PREV,
 	UI_HIST_NEXT,
+	UI_HIST_SEARCH,
 
 	UI_CURSOR_LEFT,
 	UI_CURSOR_RIGHT,
@@ -35,8 +41,12 @@ enum ui_event {
 	UI_CURSOR_SOL
 };
 
+/* counted operations are given a number of characters; others are given 0 */
 enum ui_output {
-	OUT_BACKSPACE_AND_DELETE,
+	OUT_BACKSPACE_AND_DELETE, /* counted */
+	OUT_CURSOR_LEFT,          /* counted */
+	OUT_DELETE,               /* counted; characters at the cursor */
+	OUT_DELETE_TO_EOL,        /* counted; the most characters shown there */
 	OUT_SAVE,
 	OUT_RESTORE_AND_DELETE_TO_EOL
 };
@@ -50,8 +60,16 @@ enum edit_flags {
 struct cl_peer;
 struct cl_command;
 
+struct helpcache {
+	const struct cl_trie *trie;
+	int mode;
+	size_t len;
+	char *s;
+};
+
 struct cl_tree {
-	struct trie *root;
+	const struct cl_trie *root;
+	struct cl_trie *trie; /* owned by cl_create(); NULL for a compiled tree */
 
 	size_t command_count;
 	const struct cl_command *commands;
@@ -64,6 +82,22 @@ struct cl_tree {
 	int (*printprompt)(struct cl_peer *p, int mode);
 	int (*visible)(struct cl_peer *p, int mode, int modes);
 	int (*vprintf)(struct cl_peer *p, const char *fmt, va_list ap);
+	ssize_t (*write)(struct cl_peer *p, const void *data, size_t len);
+
+	/* queued output past which cl_read() stops consuming input */
+	size_t output_limit;
+
+	/* milliseconds to wait for a telnet peer's terminal type; 0 to wait indefinitely */
+	unsigned ttype_timeout;
+
+	enum cl_help helpmode;
+
+	/* where history files are kept, for cl_set_history_key(); NULL for none */
+	char *histdir;
+	size_t histsize;
+
+	/* rendered trie_help(), for cl_visible() only; prime to spread single-bit modes */
+	struct helpcache help[13];
 };
 
 struct cl_event {
@@ -71,15 +105,35 @@ struct cl_event {
 
 	union {
 		const char *utf8;	/* UI_CODEPOINT */
+		struct {
+			const char *s;
+			size_t n;
+		} text;			/* UI_TEXT; no line endings or control characters */
 	} u;
 };
 
+/* see key.c; a few bytes of a key sequence split between reads */
+struct keyctx {
+	unsigned char state;
+	unsigned char param; /* CSI's first parameter */
+	unsigned char semi;  /* past CSI's first parameter */
+	unsigned char need;  /* UTF-8 continuation bytes to come */
+	unsigned char len;
+	unsigned char cr;    /* the last key was CR */
+	char utf8[5];
+};
+
 struct cl_term {
 	const char *cub1; /* cursor left */
 	const char *dch1; /* delete character */
 	const char *el;   /* clear to EOL */
 	const char *sc;   /* save cursor */
 	const char *rc;   /* restore cursor */
+
+	/* parameterized; see term_param() */
+	const char *cub;  /* cursor left n */
+	const char *dch;  /* delete n characters */
+	const char *ech;  /* erase n characters */
 };
 
 struct ioctx;
@@ -91,12 +145,19 @@ struct io {
 	ssize_t     (*read)(struct cl_peer *p, struct cl_chctx *chctx,
 	                    const void *data, size_t len);
 	ssize_t     (*send)(struct cl_peer *p, struct cl_chctx *chctx,
-	                    enum ui_output output);
+	                    enum ui_output output, size_t n);
 	int         (*vprintf)(struct cl_peer *p, struct cl_chctx *chctx,
 	                      const char *fmt, va_list ap);
 	int         (*printf)(struct cl_peer *p, struct cl_chctx *chctx,
 	                      const char *fmt, ...);
+	ssize_t     (*write)(struct cl_peer *p, struct cl_chctx *chctx,
+	                     const void *data, size_t len);
+	ssize_t     (*writev)(struct cl_peer *p, struct cl_chctx *chctx,
+	                      const struct iovec *iov, int iovcnt);
 	const char *(*ttype)(struct cl_peer *p, struct cl_chctx *chctx);
+	int         (*flush)(struct cl_peer *p, struct cl_chctx *chctx);
+	size_t      (*pending)(struct cl_peer *p, struct cl_chctx *chctx);
+	int         (*tick)(struct cl_peer *p, struct cl_chctx *chctx);
 };
 
 struct cl_chctx {
@@ -104,21 +165,6 @@ struct cl_chctx {
 	struct ioctx    *ioctx;
 };
 
-struct trie_command {
-	const char *command;
-	int modes;
-	int fields;
-
-	void (*callback)(struct cl_peer *p, const char *command, int mode,
-		int argc, const char *argv[]);
-};
-
-struct trie {
-	struct trie *edge[UCHAR_MAX + 1];
-
-	struct trie_command *command;
-};
-
 struct termctx;
 
 struct cl_chain;
@@ -133,10 +179,15 @@ struct cl_peer {
 	struct termctx *tctx;
 	struct readctx *rctx;
 	struct editctx *ectx;
+	struct filterctx *fctx;
+	struct histctx *hctx;
 	struct cl_chctx *chctx;
 
 	const struct cl_chain *chain;
 
+	/* a command has left output queued past the limit; cl_read() ends there */
+	int stalled;
+
 	void *opaque;
 };
 
@@ -155,39 +206,101 @@ struct lex_tok {
 	} src, dst;
 };
 
-struct trie *
-trie_add(struct trie **trie, const char *s, const struct cl_command *command);
-const struct trie *
-trie_walk(const struct trie *trie, const char *s, size_t len);
-const struct trie *
-trie_cycle(struct cl_peer *p, const struct trie *trie, int mode, char c,
-	const struct trie *prev);
+/*
+ * A token in the edit buffer, with its position in the trie. Offsets are
+ * used rather than pointers, since the buffer is reallocated as it grows.
+ */
+struct edit_tok {
+	enum lex_type type;
+	size_t start;
+	size_t end;
 
-/* returns NULL for ambiguity */
-const struct trie *
-trie_run(struct cl_peer *p, const struct trie *trie, int mode, char c);
+	const struct cl_trie *word; /* where the word starts; NULL once off the trie */
+	const struct cl_trie *trie; /* where its text leads, or NULL */
+	size_t off;              /* characters consumed along trie's label */
+	const struct cl_trie *run;  /* the command or space it resolves to, if any */
+};
 
+struct cl_trie *
+trie_create(size_t count, const struct cl_command *commands);
 void
-trie_help(struct cl_peer *p, const struct trie *trie, int mode);
+trie_destroy(struct cl_trie *trie);
+const struct cl_trie *
+trie_walk(const struct cl_trie *trie, const char *s, size_t len);
+
+const struct cl_trie *
+trie_exact(struct cl_peer *p, const struct cl_trie *trie, int mode);
+
+/* returns NULL for ambiguity */
+const struct cl_trie *
+trie_run(struct cl_peer *p, const struct cl_trie *trie, int mode, char c);
+
+int
+trie_help(struct cl_peer *p, const struct cl_trie *trie, int mode);
+int
+trie_words(struct cl_peer *p, const struct cl_trie *trie, int mode);
+size_t
+trie_prefix(struct cl_peer *p, const struct cl_trie *trie, int mode,
+	const char **s, size_t *len);
 
 const struct cl_field *
 find_field(struct cl_tree *t, int id);
 
+unsigned long
+compile_sum(size_t command_count, const struct cl_command commands[],
+	size_t field_count, const struct cl_field fields[]);
+
+struct arena *arena_create(void);
+void arena_destroy(struct arena *a);
+void *arena_alloc(struct arena *a, size_t n);
+void arena_reset(struct arena *a);
+
+int fmt_vsnprintf(char *s, size_t n, const char *fmt, va_list ap);
+
 struct readctx *read_create(void);
 void read_destroy(struct readctx *read);
 const char *read_get_field(struct readctx *rc, int id);
 int getc_main(struct cl_peer *p, const struct cl_event *event);
 
+struct filterctx *filter_create(void);
+void filter_destroy(struct filterctx *f);
+int filter_parse(struct cl_peer *p, const char **src, const char *end, char **dst);
+int filter_active(const struct filterctx *f);
+void filter_begin(struct filterctx *f);
+int filter_vprintf(struct cl_peer *p, const char *fmt, va_list ap);
+ssize_t filter_write(struct cl_peer *p, const void *data, size_t len);
+int filter_end(struct cl_peer *p);
+
+struct histctx *hist_create(void);
+void hist_destroy(struct histctx *h);
+int hist_add(struct histctx *h, const char *s, size_t n);
+int hist_open(struct histctx *h, const char *path, size_t size);
+size_t hist_age(const struct histctx *h, size_t age);
+const char *hist_get(struct histctx *h, size_t age, size_t *n);
+void hist_search_begin(struct histctx *h);
+const char *hist_search_match(struct histctx *h, size_t *n, size_t *age, size_t *at);
+int hist_search_push(struct histctx *h, const char *s, size_t n);
+int hist_search_pop(struct histctx *h, size_t n);
+int hist_search_next(struct histctx *h);
+
 struct termctx *term_create(struct cl_term *term, const char *name);
 void term_destroy(struct termctx *t);
+size_t term_param(char *buf, size_t bufsz, const char *cap, unsigned n);
+
+void key_init(struct keyctx *k);
+int key_next(struct keyctx *k, const char **s, const char *end, struct cl_event *e);
 
 struct lex_tok *
-lex_next(struct lex_tok *new, const char **src, char **dst);
+lex_next(struct lex_tok *new, const char **src, const char *end, char **dst);
+int lex_space(char c);
+int lex_word(char c);
 
 struct editctx *edit_create(void);
 void edit_destroy(struct editctx *ectx);
-char *edit_release(struct editctx *ectx);
+const char *edit_line(struct editctx *ectx, size_t *n);
+void edit_clear(struct editctx *ectx);
 int edit_push(struct cl_peer *p, const struct cl_event *event, enum edit_flags flags);
+const struct edit_tok *edit_tokens(struct cl_peer *p, size_t *n, const char **buf);
 
 #endif
 
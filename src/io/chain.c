@@ -5,6 +5,7 @@
  */
 
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <cl/tree.h>
 
@@ -73,7 +74,7 @@ chain_read(struct cl_peer *p, struct cl_chctx chctx[],
 
 static ssize_t
 chain_send(struct cl_peer *p, struct cl_chctx chctx[],
-	enum ui_output output)
+	enum ui_output output, size_t n)
 {
 	struct cl_chctx *next;
 
@@ -87,7 +88,7 @@ chain_send(struct cl_peer *p, struct cl_chctx chctx[],
 	assert(next->ioapi != NULL);
 	assert(next->ioapi->send != NULL);
 
-	return next->ioapi->send(p, next, output);
+	return next->ioapi->send(p, next, output, n);
 }
 
 static int
@@ -130,6 +131,44 @@ chain_printf(struct cl_peer *p, struct cl_chctx chctx[],
 	return n;
 }
 
+static ssize_t
+chain_write(struct cl_peer *p, struct cl_chctx chctx[],
+	const void *data, size_t len)
+{
+	struct cl_chctx *next;
+
+	assert(p != NULL);
+	assert(chctx != NULL);
+	assert(chctx->ioapi != NULL);
+	assert(data != NULL || len == 0);
+
+	next = chctx + 1;
+
+	assert(next->ioapi != NULL);
+	assert(next->ioapi->write != NULL);
+
+	return next->ioapi->write(p, next, data, len);
+}
+
+static ssize_t
+chain_writev(struct cl_peer *p, struct cl_chctx chctx[],
+	const struct iovec *iov, int iovcnt)
+{
+	struct cl_chctx *next;
+
+	assert(p != NULL);
+	assert(chctx != NULL);
+	assert(chctx->ioapi != NULL);
+	assert(iov != NULL || iovcnt == 0);
+
+	next = chctx + 1;
+
+	assert(next->ioapi != NULL);
+	assert(next->ioapi->writev != NULL);
+
+	return next->ioapi->writev(p, next, iov, iovcnt);
+}
+
 static const char *
 chain_ttype(struct cl_peer *p, struct cl_chctx chctx[])
 {
@@ -147,6 +186,57 @@ chain_ttype(struct cl_peer *p, struct cl_chctx chctx[])
 	return next->ioapi->ttype(p, next);
 }
 
+static int
+chain_flush(struct cl_peer *p, struct cl_chctx chctx[])
+{
+	struct cl_chctx *next;
+
+	assert(p != NULL);
+	assert(chctx != NULL);
+	assert(chctx->ioapi != NULL);
+
+	next = chctx + 1;
+
+	assert(next->ioapi != NULL);
+	assert(next->ioapi->flush != NULL);
+
+	return next->ioapi->flush(p, next);
+}
+
+static size_t
+chain_pending(struct cl_peer *p, struct cl_chctx chctx[])
+{
+	struct cl_chctx *next;
+
+	assert(p != NULL);
+	assert(chctx != NULL);
+	assert(chctx->ioapi != NULL);
+
+	next = chctx + 1;
+
+	assert(next->ioapi != NULL);
+	assert(next->ioapi->pending != NULL);
+
+	return next->ioapi->pending(p, next);
+}
+
+static int
+chain_tick(struct cl_peer *p, struct cl_chctx chctx[])
+{
+	struct cl_chctx *next;
+
+	assert(p != NULL);
+	assert(chctx != NULL);
+	assert(chctx->ioapi != NULL);
+
+	next = chctx + 1;
+
+	assert(next->ioapi != NULL);
+	assert(next->ioapi->tick != NULL);
+
+	return next->ioapi->tick(p, next);
+}
+
 static const struct io io_chain = {
 	chain_create,
 	chain_destroy,
@@ -154,6 +244,11 @@ static const struct io io_chain = {
 	chain_send,
 	chain_vprintf,
 	chain_printf,
-	chain_ttype
+	chain_write,
+	chain_writev,
+	chain_ttype,
+	chain_flush,
+	chain_pending,
+	chain_tick
 };
 
@@ -7,13 +7,17 @@
 #define _POSIX_SOURCE
 
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <cl/tree.h>
 
+#ifdef CL_TERMKEY
 #include <termkey.h>
+#endif
 
 #include <assert.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <errno.h>
@@ -21,9 +25,28 @@
 #include "../internal.h"
 #include "chain.c"
 
+/* bracketed paste, as introduced by xterm */
+#define PASTE_ON    "\033[?2004h"
+#define PASTE_OFF   "\033[?2004l"
+#define PASTE_START "\033[200~"
+#define PASTE_END   "\033[201~"
+#define PASTE_LEN   (sizeof PASTE_START - 1)
+
+/*
+ * Keys are decoded by key.c, unless libtermkey is built in, in which case
+ * it is given the terminal's terminfo entry to decode by instead.
+ */
 struct ioctx {
+#ifdef CL_TERMKEY
 	TermKey *tk;
+#else
+	struct keyctx key;
+#endif
 	int save;
+
+	int paste;   /* between paste markers */
+	size_t held; /* bytes of a marker which may continue in the next read */
+	int cr;      /* pasted text last ended a line with CR */
 };
 
 static int
@@ -49,6 +72,7 @@ ecma48_create(struct cl_peer *p, struct cl_chctx chctx[])
 	assert(p->ttype != NULL);
 	assert(strlen(p->ttype) > 0);
 
+#ifdef CL_TERMKEY
 	/* TODO: TERMKEY_FLAG_UTF8? CTRLC? */
 	chctx->ioctx->tk = termkey_new_abstract(p->ttype, 0);
 	if (chctx->ioctx->tk == NULL) {
@@ -56,10 +80,24 @@ ecma48_create(struct cl_peer *p, struct cl_chctx chctx[])
 		chctx->ioctx = NULL;
 		return -1;
 	}
+#else
+	key_init(&chctx->ioctx->key);
+#endif
+
+	chctx->ioctx->save  = -1;
+	chctx->ioctx->paste = 0;
+	chctx->ioctx->held  = 0;
+	chctx->ioctx->cr    = 0;
+
+	if (-1 == chain_create(p, chctx)) {
+		return -1;
+	}
 
-	chctx->ioctx->save = -1;
+	if (-1 == chain_printf(p, chctx, "%s", PASTE_ON)) {
+		return -1;
+	}
 
-	return chain_create(p, chctx);
+	return 0;
 }
 
 static void
@@ -71,9 +109,16 @@ ecma48_destroy(struct cl_peer *p, struct cl_chctx chctx[])
 	assert(chctx->ioapi->destroy == ecma48_destroy);
 
 	if (chctx->ioctx != NULL) {
+		/* the terminal outlives the peer; this is best-effort */
+		if (-1 != chain_printf(p, chctx, "%s", PASTE_OFF)) {
+			(void) chain_flush(p, chctx);
+		}
+
+#ifdef CL_TERMKEY
 		assert(chctx->ioctx->tk != NULL);
 
 		termkey_destroy(chctx->ioctx->tk);
+#endif
 
 		free(chctx->ioctx);
 	}
@@ -81,11 +126,17 @@ ecma48_destroy(struct cl_peer *p, struct cl_chctx chctx[])
 	chain_destroy(p, chctx);
 }
 
+#ifdef CL_TERMKEY
+
+/*
+ * Keystrokes, decoded by libtermkey. Returns the number of bytes consumed,
+ * or -1 on error. libtermkey keeps whatever it is given, so every key it
+ * decodes is passed on; the output limit stops input only between reads.
+ */
 static ssize_t
-ecma48_recv(struct cl_peer *p, struct cl_chctx chctx[],
-	const void *data, size_t len)
+keys(struct cl_peer *p, struct cl_chctx chctx[],
+	const char *data, size_t len)
 {
-	struct cl_chctx *prev;
 	TermKeyKey key;
 	size_t n;
 
@@ -93,23 +144,12 @@ ecma48_recv(struct cl_peer *p, struct cl_chctx chctx[],
 	assert(chctx != NULL);
 	assert(chctx->ioctx != NULL);
 	assert(chctx->ioctx->tk != NULL);
-	assert(chctx->ioapi != NULL);
-	assert(chctx->ioapi->read == ecma48_recv);
 	assert(data != NULL);
 
-	prev = chctx - 1;
-
-	(void) prev;
-
 	if (len == 0) {
 		return 0;
 	}
 
-	if (len > SSIZE_MAX) {
-		errno = EINVAL;
-		return -1;
-	}
-
 	n = termkey_push_bytes(chctx->ioctx->tk, data, len);
 	if ((size_t) -1 == n) {
 		return -1;
@@ -179,12 +219,29 @@ ecma48_recv(struct cl_peer *p, struct cl_chctx chctx[],
 
 			if (key.modifiers & TERMKEY_KEYMOD_CTRL) {
 				switch (e.u.utf8[0]) {
-				case 'c': e.type = UI_CANCEL;      break;
-				case 'h': e.type = UI_BACKSPACE;   break;
-				case 'u': e.type = UI_DELETE_LINE; break;
-				case 'w': e.type = UI_DELETE_WORD; break;
+				case 'c': e.type = UI_CANCEL;        break;
+				case 'h': e.type = UI_BACKSPACE;     break;
+				case 'u': e.type = UI_DELETE_LINE;   break;
+				case 'w': e.type = UI_DELETE_WORD;   break;
+
+				/* emacs-style line editing */
+				case 'a': e.type = UI_CURSOR_SOL;    break;
+				case 'b': e.type = UI_CURSOR_LEFT;   break;
+				case 'd': e.type = UI_DELETE;        break;
+				case 'e': e.type = UI_CURSOR_EOL;    break;
+				case 'f': e.type = UI_CURSOR_RIGHT;  break;
+				case 'k': e.type = UI_DELETE_TO_EOL; break;
+				case 'n': e.type = UI_HIST_NEXT;     break;
+				case 'p': e.type = UI_HIST_PREV;     break;
+				case 'r': e.type = UI_HIST_SEARCH;   break;
 
-				/* TODO: emacs-style line editing */
+				default:
+					continue;
+				}
+			} else if (key.modifiers & TERMKEY_KEYMOD_ALT) {
+				switch (e.u.utf8[0]) {
+				case 'b': e.type = UI_CURSOR_LEFT_WORD;  break;
+				case 'f': e.type = UI_CURSOR_RIGHT_WORD; break;
 
 				default:
 					continue;
@@ -206,15 +263,309 @@ ecma48_recv(struct cl_peer *p, struct cl_chctx chctx[],
 	return n;
 }
 
+#else
+
+/*
+ * Keystrokes, decoded in-tree. Returns the number of bytes consumed, which
+ * is short when a command leaves too much output queued, or -1 on error.
+ */
+static ssize_t
+keys(struct cl_peer *p, struct cl_chctx chctx[],
+	const char *data, size_t len)
+{
+	struct cl_event e;
+	const char *s, *end;
+
+	assert(p != NULL);
+	assert(chctx != NULL);
+	assert(chctx->ioctx != NULL);
+	assert(data != NULL);
+
+	s   = data;
+	end = s + len;
+
+	while (key_next(&chctx->ioctx->key, &s, end, &e)) {
+		if (-1 == getc_main(p, &e)) {
+			return -1;
+		}
+
+		if (p->stalled) {
+			break;
+		}
+	}
+
+	return s - data;
+}
+
+#endif
+
+/*
+ * Pasted text, which is given to the line editor a run at a time rather
+ * than a key at a time, and so is echoed in one piece. Line endings
+ * (CR, LF or CRLF) enter the line, and tabs are taken as spaces; other
+ * control characters are dropped, so that nothing pasted is taken as
+ * an editing key. Returns the number of bytes consumed, as for keys().
+ */
+static ssize_t
+paste(struct cl_peer *p, struct cl_chctx chctx[],
+	const char *data, size_t len)
+{
+	struct cl_event e;
+	const char *s, *end;
+
+	assert(p != NULL);
+	assert(chctx != NULL);
+	assert(chctx->ioctx != NULL);
+	assert(data != NULL);
+
+	end = data + len;
+
+	for (s = data; s < end; ) {
+		const char *t;
+
+		for (t = s; t < end; t++) {
+			if ((unsigned char) *t < ' ') {
+				break;
+			}
+
+			if (*t == '\177') {
+				break;
+			}
+		}
+
+		if (t > s) {
+			e.type     = UI_TEXT;
+			e.u.text.s = s;
+			e.u.text.n = t - s;
+
+			chctx->ioctx->cr = 0;
+
+			if (-1 == getc_main(p, &e)) {
+				return -1;
+			}
+		}
+
+		if (t == end) {
+			break;
+		}
+
+		if (*t == '\t') {
+			/* a tab would complete; it is taken as the space it stands for */
+			e.type     = UI_TEXT;
+			e.u.text.s = " ";
+			e.u.text.n = 1;
+
+			if (-1 == getc_main(p, &e)) {
+				return -1;
+			}
+		} else if ((*t == '\r' || *t == '\n') && !(*t == '\n' && chctx->ioctx->cr)) {
+			e.type   = UI_CODEPOINT;
+			e.u.utf8 = "\n";
+
+			chctx->ioctx->cr = *t == '\r';
+
+			if (-1 == getc_main(p, &e)) {
+				return -1;
+			}
+
+			if (p->stalled) {
+				return t + 1 - data;
+			}
+		}
+
+		chctx->ioctx->cr = *t == '\r';
+
+		s = t + 1;
+	}
+
+	return len;
+}
+
+/*
+ * The next paste marker, or else a marker cut short at the end of the data,
+ * for which *partial is set. Returns end if there is neither.
+ */
+static const char *
+marker(const char *s, const char *end, const char *m, int *partial)
+{
+	size_t n;
+
+	assert(s != NULL && end != NULL);
+	assert(m != NULL);
+	assert(partial != NULL);
+
+	for ( ; (s = memchr(s, '\033', (size_t) (end - s))) != NULL; s++) {
+		n = (size_t) (end - s) < PASTE_LEN ? (size_t) (end - s) : PASTE_LEN;
+
+		if (0 == memcmp(s, m, n)) {
+			*partial = n < PASTE_LEN;
+			return s;
+		}
+	}
+
+	return end;
+}
+
+/*
+ * Input is decoded as keys, except between the markers which
+ * bracket pasted text. A marker split between reads is held back until
+ * it is known whether it is one, except for a lone ESC ending the read
+ * outside a paste, which is taken as the Escape key rather than delayed
+ * until the next read. The read ends early after a command which leaves
+ * too much output queued.
+ */
+static ssize_t
+ecma48_recv(struct cl_peer *p, struct cl_chctx chctx[],
+	const void *data, size_t len)
+{
+	struct ioctx *ctx;
+	const char *s, *end, *m;
+	int partial;
+	ssize_t r;
+
+	assert(p != NULL);
+	assert(chctx != NULL);
+	assert(chctx->ioctx != NULL);
+	assert(chctx->ioapi != NULL);
+	assert(chctx->ioapi->read == ecma48_recv);
+	assert(data != NULL);
+
+	if (len == 0) {
+		return 0;
+	}
+
+	if (len > SSIZE_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ctx = chctx->ioctx;
+
+	s   = data;
+	end = s + len;
+
+	if (ctx->held > 0) {
+		size_t n;
+
+		m = ctx->paste ? PASTE_END : PASTE_START;
+		n = PASTE_LEN - ctx->held < len ? PASTE_LEN - ctx->held : len;
+
+		if (0 == memcmp(m + ctx->held, s, n)) {
+			if (ctx->held + n < PASTE_LEN) {
+				ctx->held += n;
+				return len;
+			}
+
+			s += n;
+			ctx->held  = 0;
+			ctx->paste = !ctx->paste;
+		} else {
+			/* not a marker after all; what was held is the prefix matched */
+			n = ctx->held;
+			ctx->held = 0;
+
+			/* a prefix of a marker holds no Enter, and so no command */
+			r = (ctx->paste ? paste : keys)(p, chctx, m, n);
+			if (r == -1) {
+				return -1;
+			}
+
+			assert((size_t) r == n);
+		}
+	}
+
+	while (s < end) {
+		m = marker(s, end, ctx->paste ? PASTE_END : PASTE_START, &partial);
+
+		r = (ctx->paste ? paste : keys)(p, chctx, s, m - s);
+		if (r == -1) {
+			return -1;
+		}
+
+		/* the rest waits for the application to give it again */
+		if (p->stalled) {
+			return s + r - (const char *) data;
+		}
+
+		if (m == end) {
+			break;
+		}
+
+		if (partial && !ctx->paste && end - m == 1) {
+			/* an ESC is not an Enter, and so runs no command */
+			r = keys(p, chctx, m, 1);
+			if (r == -1) {
+				return -1;
+			}
+
+			assert(r == 1);
+			break;
+		}
+
+		if (partial) {
+			ctx->held = end - m;
+			break;
+		}
+
+		s = m + PASTE_LEN;
+		ctx->paste = !ctx->paste;
+		ctx->cr    = 0;
+	}
+
+	return len;
+}
+
+/*
+ * A counted operation by a parameterized capability where there is one,
+ * and otherwise by repeating its single-character form. Either way this
+ * is one sequence through the chain per edit, rather than one per character.
+ */
+static ssize_t
+counted(struct cl_peer *p, struct cl_chctx chctx[],
+	const char *cap, const char *cap1, size_t n)
+{
+	char buf[32];
+	ssize_t r, x;
+	size_t len;
+
+	assert(p != NULL);
+	assert(chctx != NULL);
+
+	if (n == 0) {
+		return 0;
+	}
+
+	if (cap != NULL && (n > 1 || cap1 == NULL)) {
+		len = term_param(buf, sizeof buf, cap, n);
+		if (len > 0) {
+			return chain_write(p, chctx, buf, len);
+		}
+	}
+
+	if (cap1 == NULL) {
+		return 0;
+	}
+
+	len = strlen(cap1);
+
+	for (r = 0; n-- > 0; r += x) {
+		x = chain_write(p, chctx, cap1, len);
+		if (x == -1) {
+			return -1;
+		}
+	}
+
+	return r;
+}
+
 static ssize_t
 ecma48_send(struct cl_peer *p, struct cl_chctx chctx[],
-	enum ui_output output)
+	enum ui_output output, size_t n)
 {
-	ssize_t n = 0;
+	ssize_t r = 0, x;
 
 	assert(p != NULL);
 	assert(p->tree != NULL);
-	assert(p->tree->vprintf != NULL);
 	assert(chctx->ioctx != NULL);
 	assert(chctx->ioapi != NULL);
 	assert(chctx->ioapi->send == ecma48_send);
@@ -222,22 +573,68 @@ ecma48_send(struct cl_peer *p, struct cl_chctx chctx[],
 
 	switch (output) {
 	case OUT_BACKSPACE_AND_DELETE:
-		assert(chctx->ioctx->save == -1);
-
-		if (p->term.cub1 == NULL) {
+		if (p->term.cub1 == NULL && p->term.cub == NULL) {
 			return 0;
 		}
 
-		if (p->term.dch1 != NULL) {
-			n = chain_printf(p, chctx, "%s%s",
-				p->term.cub1,
-				p->term.dch1);
+		r = counted(p, chctx, p->term.cub, p->term.cub1, n);
+		if (r == -1) {
+			return -1;
+		}
+
+		if (p->term.dch != NULL || p->term.dch1 != NULL) {
+			x = counted(p, chctx, p->term.dch, p->term.dch1, n);
+		} else if (p->term.ech != NULL) {
+			x = counted(p, chctx, p->term.ech, NULL, n);
+		} else if (p->term.el != NULL) {
+			x = chain_printf(p, chctx, "%s", p->term.el);
 		} else {
-			n = chain_printf(p, chctx, "%s %s",
-				p->term.cub1,
-				p->term.cub1);
+			x = counted(p, chctx, NULL, " ", n);
+			if (x != -1) {
+				r += x;
+				x = counted(p, chctx, p->term.cub, p->term.cub1, n);
+			}
+		}
+
+		if (x == -1) {
+			return -1;
+		}
+
+		r += x;
+
+		break;
+
+	case OUT_CURSOR_LEFT:
+		r = counted(p, chctx, p->term.cub, p->term.cub1, n);
+		break;
+
+	case OUT_DELETE:
+		r = counted(p, chctx, p->term.dch, p->term.dch1, n);
+		break;
+
+	case OUT_DELETE_TO_EOL:
+		if (p->term.el != NULL) {
+			r = chain_printf(p, chctx, "%s", p->term.el);
+			break;
+		}
+
+		if (p->term.ech != NULL) {
+			r = counted(p, chctx, p->term.ech, NULL, n);
+			break;
+		}
+
+		r = counted(p, chctx, NULL, " ", n);
+		if (r == -1) {
+			return -1;
 		}
 
+		x = counted(p, chctx, p->term.cub, p->term.cub1, n);
+		if (x == -1) {
+			return -1;
+		}
+
+		r += x;
+
 		break;
 
 	case OUT_SAVE:
@@ -248,7 +645,7 @@ ecma48_send(struct cl_peer *p, struct cl_chctx chctx[],
 			return 0;
 		}
 
-		n = chain_printf(p, chctx, "%s",
+		r = chain_printf(p, chctx, "%s",
 			p->term.sc);
 
 		break;
@@ -257,25 +654,23 @@ ecma48_send(struct cl_peer *p, struct cl_chctx chctx[],
 		assert(chctx->ioctx->save != -1);
 
 		if (p->term.sc == NULL || p->term.rc == NULL) {
-			ssize_t x;
+			n = chctx->ioctx->save;
+			chctx->ioctx->save = -1;
 
-			for (n = 0; chctx->ioctx->save-- > 0; n += x) {
-				x = ecma48_send(p, chctx, OUT_BACKSPACE_AND_DELETE);
-				if (x == -1) {
-					return -1;
-				}
-			}
+			r = ecma48_send(p, chctx, OUT_BACKSPACE_AND_DELETE, n);
 
 			break;
 		}
 
-		n = chctx->ioapi->printf(p, chctx, "%s",
-			p->term.rc);
+		chctx->ioctx->save = -1;
+
+		r = chain_printf(p, chctx, "%s%s",
+			p->term.rc, p->term.el != NULL ? p->term.el : "");
 
 		break;
 	}
 
-	return n;
+	return r;
 }
 
 static int
@@ -286,7 +681,6 @@ ecma48_vprintf(struct cl_peer *p, struct cl_chctx chctx[],
 
 	assert(p != NULL);
 	assert(p->tree != NULL);
-	assert(p->tree->vprintf != NULL);
 	assert(chctx->ioctx != NULL);
 	assert(chctx->ioapi != NULL);
 	assert(chctx->ioapi->vprintf == ecma48_vprintf);
@@ -308,6 +702,58 @@ ecma48_vprintf(struct cl_peer *p, struct cl_chctx chctx[],
 	return n;
 }
 
+/*
+ * Characters written while a position is saved are counted, so that the
+ * cursor may be moved back over them where there is no rc capability.
+ */
+static ssize_t
+saved(struct cl_chctx chctx[], ssize_t n)
+{
+	assert(chctx != NULL);
+	assert(chctx->ioctx != NULL);
+
+	if (n == -1 || chctx->ioctx->save == -1) {
+		return n;
+	}
+
+	if (n > INT_MAX - chctx->ioctx->save) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	chctx->ioctx->save += n;
+
+	return n;
+}
+
+static ssize_t
+ecma48_write(struct cl_peer *p, struct cl_chctx chctx[],
+	const void *data, size_t len)
+{
+	assert(p != NULL);
+	assert(chctx != NULL);
+	assert(chctx->ioctx != NULL);
+	assert(chctx->ioapi != NULL);
+	assert(chctx->ioapi->write == ecma48_write);
+	assert(data != NULL || len == 0);
+
+	return saved(chctx, chain_write(p, chctx, data, len));
+}
+
+static ssize_t
+ecma48_writev(struct cl_peer *p, struct cl_chctx chctx[],
+	const struct iovec *iov, int iovcnt)
+{
+	assert(p != NULL);
+	assert(chctx != NULL);
+	assert(chctx->ioctx != NULL);
+	assert(chctx->ioapi != NULL);
+	assert(chctx->ioapi->writev == ecma48_writev);
+	assert(iov != NULL || iovcnt == 0);
+
+	return saved(chctx, chain_writev(p, chctx, iov, iovcnt));
+}
+
 const struct io io_ecma48 = {
 	ecma48_create,
 	ecma48_destroy,
@@ -315,6 +761,11 @@ const struct io io_ecma48 = {
 	ecma48_send,
 	ecma48_vprintf,
 	chain_printf,
-	chain_ttype
+	ecma48_write,
+	ecma48_writev,
+	chain_ttype,
+	chain_flush,
+	chain_pending,
+	chain_tick
 };
 
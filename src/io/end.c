@@ -4,37 +4,160 @@
  * See LICENCE for the full copyright terms.
  */
 
+#define _POSIX_SOURCE
+
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <cl/tree.h>
 
 #include <assert.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
 
 #include "../internal.h"
 #include "chain.c"
 
+/*
+ * Output is gathered here, and handed to the application's write (or vprintf)
+ * callback in one piece when flushed, rather than once per cl_printf() or
+ * cl_write() and once again per escape sequence or telnet command from the
+ * layers above.
+ *
+ * Formatting is done by vsnprintf() directly into the free space at the end
+ * of the buffer. The buffer only ever grows, so a format is repeated only in
+ * the rare case where it has grown to fit; there is no per-call allocation,
+ * and given a write callback, the application needn't format anything.
+ *
+ * Flushing happens after each command's output and prompt, and before
+ * returning from cl_ready() and cl_read(), so that echoed input is seen.
+ * A command which prints a great deal is flushed in portions, as the buffer
+ * passes END_HIGH bytes, so that memory use stays bounded.
+ *
+ * The callback may accept less than it is given, or fail with EAGAIN. What
+ * remains is kept queued from ctx->start, and the peer is blocked: there are
+ * no further attempts at END_HIGH until a flush empties the queue. Space
+ * before ctx->start is reclaimed when more room is needed at the end.
+ */
+
+#define END_HIGH 4096
+
+struct ioctx {
+	char *buf;
+	size_t start;
+	size_t len;
+	size_t size;
+	int blocked;
+};
+
+static int end_flush(struct cl_peer *p, struct cl_chctx chctx[]);
+
+static int
+end_create(struct cl_peer *p, struct cl_chctx chctx[])
+{
+	assert(p != NULL);
+	assert(chctx != NULL);
+	assert(chctx->ioctx == NULL);
+	assert(chctx->ioapi != NULL);
+	assert(chctx->ioapi->create == end_create);
+
+	chctx->ioctx = malloc(sizeof *chctx->ioctx);
+	if (chctx->ioctx == NULL) {
+		return -1;
+	}
+
+	chctx->ioctx->buf     = NULL;
+	chctx->ioctx->start   = 0;
+	chctx->ioctx->len     = 0;
+	chctx->ioctx->size    = 0;
+	chctx->ioctx->blocked = 0;
+
+	return chain_create(p, chctx);
+}
+
+static void
+end_destroy(struct cl_peer *p, struct cl_chctx chctx[])
+{
+	assert(p != NULL);
+	assert(chctx != NULL);
+	assert(chctx->ioapi != NULL);
+	assert(chctx->ioapi->destroy == end_destroy);
+
+	if (chctx->ioctx == NULL) {
+		return;
+	}
+
+	/* cl_close() has flushed; anything still queued cannot be sent */
+	free(chctx->ioctx->buf);
+	free(chctx->ioctx);
+	chctx->ioctx = NULL;
+}
+
+/* a sequence repeated n times, for want of a parameterized capability */
+static ssize_t
+repeat(struct cl_peer *p, struct cl_chctx chctx[], const char *s, size_t n)
+{
+	ssize_t r, x;
+	size_t len;
+
+	assert(p != NULL);
+	assert(chctx != NULL);
+	assert(chctx->ioapi != NULL);
+	assert(chctx->ioapi->write != NULL);
+	assert(s != NULL);
+
+	len = strlen(s);
+
+	for (r = 0; n-- > 0; r += x) {
+		x = chctx->ioapi->write(p, chctx, s, len);
+		if (x == -1) {
+			return -1;
+		}
+	}
+
+	return r;
+}
+
 static ssize_t
 end_send(struct cl_peer *p, struct cl_chctx chctx[],
-	enum ui_output output)
+	enum ui_output output, size_t n)
 {
-	ssize_t n = 0;
+	ssize_t r = 0;
 
 	assert(p != NULL);
 	assert(p->tree != NULL);
-	assert(p->tree->vprintf != NULL);
 	assert(chctx != NULL);
-	assert(chctx->ioctx == NULL);
+	assert(chctx->ioctx != NULL);
 	assert(chctx->ioapi != NULL);
 	assert(chctx->ioapi->send == end_send);
 
-	(void) chctx;
-
 	switch (output) {
 	case OUT_BACKSPACE_AND_DELETE:
 		/* TODO: disregard for plain? */
-		n = chctx->ioapi->printf(p, chctx, "\b \b");
+		r = repeat(p, chctx, "\b \b", n);
+		break;
+
+	case OUT_CURSOR_LEFT:
+		r = repeat(p, chctx, "\b", n);
+		break;
+
+	case OUT_DELETE:
+		/* nothing we can do; the caller redraws instead */
+		break;
+
+	case OUT_DELETE_TO_EOL:
+		r = repeat(p, chctx, " ", n);
+		if (r != -1) {
+			ssize_t x;
+
+			x = repeat(p, chctx, "\b", n);
+			r = x == -1 ? -1 : r + x;
+		}
 		break;
 
 	case OUT_SAVE:
@@ -43,29 +166,339 @@ end_send(struct cl_peer *p, struct cl_chctx chctx[],
 		break;
 
 	case OUT_RESTORE_AND_DELETE_TO_EOL:
-		n = chctx->ioapi->printf(p, chctx, "\r\n");
+		r = chctx->ioapi->printf(p, chctx, "\r\n");
 		break;
 	}
 
-	return n;
+	return r;
+}
+
+/* room for n more bytes at the end, and a terminator for vsnprintf() */
+static int
+reserve(struct ioctx *ctx, size_t n)
+{
+	size_t size;
+	char *tmp;
+
+	assert(ctx != NULL);
+
+	if (ctx->start + ctx->len + n < ctx->size) {
+		return 0;
+	}
+
+	if (ctx->start > 0) {
+		memmove(ctx->buf, ctx->buf + ctx->start, ctx->len);
+		ctx->start = 0;
+
+		if (ctx->len + n < ctx->size) {
+			return 0;
+		}
+	}
+
+	size = ctx->size == 0 ? END_HIGH : ctx->size;
+	while (size <= ctx->len + n) {
+		size *= 2;
+	}
+
+	tmp = realloc(ctx->buf, size);
+	if (tmp == NULL) {
+		return -1;
+	}
+
+	ctx->buf  = tmp;
+	ctx->size = size;
+
+	return 0;
 }
 
 static int
 end_vprintf(struct cl_peer *p, struct cl_chctx chctx[],
 	const char *fmt, va_list ap)
 {
+	struct ioctx *ctx;
+	char *end;
+	int r;
+
 	assert(p != NULL);
-	assert(p->tree != NULL);
-	assert(p->tree->vprintf != NULL);
 	assert(chctx != NULL);
-	assert(chctx->ioctx == NULL);
+	assert(chctx->ioctx != NULL);
 	assert(chctx->ioapi != NULL);
 	assert(chctx->ioapi->vprintf == end_vprintf);
 	assert(fmt != NULL);
 
-	(void) chctx;
+	ctx = chctx->ioctx;
+
+	for (;;) {
+		end = ctx->buf == NULL ? NULL : ctx->buf + ctx->start + ctx->len;
+
+		r = fmt_vsnprintf(end, ctx->size - ctx->start - ctx->len, fmt, ap);
+
+		if (r < 0) {
+			return -1;
+		}
+
+		if ((size_t) r < ctx->size - ctx->start - ctx->len) {
+			break;
+		}
+
+		if (-1 == reserve(ctx, r)) {
+			return -1;
+		}
+	}
+
+	ctx->len += r;
+
+	if (ctx->len >= END_HIGH && !ctx->blocked) {
+		if (-1 == end_flush(p, chctx)) {
+			return -1;
+		}
+	}
+
+	return r;
+}
+
+static int
+emit(struct cl_peer *p, const char *fmt, ...)
+{
+	va_list ap;
+	int r;
+
+	assert(p != NULL);
+	assert(p->tree != NULL);
+	assert(p->tree->vprintf != NULL);
+	assert(fmt != NULL);
+
+	va_start(ap, fmt);
+	r = p->tree->vprintf(p, fmt, ap);
+	va_end(ap);
+
+	return r;
+}
 
-	return p->tree->vprintf(p, fmt, ap);
+static int
+again(void)
+{
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+/*
+ * Bytes are given to the application's write callback where there is one.
+ * Otherwise the vprintf callback is given them by "%.*s", which would stop
+ * at a '\0'; those are given separately by "%c", so that binary data passes
+ * intact.
+ *
+ * Returns the number of bytes accepted, which is short if the callback
+ * would block, or -1 on error.
+ */
+static ssize_t
+sink(struct cl_peer *p, const char *s, size_t n)
+{
+	const char *nul;
+	size_t len;
+	ssize_t r, w;
+
+	assert(p != NULL);
+	assert(p->tree != NULL);
+	assert(s != NULL || n == 0);
+
+	r = 0;
+
+	while (n > 0) {
+		if (p->tree->write != NULL) {
+			len = n;
+			w = p->tree->write(p, s, len);
+		} else {
+			nul = memchr(s, '\0', n);
+			len = nul == s ? 1 : nul == NULL ? n : (size_t) (nul - s);
+
+			if (len > INT_MAX) {
+				len = INT_MAX;
+			}
+
+			if (nul == s) {
+				w = emit(p, "%c", '\0');
+			} else {
+				w = emit(p, "%.*s", (int) len, s);
+			}
+		}
+
+		/* interrupted before anything was written; nothing is queued for it */
+		if (w == -1 && errno == EINTR) {
+			continue;
+		}
+
+		if (w == -1 && again()) {
+			break;
+		}
+
+		if (w == -1) {
+			return -1;
+		}
+
+		assert((size_t) w <= len);
+
+		s += w;
+		n -= w;
+		r += w;
+
+		if ((size_t) w < len) {
+			break;
+		}
+	}
+
+	return r;
+}
+
+static int
+end_flush(struct cl_peer *p, struct cl_chctx chctx[])
+{
+	struct ioctx *ctx;
+	ssize_t r;
+
+	assert(p != NULL);
+	assert(chctx != NULL);
+	assert(chctx->ioctx != NULL);
+	assert(chctx->ioapi != NULL);
+	assert(chctx->ioapi->flush == end_flush);
+
+	ctx = chctx->ioctx;
+
+	if (ctx->len == 0) {
+		return 0;
+	}
+
+	r = sink(p, ctx->buf + ctx->start, ctx->len);
+	if (r == -1) {
+		return -1;
+	}
+
+	ctx->start += r;
+	ctx->len   -= r;
+
+	if (ctx->len == 0) {
+		ctx->start = 0;
+	}
+
+	ctx->blocked = ctx->len > 0;
+
+	return r > INT_MAX ? INT_MAX : (int) r;
+}
+
+static size_t
+end_pending(struct cl_peer *p, struct cl_chctx chctx[])
+{
+	assert(p != NULL);
+	assert(chctx != NULL);
+	assert(chctx->ioapi != NULL);
+	assert(chctx->ioapi->pending == end_pending);
+
+	(void) p;
+
+	if (chctx->ioctx == NULL) {
+		return 0;
+	}
+
+	return chctx->ioctx->len;
+}
+
+/* nothing here waits on time */
+static int
+end_tick(struct cl_peer *p, struct cl_chctx chctx[])
+{
+	assert(p != NULL);
+	assert(chctx != NULL);
+	assert(chctx->ioapi != NULL);
+	assert(chctx->ioapi->tick == end_tick);
+
+	(void) p;
+
+	return 0;
+}
+
+/*
+ * Small writes are gathered with everything else. Anything which would take
+ * the buffer past END_HIGH is sent directly from the caller's storage,
+ * after whatever is already buffered, rather than being copied. Only what
+ * the callback doesn't accept is copied, to be queued.
+ */
+static ssize_t
+end_write(struct cl_peer *p, struct cl_chctx chctx[],
+	const void *data, size_t len)
+{
+	struct ioctx *ctx;
+	ssize_t r;
+
+	assert(p != NULL);
+	assert(chctx != NULL);
+	assert(chctx->ioctx != NULL);
+	assert(chctx->ioapi != NULL);
+	assert(chctx->ioapi->write == end_write);
+	assert(data != NULL || len == 0);
+
+	ctx = chctx->ioctx;
+
+	if (len > SSIZE_MAX) {
+		len = SSIZE_MAX;
+	}
+
+	r = 0;
+
+	if (ctx->len + len >= END_HIGH && !ctx->blocked) {
+		if (-1 == end_flush(p, chctx)) {
+			return -1;
+		}
+
+		if (ctx->len == 0) {
+			r = sink(p, data, len);
+			if (r == -1) {
+				return -1;
+			}
+
+			ctx->blocked = (size_t) r < len;
+		}
+	}
+
+	if ((size_t) r < len) {
+		if (-1 == reserve(ctx, len - r)) {
+			return -1;
+		}
+
+		memcpy(ctx->buf + ctx->start + ctx->len, (const char *) data + r, len - r);
+		ctx->len += len - r;
+	}
+
+	return len;
+}
+
+static ssize_t
+end_writev(struct cl_peer *p, struct cl_chctx chctx[],
+	const struct iovec *iov, int iovcnt)
+{
+	ssize_t n, r;
+	int i;
+
+	assert(p != NULL);
+	assert(chctx != NULL);
+	assert(chctx->ioapi != NULL);
+	assert(chctx->ioapi->writev == end_writev);
+	assert(iov != NULL || iovcnt == 0);
+
+	n = 0;
+
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len > (size_t) (SSIZE_MAX - n)) {
+			break;
+		}
+
+		r = end_write(p, chctx, iov[i].iov_base, iov[i].iov_len);
+		if (r == -1) {
+			return -1;
+		}
+
+		n += r;
+	}
+
+	return n;
 }
 
 static const char *
@@ -94,12 +527,17 @@ end_ttype(struct cl_peer *p, struct cl_chctx chctx[])
 }
 
 const struct io io_end = {
-	chain_create,
-	chain_destroy,
+	end_create,
+	end_destroy,
 	chain_read,
 	end_send,
 	end_vprintf,
 	chain_printf,
-	end_ttype
+	end_write,
+	end_writev,
+	end_ttype,
+	end_flush,
+	end_pending,
+	end_tick
 };
 
@@ -4,7 +4,10 @@
  * See LICENCE for the full copyright terms.
  */
 
+#define _POSIX_SOURCE
+
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <cl/tree.h>
 
@@ -12,6 +15,7 @@
 #include <stddef.h>
 #include <stdarg.h>
 #include <string.h>
+#include <limits.h>
 
 #include "../internal.h"
 #include "chain.c"
@@ -20,8 +24,6 @@ static int
 start_create(struct cl_peer *p, struct cl_chctx chctx[])
 {
 	assert(p != NULL);
-	assert(p->ttype != NULL);
-	assert(strlen(p->ttype) > 0);
 	assert(chctx != NULL);
 	assert(chctx->ioctx == NULL);
 	assert(chctx->ioapi != NULL);
@@ -35,6 +37,7 @@ start_create(struct cl_peer *p, struct cl_chctx chctx[])
 	}
 
 	assert(p->ttype != NULL);
+	assert(strlen(p->ttype) > 0);
 
 	p->tctx = term_create(&p->term, p->ttype);
 	if (p->tctx == NULL) {
@@ -79,11 +82,48 @@ start_destroy(struct cl_peer *p, struct cl_chctx chctx[])
 	chain_destroy(p, chctx);
 }
 
+/*
+ * Bytes which mean something to the line editor, and so are passed one at
+ * a time. Anything else is text, which is inserted a run at a time.
+ */
+static int
+special(char c)
+{
+	return (unsigned char) c < ' ' || c == '\177' || c == '?';
+}
+
+static int
+getc_byte(struct cl_peer *p, char c)
+{
+	struct cl_event e;
+	char s[2];
+
+	assert(p != NULL);
+
+	s[0] = c;
+	s[1] = '\0';
+
+	e.type   = UI_CODEPOINT;
+	e.u.utf8 = s;
+
+	return getc_main(p, &e);
+}
+
+/*
+ * Plain input does no key decoding, so a read usually holds whole lines
+ * of text. Each line is found by memchr() and given to the line editor in
+ * runs between the few bytes it treats specially, rather than a byte at
+ * a time; the newline then dispatches the command.
+ *
+ * A command which leaves too much output queued ends the read there, and
+ * what follows is left for the application to give again.
+ */
 static ssize_t
 start_read(struct cl_peer *p, struct cl_chctx chctx[],
 	const void *data, size_t len)
 {
-	size_t i;
+	const char *s, *end, *nl, *t;
+	struct cl_event e;
 
 	assert(p != NULL);
 	assert(data != NULL);
@@ -94,22 +134,63 @@ start_read(struct cl_peer *p, struct cl_chctx chctx[],
 
 	(void) chctx;
 
-	for (i = 0; i < len; i++) {
-		struct cl_event e;
-		char s[2];
+	if (len > SSIZE_MAX) {
+		len = SSIZE_MAX;
+	}
+
+	end = (const char *) data + len;
+
+	for (s = data; s < end; s = nl + 1) {
+		nl = memchr(s, '\n', end - s);
+		if (nl == NULL) {
+			nl = end;
+		}
+
+		while (s < nl) {
+			for (t = s; t < nl && !special(*t); t++)
+				;
 
-		s[0] = * ((char *) data + i);
-		s[1] = '\0';
+			if (t > s) {
+				e.type     = UI_TEXT;
+				e.u.text.s = s;
+				e.u.text.n = t - s;
 
-		e.type   = UI_CODEPOINT;
-		e.u.utf8 = s;
+				if (-1 == getc_main(p, &e)) {
+					return -1;
+				}
 
-		if (-1 == getc_main(p, &e)) {
+				if (p->stalled) {
+					return t - (const char *) data;
+				}
+			}
+
+			if (t < nl) {
+				if (-1 == getc_byte(p, *t++)) {
+					return -1;
+				}
+
+				if (p->stalled) {
+					return t - (const char *) data;
+				}
+			}
+
+			s = t;
+		}
+
+		if (nl == end) {
+			break;
+		}
+
+		if (-1 == getc_byte(p, '\n')) {
 			return -1;
 		}
+
+		if (p->stalled) {
+			return nl + 1 - (const char *) data;
+		}
 	}
 
-	return i;
+	return len;
 }
 
 const struct io io_start = {
@@ -119,6 +200,11 @@ const struct io io_start = {
 	chain_send,
 	chain_vprintf,
 	chain_printf,
-	chain_ttype
+	chain_write,
+	chain_writev,
+	chain_ttype,
+	chain_flush,
+	chain_pending,
+	chain_tick
 };
 
@@ -4,179 +4,548 @@
  * See LICENCE for the full copyright terms.
  */
 
+#define _POSIX_C_SOURCE 199309L
+
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <cl/tree.h>
 
-#include <libtelnet.h>
-
 #include <assert.h>
+#include <limits.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <time.h>
 
 #include "../internal.h"
 #include "chain.c"
 
+/*
+ * The telnet protocol (RFC 854), as much of it as we need: options are
+ * negotiated by the Q method (RFC 1143), and the only subnegotiation
+ * understood is the peer's reply to our TTYPE query (RFC 1091).
+ *
+ * Received data is scanned for IAC by memchr(), and each run between
+ * commands is passed up the chain in one call; most reads contain no IAC
+ * at all, and so go up whole. Nothing is allocated per byte, and all state
+ * lives in the ioctx.
+ *
+ * Until the peer's terminal type is known, the layers above are not yet
+ * created, and so there is nowhere for data to go. RFC 854 suggests that
+ * data received in this "uncertainty period" be held, to hide it from the
+ * user; so it is, up to EARLY_MAX bytes. The wait ends when the peer
+ * answers our TTYPE query, refuses TTYPE, sends more than can be held, or
+ * when the tree's ttype_timeout passes, whichever comes first; the type
+ * then falls back to that given by the next layer, and the held data is
+ * passed up as though it had just arrived.
+ */
+
+enum {
+	SE   = 240,
+	NOP  = 241,
+	SB   = 250,
+	WILL = 251,
+	WONT = 252,
+	DO   = 253,
+	DONT = 254,
+	IAC  = 255
+};
+
+enum {
+	TELOPT_ECHO  = 1,
+	TELOPT_SGA   = 3,
+	TELOPT_TTYPE = 24
+};
+
+/* TTYPE subnegotiation */
+enum {
+	TTYPE_IS   = 0,
+	TTYPE_SEND = 1
+};
+
+/* per RFC 1091, terminal type names are at most 40 characters */
+#define TTYPE_MAX 40
+
+/* data held while waiting for the terminal type */
+#define EARLY_MAX 256
+
+enum state {
+	TS_DATA,
+	TS_IAC,
+	TS_OPT,    /* after WILL, WONT, DO or DONT */
+	TS_SB,     /* after SB, for the option */
+	TS_SB_DATA,
+	TS_SB_IAC
+};
+
+enum ready {
+	RS_WAIT,   /* for the peer's terminal type */
+	RS_READY   /* the layers above are created */
+};
+
+/* RFC 1143's states, for each side of an option */
+enum q {
+	Q_NO,
+	Q_YES,
+	Q_WANTNO,
+	Q_WANTYES
+};
+
+/* the options we negotiate; each is offered by us and asked of the peer */
+static const unsigned char opts[] = {
+	TELOPT_ECHO,
+	TELOPT_SGA,
+	TELOPT_TTYPE
+};
+
+#define NOPTS (sizeof opts / sizeof *opts)
+
 struct ioctx {
 	struct cl_peer *p;
-	struct cl_chctx *chctx;
-	telnet_t *tt;
+
+	unsigned char ready; /* enum ready */
+	unsigned char state; /* enum state */
+	unsigned char cmd;   /* TS_OPT: WILL, WONT, DO or DONT */
+	unsigned char cr;    /* the last data byte was CR */
+	unsigned char us[NOPTS];  /* enum q */
+	unsigned char him[NOPTS]; /* enum q */
+
+	unsigned char sbopt;
+	size_t sblen;
+	char sb[1 + TTYPE_MAX];
+
+	char ttype[TTYPE_MAX + 1];
+
+	int timed;                /* the deadline applies */
+	struct timespec deadline; /* CLOCK_MONOTONIC */
+
+	size_t early_len;
+	char early[EARLY_MAX];
+
+	/* formatted output, escaped from here; it only ever grows */
+	char *buf;
+	size_t bufsz;
 };
 
-static void
-ready(struct cl_chctx *chctx)
+static ssize_t
+recv_data(struct cl_peer *p, struct cl_chctx chctx[], const char *s, size_t n);
+
+static int
+send_raw(struct cl_peer *p, struct cl_chctx chctx[],
+	const void *data, size_t len)
 {
+	struct cl_chctx *next;
+
+	assert(p != NULL);
 	assert(chctx != NULL);
-	assert(chctx->ioctx != NULL);
-	assert(chctx->ioctx->p != NULL);
-	assert(chctx->ioctx->p->ttype != NULL);
+	assert(data != NULL || len == 0);
+
+	if (len == 0) {
+		return 0;
+	}
 
-	/* TODO: handle error */
-	chain_create(chctx->ioctx->p, chctx);
+	next = chctx + 1;
+
+	assert(next->ioapi != NULL);
+	assert(next->ioapi->write != NULL);
+
+	if (-1 == next->ioapi->write(p, next, data, len)) {
+		return -1;
+	}
+
+	return 0;
 }
 
-static void
-handler(telnet_t *tt, telnet_event_t *event, void *opaque)
+static int
+send_cmd(struct cl_peer *p, struct cl_chctx chctx[],
+	unsigned char cmd, unsigned char opt)
 {
-	struct cl_chctx *chctx;
+	unsigned char a[3];
 
-	assert(tt != NULL);
-	assert(event != NULL);
-	assert(opaque != NULL);
+	a[0] = IAC;
+	a[1] = cmd;
+	a[2] = opt;
 
-	chctx = opaque;
+	return send_raw(p, chctx, a, sizeof a);
+}
 
+/*
+ * End the wait for the terminal type. ttype is the peer's answer, or NULL
+ * to fall back to the next layer's. The layers above are created, and any
+ * data held meanwhile is passed up to them. That is all taken, even past
+ * the output limit, since there is nobody to give it again; it is at most
+ * EARLY_MAX bytes.
+ */
+static int
+ready(struct cl_peer *p, struct cl_chctx chctx[], const char *ttype)
+{
+	struct ioctx *ctx;
+	struct cl_chctx *next;
+	const char *s;
+	ssize_t r;
+	size_t n;
+
+	assert(p != NULL);
 	assert(chctx != NULL);
 	assert(chctx->ioctx != NULL);
-	assert(chctx->ioctx->p != NULL);
-	assert(chctx->ioctx->tt == tt);
+	assert(chctx->ioctx->ready == RS_WAIT);
 
-	switch (event->type) {
-	case TELNET_EV_TTYPE:
-		assert(event->ttype.name != NULL);
+	ctx = chctx->ioctx;
 
-		if (event->ttype.name == NULL || strlen(event->ttype.name) == 0) {
-			break;
-		}
+	if (ttype == NULL) {
+		next = chctx + 1;
 
-		if (chctx->ioctx->p->ttype != NULL) {
-			/* TODO: handle terminal types changing */
-			break;
+		assert(next->ioapi != NULL);
+		assert(next->ioapi->ttype != NULL);
+
+		ttype = next->ioapi->ttype(p, next);
+	}
+
+	assert(ttype != NULL);
+
+	p->ttype   = ttype;
+	ctx->ready = RS_READY;
+
+	if (-1 == chain_create(p, chctx)) {
+		return -1;
+	}
+
+	n = ctx->early_len;
+	ctx->early_len = 0;
+
+	for (s = ctx->early; n > 0; s += r, n -= r) {
+		r = recv_data(p, chctx, s, n);
+		if (r == -1) {
+			return -1;
 		}
 
-		/* TODO: find out if this $TERM is supported; if not, continue to the next */
+		assert(r > 0);
+	}
 
-		{
-			char *s;
+	return 0;
+}
 
-			/* XXX: strdup? */
-			/* XXX: allocate after struct for free() convenience */
-			s = strdup(event->ttype.name);
+static int
+expired(const struct ioctx *ctx)
+{
+	struct timespec now;
 
-			for (chctx->ioctx->p->ttype = s; *s != '\0'; s++) {
-				*s = tolower((unsigned char) *s);
-			}
+	assert(ctx != NULL);
+
+	if (ctx->ready != RS_WAIT || !ctx->timed) {
+		return 0;
+	}
+
+	if (-1 == clock_gettime(CLOCK_MONOTONIC, &now)) {
+		/* no clock; better to stop waiting than to wait forever */
+		return 1;
+	}
+
+	if (now.tv_sec != ctx->deadline.tv_sec) {
+		return now.tv_sec > ctx->deadline.tv_sec;
+	}
+
+	return now.tv_nsec >= ctx->deadline.tv_nsec;
+}
+
+/*
+ * The peer's answer (or demand) for one side of an option, per RFC 1143.
+ * q is our state for that side; yes is the command agreeing to it, and no
+ * the command refusing it.
+ */
+static int
+negotiate(struct cl_peer *p, struct cl_chctx chctx[],
+	unsigned char *q, int enable, unsigned char yes, unsigned char no,
+	unsigned char opt)
+{
+	assert(p != NULL);
+	assert(chctx != NULL);
+
+	if (q == NULL) {
+		/* an option we don't do; refuse it, and stay refused */
+		return enable ? send_cmd(p, chctx, no, opt) : 0;
+	}
 
-			/* TODO: now init ecma48 */
-			/* TODO: handle error */
-			ready(chctx);
+	switch (*q) {
+	case Q_NO:
+		if (!enable) {
+			return 0;
 		}
 
-		break;
+		*q = Q_YES;
+		return send_cmd(p, chctx, yes, opt);
 
-	case TELNET_EV_DATA:
+	case Q_YES:
+		if (enable) {
+			return 0;
+		}
 
-		/*
-		 * Here we have incoming data before a response for our TTYPE query.
-		 * RFC 854 suggests we buffer this (and presumbaly refrain from sending
-		 * data, too) in order to 'hide the "uncertainty period" from the user.'
-		 *
-		 * TODO: consider buffering data. For now we're just falling through to
-		 * pick a terminal type supplied from the next I/O handler.
-		 */
-		if (chctx->ioctx->p->ttype == NULL) {
-			struct cl_chctx *next;
+		*q = Q_NO;
+		return send_cmd(p, chctx, no, opt);
 
-			next = chctx + 1;
+	case Q_WANTNO:
+		*q = Q_NO;
+		return 0;
 
-			assert(next->ioapi != NULL);
-			assert(next->ioapi->ttype != NULL);
+	case Q_WANTYES:
+		*q = enable ? Q_YES : Q_NO;
+		return 0;
+	}
 
-			chctx->ioctx->p->ttype = next->ioapi->ttype(chctx->ioctx->p, next);
+	return 0;
+}
+
+static int
+option(struct cl_peer *p, struct cl_chctx chctx[],
+	unsigned char cmd, unsigned char opt)
+{
+	struct ioctx *ctx;
+	size_t i;
+
+	assert(p != NULL);
+	assert(chctx != NULL);
+	assert(chctx->ioctx != NULL);
 
-			assert(chctx->ioctx->p->ttype != NULL);
+	ctx = chctx->ioctx;
 
-			/* TODO: now init ecma48 */
-			/* TODO: handle error */
-			ready(chctx);
+	for (i = 0; i < NOPTS; i++) {
+		if (opts[i] == opt) {
+			break;
 		}
+	}
 
+	switch (cmd) {
+	case WILL:
+	case WONT:
+		if (-1 == negotiate(p, chctx, i < NOPTS ? &ctx->him[i] : NULL,
+			cmd == WILL, DO, DONT, opt))
 		{
-			struct cl_chctx *prev;
+			return -1;
+		}
+		break;
+
+	case DO:   return negotiate(p, chctx, i < NOPTS ? &ctx->us[i]  : NULL, 1, WILL, WONT, opt);
+	case DONT: return negotiate(p, chctx, i < NOPTS ? &ctx->us[i]  : NULL, 0, WILL, WONT, opt);
+
+	default:
+		return 0;
+	}
+
+	if (opt != TELOPT_TTYPE || ctx->ready != RS_WAIT) {
+		return 0;
+	}
+
+	assert(i < NOPTS);
+
+	switch (ctx->him[i]) {
+	case Q_YES: {
+		/* the peer will give its terminal type, so now we ask for it */
+		static const unsigned char a[] = {
+			IAC, SB, TELOPT_TTYPE, TTYPE_SEND, IAC, SE
+		};
+
+		return send_raw(p, chctx, a, sizeof a);
+	}
+
+	case Q_NO:
+		/* the peer won't; there's nothing to wait for */
+		return ready(p, chctx, NULL);
+
+	default:
+		return 0;
+	}
+}
+
+static int
+subnegotiation(struct cl_peer *p, struct cl_chctx chctx[])
+{
+	struct ioctx *ctx;
+	size_t i, n;
+
+	assert(p != NULL);
+	assert(chctx != NULL);
+	assert(chctx->ioctx != NULL);
+
+	ctx = chctx->ioctx;
+
+	if (ctx->sbopt != TELOPT_TTYPE || ctx->sblen > sizeof ctx->sb) {
+		return 0;
+	}
+
+	if (ctx->sblen < 2 || (unsigned char) ctx->sb[0] != TTYPE_IS) {
+		return 0;
+	}
+
+	if (ctx->ready != RS_WAIT) {
+		/* TODO: handle terminal types changing */
+		return 0;
+	}
+
+	/* TODO: find out if this $TERM is supported; if not, continue to the next */
+
+	n = ctx->sblen - 1;
+
+	for (i = 0; i < n; i++) {
+		ctx->ttype[i] = tolower((unsigned char) ctx->sb[1 + i]);
+	}
+
+	ctx->ttype[n] = '\0';
+
+	if (strlen(ctx->ttype) == 0) {
+		return 0;
+	}
+
+	return ready(p, chctx, ctx->ttype);
+}
+
+/* a subnegotiation too long to keep is counted past sizeof sb, and ignored */
+static void
+sbbyte(struct ioctx *ctx, unsigned char c)
+{
+	assert(ctx != NULL);
+
+	if (ctx->sblen < sizeof ctx->sb) {
+		ctx->sb[ctx->sblen] = c;
+	}
+
+	if (ctx->sblen <= sizeof ctx->sb) {
+		ctx->sblen++;
+	}
+}
+
+/*
+ * Pass a run of data up the chain. Returns the number of bytes taken, which
+ * is short when a command there has left too much output queued.
+ */
+static ssize_t
+up(struct cl_peer *p, struct cl_chctx chctx[], const char *s, size_t n)
+{
+	struct cl_chctx *prev;
+
+	assert(p != NULL);
+	assert(chctx != NULL);
+	assert(s != NULL);
+
+	if (n == 0) {
+		return 0;
+	}
+
+	prev = chctx - 1;
+
+	assert(prev->ioapi != NULL);
+	assert(prev->ioapi->read != NULL);
+
+	return prev->ioapi->read(p, prev, s, n);
+}
+
+/* data taken only up to s + r, of that from start */
+static size_t
+taken(struct ioctx *ctx, const char *start, const char *s, size_t r)
+{
+	assert(ctx != NULL);
+	assert(start != NULL && s != NULL);
 
-			prev = chctx - 1;
+	ctx->cr = r > 0 && s[r - 1] == '\r';
 
-			assert(prev->ioapi != NULL);
-			assert(prev->ioapi->read != NULL);
+	return s + r - start;
+}
 
-			/* TODO: handle error */
-			(void) prev->ioapi->read(chctx->ioctx->p, prev,
-				event->data.buffer, event->data.size);
+/*
+ * A run of data, free of IAC. CR NUL is how a bare CR is sent (RFC 854);
+ * the NUL is dropped here, and CR LF is left for the key decoder.
+ *
+ * Returns the number of bytes taken, as for up().
+ */
+static ssize_t
+recv_data(struct cl_peer *p, struct cl_chctx chctx[], const char *s, size_t n)
+{
+	struct ioctx *ctx;
+	const char *start, *end, *cr;
+	ssize_t r;
+
+	assert(p != NULL);
+	assert(chctx != NULL);
+	assert(chctx->ioctx != NULL);
+	assert(s != NULL);
+
+	ctx = chctx->ioctx;
+
+	if (n == 0) {
+		return 0;
+	}
+
+	/* data before the terminal type is held, so far as it fits */
+	if (ctx->ready == RS_WAIT) {
+		if (n <= sizeof ctx->early - ctx->early_len) {
+			memcpy(ctx->early + ctx->early_len, s, n);
+			ctx->early_len += n;
+			return n;
 		}
-		return;
 
-	case TELNET_EV_SEND:
-/* TODO: this can occur before ecma48 is initialised, but that's okay. it only occurs after cl_ready(),
-so the user's callbacks will operate to write to the wire */
-		{
-			struct cl_chctx *next;
+		if (-1 == ready(p, chctx, NULL)) {
+			return -1;
+		}
+	}
 
-			next = chctx + 1;
+	start = s;
+	end   = s + n;
 
-			assert(next->ioapi != NULL);
-			assert(next->ioapi->printf != NULL);
+	if (ctx->cr && *s == '\0') {
+		s++;
+	}
+
+	ctx->cr = 0;
 
-			/* TODO: really want a .write() here, for binary */
-			/* TODO: handle error */
-			/* XXX: cast to int for printf */
-			(void) next->ioapi->printf(chctx->ioctx->p, next, "%.*s",
-				(int) event->data.size, event->data.buffer);
+	for (cr = s; (cr = memchr(cr, '\r', end - cr)) != NULL; ) {
+		cr++;
+
+		if (cr == end) {
+			ctx->cr = 1;
+			break;
 		}
-		return;
-
-	case TELNET_EV_ENVIRON:
-	case TELNET_EV_IAC:
-	case TELNET_EV_WILL:
-	case TELNET_EV_WONT:
-	case TELNET_EV_DO:
-	case TELNET_EV_DONT:
-	case TELNET_EV_SUBNEGOTIATION:
-	case TELNET_EV_COMPRESS:
-	case TELNET_EV_ZMP:
-	case TELNET_EV_MSSP:
-	case TELNET_EV_WARNING:
-	case TELNET_EV_ERROR:
-		/* TODO: ... */
-		break;
+
+		if (*cr != '\0') {
+			continue;
+		}
+
+		r = up(p, chctx, s, cr - s);
+		if (r == -1) {
+			return -1;
+		}
+
+		if (p->stalled) {
+			return taken(ctx, start, s, r);
+		}
+
+		s = ++cr;
 	}
+
+	r = up(p, chctx, s, end - s);
+	if (r == -1) {
+		return -1;
+	}
+
+	if (p->stalled) {
+		return taken(ctx, start, s, r);
+	}
+
+	return n;
 }
 
 static int
 cltelnet_create(struct cl_peer *p, struct cl_chctx chctx[])
 {
+	unsigned char a[NOPTS * 6], *q;
+	struct ioctx *ctx;
+	unsigned ms;
 	size_t i;
 
-	static const telnet_telopt_t opts[] = {
-		{ TELNET_TELOPT_ECHO,  TELNET_WILL, TELNET_DO },
-		{ TELNET_TELOPT_SGA,   TELNET_WILL, TELNET_DO },
-		{ TELNET_TELOPT_TTYPE, TELNET_WILL, TELNET_DO },
-		{ -1, 0, 0 }
-	};
-
 	assert(p != NULL);
+	assert(p->tree != NULL);
 	assert(chctx != NULL);
 	assert(chctx->ioctx == NULL);
 	assert(chctx->ioapi != NULL);
@@ -187,31 +556,63 @@ cltelnet_create(struct cl_peer *p, struct cl_chctx chctx[])
 		return -1;
 	}
 
-	chctx->ioctx->p = p;
+	ctx = chctx->ioctx;
 
-	chctx->ioctx->tt = telnet_init(opts, handler, 0, chctx);
-	if (chctx->ioctx->tt == NULL) {
-		free(chctx->ioctx);
-		chctx->ioctx = NULL;
-		return -1;
+	ctx->p         = p;
+	ctx->ready     = RS_WAIT;
+	ctx->state     = TS_DATA;
+	ctx->cr        = 0;
+	ctx->sblen     = 0;
+	ctx->early_len = 0;
+	ctx->buf       = NULL;
+	ctx->bufsz     = 0;
+
+	ms = p->tree->ttype_timeout;
+	ctx->timed = ms != 0;
+
+	if (ctx->timed) {
+		if (-1 == clock_gettime(CLOCK_MONOTONIC, &ctx->deadline)) {
+			goto error;
+		}
+
+		ctx->deadline.tv_sec  += ms / 1000;
+		ctx->deadline.tv_nsec += (long) (ms % 1000) * 1000000L;
+
+		if (ctx->deadline.tv_nsec >= 1000000000L) {
+			ctx->deadline.tv_sec++;
+			ctx->deadline.tv_nsec -= 1000000000L;
+		}
 	}
 
-	/* XXX: I don't understand why I'm having to do this here, as well as in the table above */
-	for (i = 0; i < sizeof opts / sizeof *opts; i++) {
-		telnet_negotiate(chctx->ioctx->tt, opts[i].us,  opts[i].telopt);
-		telnet_negotiate(chctx->ioctx->tt, opts[i].him, opts[i].telopt);
+	/*
+	 * Everything is offered at once. The TTYPE query itself waits for
+	 * the peer's WILL TTYPE, since RFC 1091 has it sent only after that.
+	 */
+	q = a;
+
+	for (i = 0; i < NOPTS; i++) {
+		ctx->us[i]  = Q_WANTYES;
+		ctx->him[i] = Q_WANTYES;
+
+		*q++ = IAC; *q++ = WILL; *q++ = opts[i];
+		*q++ = IAC; *q++ = DO;   *q++ = opts[i];
 	}
 
-/* XXX:
-telnet_begin_newenviron(ioctx->tt, TELNET_ENVIRON_SEND);
-telnet_newenviron_value(ioctx->tt, 
-*/
+	assert(q == a + sizeof a);
 
-	telnet_ttype_send(chctx->ioctx->tt);
+	if (-1 == send_raw(p, chctx, a, sizeof a)) {
+		goto error;
+	}
 
 	return 0;
-}
 
+error:
+
+	free(chctx->ioctx);
+	chctx->ioctx = NULL;
+
+	return -1;
+}
 
 static void
 cltelnet_destroy(struct cl_peer *p, struct cl_chctx chctx[])
@@ -222,10 +623,11 @@ cltelnet_destroy(struct cl_peer *p, struct cl_chctx chctx[])
 	assert(chctx->ioapi->destroy == cltelnet_destroy);
 
 	if (chctx->ioctx != NULL) {
-		assert(chctx->ioctx->tt != NULL);
-
-		telnet_free(chctx->ioctx->tt);
+		if (p->ttype == chctx->ioctx->ttype) {
+			p->ttype = NULL;
+		}
 
+		free(chctx->ioctx->buf);
 		free(chctx->ioctx);
 	}
 
@@ -236,38 +638,170 @@ static ssize_t
 cltelnet_read(struct cl_peer *p, struct cl_chctx chctx[],
 	const void *data, size_t len)
 {
+	struct ioctx *ctx;
+	const char *s, *end, *iac;
+	unsigned char c;
+	ssize_t r;
+
 	assert(p != NULL);
 	assert(chctx != NULL);
 	assert(chctx->ioctx != NULL);
 	assert(chctx->ioctx->p != NULL);
-	assert(chctx->ioctx->tt != NULL);
 	assert(chctx->ioapi != NULL);
 	assert(chctx->ioapi->read == cltelnet_read);
 	assert(data != NULL);
 
-	telnet_recv(chctx->ioctx->tt, data, len);
+	if (len > SSIZE_MAX) {
+		len = SSIZE_MAX;
+	}
+
+	ctx = chctx->ioctx;
+
+	/* the wait is over before this data arrived */
+	if (expired(ctx)) {
+		if (-1 == ready(p, chctx, NULL)) {
+			return -1;
+		}
+	}
+
+	s   = data;
+	end = s + len;
+
+	while (s < end) {
+		if (ctx->state == TS_DATA) {
+			iac = memchr(s, IAC, end - s);
+			if (iac == NULL) {
+				iac = end;
+			}
+
+			r = recv_data(p, chctx, s, iac - s);
+			if (r == -1) {
+				return -1;
+			}
+
+			/* the rest waits for the application to give it again */
+			if (p->stalled) {
+				return s + r - (const char *) data;
+			}
+
+			if (iac == end) {
+				break;
+			}
+
+			s = iac + 1;
+			ctx->state = TS_IAC;
+			continue;
+		}
+
+		c = (unsigned char) *s++;
+
+		switch (ctx->state) {
+		case TS_IAC:
+			switch (c) {
+			case IAC:
+				/* an escaped 0xFF, which is data; alone, it is never a command */
+				ctx->state = TS_DATA;
+				r = recv_data(p, chctx, s - 1, 1);
+				if (r == -1) {
+					return -1;
+				}
+
+				assert(r == 1);
+				break;
+
+			case WILL:
+			case WONT:
+			case DO:
+			case DONT:
+				ctx->cmd   = c;
+				ctx->state = TS_OPT;
+				break;
+
+			case SB:
+				ctx->state = TS_SB;
+				break;
+
+			default:
+				/* NOP, GA, AYT and the like; nothing for us */
+				ctx->state = TS_DATA;
+				break;
+			}
+			break;
+
+		case TS_OPT:
+			ctx->state = TS_DATA;
+			if (-1 == option(p, chctx, ctx->cmd, c)) {
+				return -1;
+			}
+			break;
+
+		case TS_SB:
+			ctx->sbopt = c;
+			ctx->sblen = 0;
+			ctx->state = TS_SB_DATA;
+			break;
+
+		case TS_SB_DATA:
+			if (c == IAC) {
+				ctx->state = TS_SB_IAC;
+				break;
+			}
+
+			sbbyte(ctx, c);
+			break;
+
+		case TS_SB_IAC:
+			switch (c) {
+			case IAC:
+				ctx->state = TS_SB_DATA;
+				sbbyte(ctx, c);
+				break;
+
+			case SE:
+				ctx->state = TS_DATA;
+				if (-1 == subnegotiation(p, chctx)) {
+					return -1;
+				}
+				break;
+
+			default:
+				/* not an SE; the subnegotiation is abandoned, and this is a command */
+				ctx->state = TS_IAC;
+				s--;
+				break;
+			}
+			break;
+
+		case TS_DATA:
+			/* UNREACHED */
+			break;
+		}
+	}
 
-	/* TODO: really all of len consumed? */
 	return len;
 }
 
 static ssize_t
 cltelnet_send(struct cl_peer *p, struct cl_chctx chctx[],
-	enum ui_output output)
+	enum ui_output output, size_t n)
 {
 	struct cl_chctx *next;
 
 	assert(p != NULL);
 	assert(p->tree != NULL);
-	assert(p->tree->vprintf != NULL);
 	assert(chctx != NULL);
 
 	next = chctx + 1;
 
 	(void) next;
 
+	(void) n;
+
 	switch (output) {
 	case OUT_BACKSPACE_AND_DELETE:
+	case OUT_CURSOR_LEFT:
+	case OUT_DELETE:
+	case OUT_DELETE_TO_EOL:
 	case OUT_SAVE:
 	case OUT_RESTORE_AND_DELETE_TO_EOL:
 		/* TODO: nothing sensible we can do here? ecma48 should have done this for us */
@@ -281,27 +815,322 @@ cltelnet_send(struct cl_peer *p, struct cl_chctx chctx[],
 	return 0;
 }
 
+/*
+ * Output is escaped by scanning for the bytes which need it a machine word
+ * at a time, as the lexer skips runs (see lexer.c), and the unchanged runs
+ * between them are gathered with their escapes into an iovec, to go down
+ * the chain as one vectored write. Output needing no escapes at all is a
+ * single run, passed on as it is.
+ */
+
+#define ONES  (~0UL / 255)
+#define HIGHS (ONES * 128)
+
+/* any byte less than n, for n <= 128 */
+#define HASLESS(x, n) (((x) - ONES * (n)) & ~(x) & HIGHS)
+#define HASBYTE(x, c) HASLESS((x) ^ (ONES * (unsigned char) (c)), 1)
+
+/* runs gathered before they're sent on */
+#define OUT_IOV 32
+
+struct out {
+	struct iovec iov[OUT_IOV];
+	int n;
+};
+
+static int
+out_flush(struct cl_peer *p, struct cl_chctx chctx[], struct out *o)
+{
+	struct cl_chctx *next;
+
+	assert(p != NULL);
+	assert(chctx != NULL);
+	assert(o != NULL);
+
+	if (o->n == 0) {
+		return 0;
+	}
+
+	next = chctx + 1;
+
+	assert(next->ioapi != NULL);
+	assert(next->ioapi->writev != NULL);
+
+	if (-1 == next->ioapi->writev(p, next, o->iov, o->n)) {
+		return -1;
+	}
+
+	o->n = 0;
+
+	return 0;
+}
+
+static int
+out_add(struct cl_peer *p, struct cl_chctx chctx[], struct out *o,
+	const char *s, size_t n)
+{
+	assert(o != NULL);
+	assert(s != NULL || n == 0);
+
+	if (n == 0) {
+		return 0;
+	}
+
+	if (o->n == OUT_IOV && -1 == out_flush(p, chctx, o)) {
+		return -1;
+	}
+
+	o->iov[o->n].iov_base = (void *) s;
+	o->iov[o->n].iov_len  = n;
+	o->n++;
+
+	return 0;
+}
+
+/* the next byte to escape: IAC, CR or LF */
+static const char *
+scan(const char *s, const char *end)
+{
+	unsigned long x;
+
+	assert(s != NULL && end != NULL);
+
+	while ((size_t) (end - s) >= sizeof x) {
+		memcpy(&x, s, sizeof x);
+
+		if (HASBYTE(x, IAC)) {
+			break;
+		}
+
+		if (HASBYTE(x, '\n') || HASBYTE(x, '\r')) {
+			break;
+		}
+
+		s += sizeof x;
+	}
+
+	for ( ; s < end; s++) {
+		if ((unsigned char) *s == IAC) {
+			break;
+		}
+
+		if (*s == '\n' || *s == '\r') {
+			break;
+		}
+	}
+
+	return s;
+}
+
+/*
+ * IAC is doubled by ending one run just after it, and starting the next
+ * at it, so it's sent twice without an escape of its own. TRANSMIT-BINARY
+ * is never negotiated, so everything from above is NVT text (RFC 854):
+ * each newline becomes CR LF, and a bare CR becomes CR NUL. A CR LF
+ * already given is sent as it is.
+ */
+static int
+escape(struct cl_peer *p, struct cl_chctx chctx[], struct out *o,
+	const char *s, size_t n)
+{
+	const char *end, *q, *t;
+
+	assert(p != NULL);
+	assert(chctx != NULL);
+	assert(o != NULL);
+	assert(s != NULL || n == 0);
+
+	end = s + n;
+
+	for (q = s; (t = scan(q, end)) != end; q = t + 1) {
+		if ((unsigned char) *t == IAC) {
+			if (-1 == out_add(p, chctx, o, s, t + 1 - s)) {
+				return -1;
+			}
+
+			s = t;
+			continue;
+		}
+
+		if (-1 == out_add(p, chctx, o, s, t - s)) {
+			return -1;
+		}
+
+		if (*t == '\r' && t + 1 < end && t[1] == '\n') {
+			t++;
+		}
+
+		if (-1 == out_add(p, chctx, o, *t == '\n' ? "\r\n" : "\r\0", 2)) {
+			return -1;
+		}
+
+		s = t + 1;
+	}
+
+	return out_add(p, chctx, o, s, end - s);
+}
+
+static ssize_t
+cltelnet_write(struct cl_peer *p, struct cl_chctx chctx[],
+	const void *data, size_t len)
+{
+	struct out o;
+
+	assert(p != NULL);
+	assert(chctx != NULL);
+	assert(chctx->ioctx != NULL);
+	assert(chctx->ioapi != NULL);
+	assert(chctx->ioapi->write == cltelnet_write);
+	assert(data != NULL || len == 0);
+
+	if (len > SSIZE_MAX) {
+		len = SSIZE_MAX;
+	}
+
+	o.n = 0;
+
+	if (-1 == escape(p, chctx, &o, data, len)) {
+		return -1;
+	}
+
+	if (-1 == out_flush(p, chctx, &o)) {
+		return -1;
+	}
+
+	return len;
+}
+
+/* room for n bytes and a terminator for vsnprintf() */
+static int
+reserve(struct ioctx *ctx, size_t n)
+{
+	size_t size;
+	char *tmp;
+
+	assert(ctx != NULL);
+
+	if (n < ctx->bufsz) {
+		return 0;
+	}
+
+	size = ctx->bufsz == 0 ? 256 : ctx->bufsz;
+	while (size <= n) {
+		size *= 2;
+	}
+
+	tmp = realloc(ctx->buf, size);
+	if (tmp == NULL) {
+		return -1;
+	}
+
+	ctx->buf   = tmp;
+	ctx->bufsz = size;
+
+	return 0;
+}
+
+/*
+ * Formatted once into the ioctx's buffer, and escaped from there; the format
+ * is repeated only when the buffer has had to grow to fit.
+ */
 static int
 cltelnet_vprintf(struct cl_peer *p, struct cl_chctx chctx[],
 	const char *fmt, va_list ap)
 {
-	struct cl_chctx *next;
+	struct ioctx *ctx;
+	struct out o;
+	int r;
 
 	assert(p != NULL);
 	assert(p->tree != NULL);
-	assert(p->tree->vprintf != NULL);
 	assert(chctx->ioctx != NULL);
 	assert(chctx->ioctx->p != NULL);
-	assert(chctx->ioctx->tt != NULL);
 	assert(chctx->ioapi != NULL);
 	assert(chctx->ioapi->vprintf == cltelnet_vprintf);
 	assert(fmt != NULL);
 
-	next = chctx + 1;
+	ctx = chctx->ioctx;
 
-	(void) next;
+	for (;;) {
+		r = fmt_vsnprintf(ctx->buf, ctx->bufsz, fmt, ap);
+		if (r < 0) {
+			return -1;
+		}
+
+		if ((size_t) r < ctx->bufsz) {
+			break;
+		}
+
+		if (-1 == reserve(ctx, r)) {
+			return -1;
+		}
+	}
+
+	o.n = 0;
+
+	if (-1 == escape(p, chctx, &o, ctx->buf, r)) {
+		return -1;
+	}
+
+	if (-1 == out_flush(p, chctx, &o)) {
+		return -1;
+	}
+
+	return r;
+}
+
+/* all of the vector's runs and escapes are gathered into one write */
+static ssize_t
+cltelnet_writev(struct cl_peer *p, struct cl_chctx chctx[],
+	const struct iovec *iov, int iovcnt)
+{
+	struct out o;
+	ssize_t n;
+	int i;
+
+	assert(p != NULL);
+	assert(chctx != NULL);
+	assert(chctx->ioapi != NULL);
+	assert(chctx->ioapi->writev == cltelnet_writev);
+	assert(iov != NULL || iovcnt == 0);
+
+	n   = 0;
+	o.n = 0;
+
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len > (size_t) (SSIZE_MAX - n)) {
+			break;
+		}
+
+		if (-1 == escape(p, chctx, &o, iov[i].iov_base, iov[i].iov_len)) {
+			return -1;
+		}
+
+		n += iov[i].iov_len;
+	}
+
+	if (-1 == out_flush(p, chctx, &o)) {
+		return -1;
+	}
+
+	return n;
+}
+
+static int
+cltelnet_tick(struct cl_peer *p, struct cl_chctx chctx[])
+{
+	assert(p != NULL);
+	assert(chctx != NULL);
+	assert(chctx->ioapi != NULL);
+	assert(chctx->ioapi->tick == cltelnet_tick);
+
+	if (chctx->ioctx != NULL && expired(chctx->ioctx)) {
+		if (-1 == ready(p, chctx, NULL)) {
+			return -1;
+		}
+	}
 
-	return telnet_vprintf(chctx->ioctx->tt, fmt, ap);
+	return chain_tick(p, chctx);
 }
 
 const struct io io_telnet = {
@@ -311,6 +1140,11 @@ const struct io io_telnet = {
 	cltelnet_send,
 	cltelnet_vprintf,
 	chain_printf,
-	chain_ttype
+	cltelnet_write,
+	cltelnet_writev,
+	chain_ttype,
+	chain_flush,
+	chain_pending,
+	cltelnet_tick
 };
 
@@ -0,0 +1,377 @@
+/*
+ * Copyright 2012-2017 Katherine Flavel
+ *
+ * See LICENCE for the full copyright terms.
+ */
+
+#include <assert.h>
+#include <stddef.h>
+
+#include "internal.h"
+
+/*
+ * Keys as sent by ECMA-48 terminals, decoded to the line editor's events.
+ *
+ * Only the keys which mean something to the editor are recognised: the C0
+ * controls, the cursor and editing keys as CSI and SS3 sequences (with any
+ * modifier parameters ignored), F1 for help, and Alt (as an ESC prefix) on
+ * the keys for moving by word. Everything else is dropped.
+ *
+ * This needs no terminfo; the sequences are the same for every terminal
+ * we care about. The tables here are shared, and the state kept per peer
+ * is a handful of bytes, to hold a sequence split between reads.
+ *
+ * A lone ESC (the Escape key itself) waits for the next byte, which is
+ * harmless since Escape does nothing here anyway.
+ */
+
+#define NONE -1
+
+struct keymap {
+	int type;         /* enum ui_event, or NONE */
+	const char *utf8; /* UI_CODEPOINT */
+};
+
+enum {
+	KEY_GROUND,
+	KEY_ESC,
+	KEY_CSI,
+	KEY_LINUX, /* ESC [ [, the Linux console's function keys */
+	KEY_SS3,
+	KEY_UTF8
+};
+
+static const struct keymap c0[32] = {
+	{ NONE,             NULL }, /* ^@ */
+	{ UI_CURSOR_SOL,    NULL }, /* ^A */
+	{ UI_CURSOR_LEFT,   NULL }, /* ^B */
+	{ UI_CANCEL,        NULL }, /* ^C */
+	{ UI_DELETE,        NULL }, /* ^D */
+	{ UI_CURSOR_EOL,    NULL }, /* ^E */
+	{ UI_CURSOR_RIGHT,  NULL }, /* ^F */
+	{ NONE,             NULL }, /* ^G */
+	{ UI_BACKSPACE,     NULL }, /* ^H */
+	{ UI_CODEPOINT,     "\t" }, /* ^I, Tab */
+	{ UI_CODEPOINT,     "\n" }, /* ^J, from a terminal translating CR */
+	{ UI_DELETE_TO_EOL, NULL }, /* ^K */
+	{ NONE,             NULL }, /* ^L */
+	{ UI_CODEPOINT,     "\n" }, /* ^M, Enter */
+	{ UI_HIST_NEXT,     NULL }, /* ^N */
+	{ NONE,             NULL }, /* ^O */
+	{ UI_HIST_PREV,     NULL }, /* ^P */
+	{ NONE,             NULL }, /* ^Q */
+	{ UI_HIST_SEARCH,   NULL }, /* ^R */
+	{ NONE,             NULL }, /* ^S */
+	{ NONE,             NULL }, /* ^T */
+	{ UI_DELETE_LINE,   NULL }, /* ^U */
+	{ NONE,             NULL }, /* ^V */
+	{ UI_DELETE_WORD,   NULL }, /* ^W */
+	{ NONE,             NULL }, /* ^X */
+	{ NONE,             NULL }, /* ^Y */
+	{ NONE,             NULL }, /* ^Z */
+	{ NONE,             NULL }, /* ^[, handled as ESC */
+	{ NONE,             NULL }, /* ^\ */
+	{ NONE,             NULL }, /* ^] */
+	{ NONE,             NULL }, /* ^^ */
+	{ NONE,             NULL }  /* ^_ */
+};
+
+/* DEL, which is what the Backspace key sends */
+static const struct keymap del = { UI_BACKSPACE, NULL };
+
+/* final bytes A-Z, which mean the same after CSI and SS3 */
+static const struct keymap final[26] = {
+	{ UI_HIST_PREV,     NULL }, /* A: Up */
+	{ UI_HIST_NEXT,     NULL }, /* B: Down */
+	{ UI_CURSOR_RIGHT,  NULL }, /* C: Right */
+	{ UI_CURSOR_LEFT,   NULL }, /* D: Left */
+	{ UI_CURSOR_SOL,    NULL }, /* E: Begin */
+	{ UI_CURSOR_EOL,    NULL }, /* F: End */
+	{ NONE,             NULL },
+	{ UI_CURSOR_SOL,    NULL }, /* H: Home */
+	{ NONE,             NULL },
+	{ NONE,             NULL },
+	{ NONE,             NULL },
+	{ NONE,             NULL },
+	{ UI_CODEPOINT,     "\n" }, /* M: keypad Enter */
+	{ NONE,             NULL },
+	{ NONE,             NULL },
+	{ UI_HELP,          NULL }, /* P: F1 */
+	{ NONE,             NULL },
+	{ NONE,             NULL },
+	{ NONE,             NULL },
+	{ NONE,             NULL },
+	{ NONE,             NULL },
+	{ NONE,             NULL },
+	{ NONE,             NULL },
+	{ NONE,             NULL },
+	{ NONE,             NULL },
+	{ NONE,             NULL }
+};
+
+/* CSI n ~, by n */
+static const struct keymap tilde[12] = {
+	{ NONE,             NULL },
+	{ UI_CURSOR_SOL,    NULL }, /* 1: Home */
+	{ NONE,             NULL }, /* 2: Insert */
+	{ UI_DELETE,        NULL }, /* 3: Delete */
+	{ UI_CURSOR_EOL,    NULL }, /* 4: End */
+	{ NONE,             NULL }, /* 5: Page Up */
+	{ NONE,             NULL }, /* 6: Page Down */
+	{ UI_CURSOR_SOL,    NULL }, /* 7: Home, rxvt */
+	{ UI_CURSOR_EOL,    NULL }, /* 8: End, rxvt */
+	{ NONE,             NULL },
+	{ NONE,             NULL },
+	{ UI_HELP,          NULL }  /* 11: F1 */
+};
+
+static const struct keymap none = { NONE, NULL };
+
+/* Alt, sent as an ESC prefix */
+static const struct keymap *
+alt(unsigned char c)
+{
+	static const struct keymap left  = { UI_CURSOR_LEFT_WORD,  NULL };
+	static const struct keymap right = { UI_CURSOR_RIGHT_WORD, NULL };
+
+	switch (c) {
+	case 'b': return &left;
+	case 'f': return &right;
+
+	default:
+		return &none;
+	}
+}
+
+/* the number of continuation bytes which follow a UTF-8 lead byte */
+static unsigned
+utf8_need(unsigned char c)
+{
+	if (c >= 0xc2 && c <= 0xdf) {
+		return 1;
+	}
+
+	if (c >= 0xe0 && c <= 0xef) {
+		return 2;
+	}
+
+	if (c >= 0xf0 && c <= 0xf4) {
+		return 3;
+	}
+
+	return 0;
+}
+
+void
+key_init(struct keyctx *k)
+{
+	assert(k != NULL);
+
+	k->state = KEY_GROUND;
+	k->param = 0;
+	k->semi  = 0;
+	k->need  = 0;
+	k->len   = 0;
+	k->cr    = 0;
+}
+
+/*
+ * Consume bytes from *s up to and including the next key, which is given
+ * in *e. Returns 0 when the input runs out first; any partial sequence is
+ * kept for the next call. A codepoint's text is stored in k, and so lives
+ * until the next call.
+ *
+ * A byte which cannot continue the current sequence abandons it, and is
+ * then taken afresh, so that a control key is never lost to a sequence
+ * cut short.
+ */
+int
+key_next(struct keyctx *k, const char **s, const char *end, struct cl_event *e)
+{
+	const struct keymap *m;
+	unsigned char c;
+	unsigned n;
+
+	assert(k != NULL);
+	assert(s != NULL && *s != NULL);
+	assert(end != NULL);
+	assert(e != NULL);
+
+	while (*s < end) {
+		c = (unsigned char) **s;
+
+		switch (k->state) {
+		case KEY_GROUND:
+			(*s)++;
+
+			/* CR LF is one Enter */
+			if (c == '\n' && k->cr) {
+				k->cr = 0;
+				continue;
+			}
+
+			k->cr = c == '\r';
+
+			if (c == '\033') {
+				k->state = KEY_ESC;
+				continue;
+			}
+
+			if (c < 0x20) {
+				m = &c0[c];
+				break;
+			}
+
+			if (c == 0x7f) {
+				m = &del;
+				break;
+			}
+
+			if (c < 0x80) {
+				k->utf8[0] = c;
+				k->utf8[1] = '\0';
+
+				e->type   = UI_CODEPOINT;
+				e->u.utf8 = k->utf8;
+				return 1;
+			}
+
+			n = utf8_need(c);
+			if (n == 0) {
+				continue;
+			}
+
+			k->utf8[0] = c;
+			k->len     = 1;
+			k->need    = n;
+			k->state   = KEY_UTF8;
+			continue;
+
+		case KEY_UTF8:
+			if ((c & 0xc0) != 0x80) {
+				k->state = KEY_GROUND;
+				continue;
+			}
+
+			(*s)++;
+
+			assert(k->len < sizeof k->utf8 - 1);
+			k->utf8[k->len++] = c;
+
+			if (--k->need > 0) {
+				continue;
+			}
+
+			k->utf8[k->len] = '\0';
+			k->state = KEY_GROUND;
+
+			e->type   = UI_CODEPOINT;
+			e->u.utf8 = k->utf8;
+			return 1;
+
+		case KEY_ESC:
+			switch (c) {
+			case '[':
+				(*s)++;
+				k->state = KEY_CSI;
+				k->param = 0;
+				k->semi  = 0;
+				continue;
+
+			case 'O':
+				(*s)++;
+				k->state = KEY_SS3;
+				continue;
+
+			case '\033':
+				/* Escape, then another key */
+				(*s)++;
+				continue;
+			}
+
+			k->state = KEY_GROUND;
+
+			/* Alt is ignored for the control keys */
+			if (c < 0x20 || c >= 0x7f) {
+				continue;
+			}
+
+			(*s)++;
+			m = alt(c);
+			break;
+
+		case KEY_CSI:
+			if (c < 0x20 || c > 0x7e) {
+				k->state = KEY_GROUND;
+				continue;
+			}
+
+			(*s)++;
+
+			if (c >= '0' && c <= '9') {
+				/* the first parameter only; the rest are modifiers */
+				if (!k->semi) {
+					n = k->param * 10U + (c - '0');
+					k->param = n > 255 ? 255 : n;
+				}
+				continue;
+			}
+
+			if (c < 0x40) {
+				/* other parameter and intermediate bytes */
+				k->semi = 1;
+				continue;
+			}
+
+			if (c == '[' && k->param == 0 && !k->semi) {
+				k->state = KEY_LINUX;
+				continue;
+			}
+
+			k->state = KEY_GROUND;
+
+			if (c == '~') {
+				m = k->param < sizeof tilde / sizeof *tilde ? &tilde[k->param] : &none;
+			} else if (c >= 'A' && c <= 'Z') {
+				m = &final[c - 'A'];
+			} else {
+				m = &none;
+			}
+			break;
+
+		case KEY_LINUX:
+		case KEY_SS3:
+			if (c < 0x20 || c > 0x7e) {
+				k->state = KEY_GROUND;
+				continue;
+			}
+
+			(*s)++;
+
+			if (k->state == KEY_LINUX) {
+				m = c == 'A' ? &final['P' - 'A'] : &none;
+			} else {
+				m = c >= 'A' && c <= 'Z' ? &final[c - 'A'] : &none;
+			}
+
+			k->state = KEY_GROUND;
+			break;
+
+		default:
+			/* UNREACHED */
+			k->state = KEY_GROUND;
+			continue;
+		}
+
+		if (m->type == NONE) {
+			continue;
+		}
+
+		e->type   = m->type;
+		e->u.utf8 = m->utf8;
+
+		return 1;
+	}
+
+	return 0;
+}
@@ -6,12 +6,124 @@
 
 #include <assert.h>
 #include <string.h>
-#include <ctype.h>
 
 #include "internal.h"
 
-struct lex_tok *
-lex_next(struct lex_tok *new, const char **src, char **dst)
+/*
+ * Characters are classified by table rather than by isspace(), so that
+ * lexing does not depend on the locale. The whitespace characters other
+ * than ' ' are never passed on by the line editor; they are lexed as for
+ * a space, but are asserted against.
+ */
+enum {
+	W, /* word */
+	E, /* end of input */
+	S, /* space */
+	X, /* other whitespace */
+	Q, /* single quote */
+	D, /* double quote */
+	P, /* pipe */
+	B  /* backslash */
+};
+
+static const unsigned char class[256] = {
+	E, W, W, W, W, W, W, W, W, X, X, X, X, X, W, W,
+	W, W, W, W, W, W, W, W, W, W, W, W, W, W, W, W,
+	S, W, D, W, W, W, W, Q, W, W, W, W, W, W, W, W,
+	W, W, W, W, W, W, W, W, W, W, W, W, W, W, W, W,
+	W, W, W, W, W, W, W, W, W, W, W, W, W, W, W, W,
+	W, W, W, W, W, W, W, W, W, W, W, W, B, W, W, W,
+	W, W, W, W, W, W, W, W, W, W, W, W, W, W, W, W,
+	W, W, W, W, W, W, W, W, W, W, W, W, P, W, W, W,
+	W, W, W, W, W, W, W, W, W, W, W, W, W, W, W, W,
+	W, W, W, W, W, W, W, W, W, W, W, W, W, W, W, W,
+	W, W, W, W, W, W, W, W, W, W, W, W, W, W, W, W,
+	W, W, W, W, W, W, W, W, W, W, W, W, W, W, W, W,
+	W, W, W, W, W, W, W, W, W, W, W, W, W, W, W, W,
+	W, W, W, W, W, W, W, W, W, W, W, W, W, W, W, W,
+	W, W, W, W, W, W, W, W, W, W, W, W, W, W, W, W,
+	W, W, W, W, W, W, W, W, W, W, W, W, W, W, W, W
+};
+
+/*
+ * Runs of characters which need no attention (spaces between tokens, and
+ * the contents of words and strings) are skipped a machine word at a time.
+ * Each block is tested for the presence of any byte which would end the
+ * run; if there is one, the block is left for the per-character state
+ * machine to handle. These tests are exact as to whether such a byte is
+ * present, which is all we need.
+ *
+ * Blocks are read only up to the end of the input, and by memcpy(), so
+ * there are no alignment or aliasing concerns.
+ */
+
+#define ONES  (~0UL / 255)
+#define HIGHS (ONES * 128)
+
+/* any byte less than n, for n <= 128 */
+#define HASLESS(x, n) (((x) - ONES * (n)) & ~(x) & HIGHS)
+#define HASBYTE(x, c) HASLESS((x) ^ (ONES * (unsigned char) (c)), 1)
+
+enum run {
+	RUN_SPACE,
+	RUN_WORD,
+	RUN_STR1,
+	RUN_STR2
+};
+
+static const char *
+skip(enum run run, const char *s, const char *end, char **d)
+{
+	unsigned long x;
+
+	while ((size_t) (end - s) >= sizeof x) {
+		memcpy(&x, s, sizeof x);
+
+		switch (run) {
+		case RUN_SPACE:
+			if (x != ONES * ' ') {
+				return s;
+			}
+			break;
+
+		case RUN_WORD:
+			/* ' ' and below are all space, end or unusual */
+			if (HASLESS(x, ' ' + 1) || HASBYTE(x, '\'') || HASBYTE(x, '\"') || HASBYTE(x, '|')) {
+				return s;
+			}
+			break;
+
+		case RUN_STR1:
+			if (HASLESS(x, 1) || HASBYTE(x, '\'')) {
+				return s;
+			}
+			break;
+
+		case RUN_STR2:
+			if (HASLESS(x, 1) || HASBYTE(x, '\"') || HASBYTE(x, '\\')) {
+				return s;
+			}
+			break;
+		}
+
+		if (d != NULL && *d != NULL && run != RUN_SPACE) {
+			memcpy(*d, s, sizeof x);
+			*d += sizeof x;
+		}
+
+		s += sizeof x;
+	}
+
+	return s;
+}
+
+/*
+ * The state machine proper. With blocks set, runs are skipped by skip();
+ * otherwise every character is taken singly, which gives a reference for
+ * the differential test in tests/lexer.
+ */
+static struct lex_tok *
+lex(struct lex_tok *new, const char **src, const char *end, char **dst, int blocks)
 {
 	const char *s;
 	char *d;
@@ -26,17 +138,13 @@ lex_next(struct lex_tok *new, const char **src, char **dst)
 	} state;
 
 	assert(new != NULL);
-	assert(src != NULL);
+	assert(src != NULL && *src != NULL);
+	assert(end != NULL && end >= *src);
+	assert(*end == '\0');
 
 	s = *src;
 	d = dst ? *dst : NULL;
 
-	assert(!strchr(s, '\r'));
-	assert(!strchr(s, '\n'));
-	assert(!strchr(s, '\v'));
-	assert(!strchr(s, '\f'));
-	assert(!strchr(s, '\t'));
-
 	state = STATE_SPACE;
 
 	new->dst.start = d;
@@ -44,12 +152,19 @@ lex_next(struct lex_tok *new, const char **src, char **dst)
 	for (;; s++) {
 		switch (state) {
 		case STATE_SPACE:
-			switch (isspace((unsigned char) *s) ? ' ' : *s) {
-			case '\0':                                         return NULL;
-			case ' ':                                          continue;
-			case '\'': new->src.start = s; state = STATE_STR1; continue;
-			case '\"': new->src.start = s; state = STATE_STR2; continue;
-			case '|':  new->src.start = s; state = STATE_PIPE; break;
+			if (blocks) {
+				s = skip(RUN_SPACE, s, end, NULL);
+			}
+
+			assert(class[(unsigned char) *s] != X);
+
+			switch (class[(unsigned char) *s]) {
+			case E:                                            return NULL;
+			case S:                                            continue;
+			case X:                                            continue;
+			case Q:    new->src.start = s; state = STATE_STR1; continue;
+			case D:    new->src.start = s; state = STATE_STR2; continue;
+			case P:    new->src.start = s; state = STATE_PIPE; break;
 			default:   new->src.start = s; state = STATE_WORD; break;
 			}
 
@@ -62,12 +177,19 @@ lex_next(struct lex_tok *new, const char **src, char **dst)
 			}
 
 		case STATE_WORD:
-			switch (isspace((unsigned char) *s) ? ' ' : *s) {
-			case '\0': goto done;
-			case ' ':  goto done;
-			case '\'': goto done;
-			case '\"': goto done;
-			case '|':  goto done;
+			if (blocks) {
+				s = skip(RUN_WORD, s, end, &d);
+			}
+
+			assert(class[(unsigned char) *s] != X);
+
+			switch (class[(unsigned char) *s]) {
+			case E:    goto done;
+			case S:    goto done;
+			case X:    goto done;
+			case Q:    goto done;
+			case D:    goto done;
+			case P:    goto done;
 			default:   break;
 			}
 
@@ -75,9 +197,13 @@ lex_next(struct lex_tok *new, const char **src, char **dst)
 			continue;
 
 		case STATE_STR1: /* without escaping */
-			switch (*s) {
-			case '\0':       goto error;
-			case '\'': s++;  goto done;
+			if (blocks) {
+				s = skip(RUN_STR1, s, end, &d);
+			}
+
+			switch (class[(unsigned char) *s]) {
+			case E:          goto error;
+			case Q:    s++;  goto done;
 			default:         break;
 			}
 
@@ -85,10 +211,14 @@ lex_next(struct lex_tok *new, const char **src, char **dst)
 			continue;
 
 		case STATE_STR2: /* with escaping */
-			switch (*s) {
-			case '\0':                    goto error;
-			case '\"': s++;               goto done;
-			case '\\': state = STATE_ESC; continue;
+			if (blocks) {
+				s = skip(RUN_STR2, s, end, &d);
+			}
+
+			switch (class[(unsigned char) *s]) {
+			case E:                       goto error;
+			case D:    s++;               goto done;
+			case B:    state = STATE_ESC; continue;
 			default:                      break;
 			}
 
@@ -120,6 +250,7 @@ done:
 
 	*src = s;
 	if (d) *d = '\0';
+	if (d) *dst = d + 1;
 
 	new->dst.end = d;
 	new->src.end = s;
@@ -133,3 +264,25 @@ done:
 	}
 }
 
+struct lex_tok *
+lex_next(struct lex_tok *new, const char **src, const char *end, char **dst)
+{
+	return lex(new, src, end, dst, 1);
+}
+
+/*
+ * The classification for the line editor, which must agree with the lexer
+ * as to where words end.
+ */
+int
+lex_space(char c)
+{
+	return class[(unsigned char) c] == S || class[(unsigned char) c] == X;
+}
+
+/* whether c may continue a word outside of quotes */
+int
+lex_word(char c)
+{
+	return class[(unsigned char) c] == W || class[(unsigned char) c] == B;
+}
@@ -29,46 +29,44 @@ struct value {
 
 struct readctx {
 	enum readstate state;
-	const struct trie *t;
+	const struct cl_trie *t;
 	int fields;
 	struct value *values;
 	int argc;
 	const char **argv;
+	size_t *argl;
+
+	/* argv, argl, their strings and field values; reset after each command */
+	struct arena *arena;
 };
 
 /*
- * The command is stored verbatim as input by the user, followed directly by
- * each token's content, each null terminated.
- *
- * Tokens have escape sequences expanded, string quotes skipped and inter-token
- * whitespace omitted. For example (in C's notation):
- *
- *  src = " abc \t  def 'xyz' \"x\\t\\n\""
- *  dst = "abc\0def\0xyz\0x\t\n"
- *
- * gives the four tokens "abc", "def", "xyz" and "x\t\n".
- *
- * The worst case for memory use here is a sequence of pipes, where every
- * character requires termination. So the worst case memory for dst is twice
- * src, plus one for the single terminator at the end of src.
+ * The command is found from the tokens kept by the line editor, which
+ * resolved each word as it was entered. Anything after the command's
+ * words is given as arguments; *args is set to its offset in the line,
+ * and *max to the number of tokens there.
  */
 static int
-parsecommand(struct cl_peer *p, const char *src, char *dst)
+findcommand(struct cl_peer *p, size_t *args, size_t *max)
 {
-	struct lex_tok tok;
+	const struct edit_tok *tok;
+	const char *buf;
+	size_t i, n;
 
 	assert(p != NULL);
-	assert(src != NULL);
-	assert(dst != NULL);
+	assert(args != NULL);
+	assert(max != NULL);
+
+	tok = edit_tokens(p, &n, &buf);
 
 	p->rctx->t = p->tree->root;
 
-	while (lex_next(&tok, &src, &dst) != NULL) {
-		switch (tok.type) {
+	for (i = 0; i < n; i++) {
+		switch (tok[i].type) {
 		case TOK_ERROR:
-		case TOK_PIPE:	/* not implemented */
+		case TOK_PIPE:	/* filters follow a command; see filter_parse() */
 			cl_printf(p, "syntax error at: %.*s\n",
-				(int) (tok.src.end - tok.src.start), tok.src.start);
+				(int) (tok[i].end - tok[i].start), buf + tok[i].start);
 
 			return 0;
 
@@ -81,14 +79,7 @@ parsecommand(struct cl_peer *p, const char *src, char *dst)
 			return 0;
 		}
 
-		p->rctx->t = trie_walk(p->rctx->t, tok.dst.start, tok.dst.end - tok.dst.start);
-		if (p->rctx->t == NULL) {
-			cl_printf(p, "command not found\n");
-
-			return 0;
-		}
-
-		p->rctx->t = trie_run(p, p->rctx->t, p->mode, ' ');
+		p->rctx->t = tok[i].run;
 		if (p->rctx->t == NULL) {
 			cl_printf(p, "command not found\n");
 
@@ -98,21 +89,19 @@ parsecommand(struct cl_peer *p, const char *src, char *dst)
 		/* TODO: unneccessary when argv changes to contain the entire command */
 		/* TODO: then also break on a string */
 		if (p->rctx->t->command != NULL) {
+			i++;
 			break;
 		}
 	}
 
+	*args = i < n ? tok[i].start : n > 0 ? tok[n - 1].end : 0;
+	*max  = n - i;
+
 	{
 		if (p->rctx->t == p->tree->root) {
 			return 0;
 		}
 
-		if (p->rctx->t == NULL) {
-			cl_printf(p, "command not found\n");
-
-			return 0;
-		}
-
 		if (p->rctx->t->command == NULL) {
 			cl_printf(p, "command not found\n");
 
@@ -126,47 +115,86 @@ parsecommand(struct cl_peer *p, const char *src, char *dst)
 		}
 	}
 
+	return 1;
+}
+
+/*
+ * The arguments are lexed from the text stored verbatim as input by the
+ * user, into storage from the arena, each null terminated.
+ *
+ * Tokens have escape sequences expanded, string quotes skipped and inter-token
+ * whitespace omitted. For example (in C's notation):
+ *
+ *  src = " abc \t  def 'xyz' \"x\\t\\n\""
+ *  dst = "abc\0def\0xyz\0x\t\n"
+ *
+ * gives the four tokens "abc", "def", "xyz" and "x\t\n".
+ *
+ * The worst case for memory use here is a sequence of pipes, where every
+ * character requires termination. So the worst case memory for dst is twice
+ * src, plus one for the single terminator at the end of src.
+ *
+ * The line editor has lexed these already, so the number of tokens is known
+ * ahead of time, and argv needn't grow.
+ *
+ * Arguments end at the first pipe; the remainder are output filters, parsed
+ * by filter_parse(). Returns 0 for a line which is not to be run.
+ */
+static int
+parseargs(struct cl_peer *p, const char *src, size_t n, size_t max)
+{
+	struct lex_tok tok;
+	const char *end;
+	char *dst;
+
+	assert(p != NULL);
+	assert(src != NULL);
+
+	end = src + n;
+
+	if (max >= INT_MAX) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	dst           = arena_alloc(p->rctx->arena, n * 2 + 1);
+	p->rctx->argv = arena_alloc(p->rctx->arena, sizeof *p->rctx->argv * (max + 1));
+	p->rctx->argl = arena_alloc(p->rctx->arena, sizeof *p->rctx->argl * (max + 1));
+
+	if (dst == NULL || p->rctx->argv == NULL || p->rctx->argl == NULL) {
+		return -1;
+	}
+
 	p->rctx->argc = 0;
-	p->rctx->argv = NULL;
+	p->rctx->argv[0] = NULL;
+	p->rctx->argl[0] = 0;
 
-	while (lex_next(&tok, &src, &dst) != NULL) {
+	while (lex_next(&tok, &src, end, &dst) != NULL) {
 		switch (tok.type) {
 		case TOK_ERROR:
-		case TOK_PIPE:	/* not implemented */
 			cl_printf(p, "syntax error at: %.*s\n",
 				(int) (tok.src.end - tok.src.start), tok.src.start);
 
+			return 0;
+
+		case TOK_PIPE:
+			/* the remainder are filters for the command's output */
+			return filter_parse(p, &src, end, &dst);
+
 		case TOK_WORD:
 		case TOK_STRING:
 			break;
 		}
 
-		if (p->rctx->argc == INT_MAX) {
-			free(p->rctx->argv);
-			errno = ENOMEM;
-			return -1;
-		}
-
-		if (p->rctx->argc % 8 == 0) {
-			const char **tmp;
-
-			tmp = realloc(p->rctx->argv, sizeof *p->rctx->argv * (p->rctx->argc + 8 + 1));
-			if (tmp == NULL) {
-				free(p->rctx->argv);
-				return -1;
-			}
+		assert((size_t) p->rctx->argc < max);
 
-			p->rctx->argv = tmp;
-		}
+		p->rctx->argv[p->rctx->argc] = tok.dst.start;
+		p->rctx->argl[p->rctx->argc] = tok.dst.end - tok.dst.start;
 
-		p->rctx->argv[p->rctx->argc++] = tok.dst.start;
-	}
+		p->rctx->argc++;
 
-	if (p->rctx->argc == 0) {
-		static const char *argv[] = { NULL };
-		p->rctx->argv = argv;
-	} else {
 		p->rctx->argv[p->rctx->argc] = NULL;
+		p->rctx->argl[p->rctx->argc] = 0;
 	}
 
 	return 1;
@@ -198,7 +226,14 @@ read_create(void)
 		return NULL;
 	}
 
-	new->state = STATE_NEW;
+	new->arena = arena_create();
+	if (new->arena == NULL) {
+		free(new);
+		return NULL;
+	}
+
+	new->state  = STATE_NEW;
+	new->values = NULL;
 
 	return new;
 }
@@ -208,6 +243,7 @@ read_destroy(struct readctx *rctx)
 {
 	assert(rctx != NULL);
 
+	arena_destroy(rctx->arena);
 	free(rctx);
 }
 
@@ -239,6 +275,11 @@ flags(enum readstate state)
 	return 0;
 }
 
+/*
+ * A command which leaves more output queued than the tree's output limit
+ * sets p->stalled, and the io layers then stop passing input, leaving the
+ * rest for the application to give again; see cl_read().
+ */
 int
 getc_main(struct cl_peer *p, const struct cl_event *event)
 {
@@ -272,51 +313,56 @@ getc_main(struct cl_peer *p, const struct cl_event *event)
 		cl_printf(p, "\n");
 
 		{
-			size_t count;
-			char *src;
-			char *buf;
+			size_t n, args, max;
+			const char *line;
 			int r;
 
-			buf = edit_release(p->ectx);
-
-			if (buf == NULL) {
-				p->tree->printprompt(p, p->mode);
-
-				p->rctx->state = STATE_NEW;
-				return 0;
-			}
+			r = findcommand(p, &args, &max);
 
 			/*
 			 * Note there is no point in checking for an empty string here,
 			 * as for example it could be entirely whitespace, and we'd still
 			 * need to lex it to find out.
 			 */
-			count = strlen(buf);
+			line = edit_line(p->ectx, &n);
 
-			/* see parsecommand() */
-			src = realloc(buf, count * 3 + 1);
-			if (src == NULL) {
-				/* TODO: free something? */
+			if (line != NULL && -1 == hist_add(p->hctx, line, n)) {
 				return -1;
 			}
 
-			r = parsecommand(p, src, src + count + 1);
+			if (line == NULL || r == 0) {
+				edit_clear(p->ectx);
+
+				p->tree->printprompt(p, p->mode);
+
+				p->rctx->state = STATE_NEW;
+				return 0;
+			}
+
+			assert(args <= n);
+
+			r = parseargs(p, line + args, n - args, max);
+
+			edit_clear(p->ectx);
+
 			if (r == -1) {
-				/* TODO: free argv etc */
+				filter_end(p);
+				arena_reset(p->rctx->arena);
 				return -1;
 			}
 
 			if (r == 0) {
+				filter_end(p);
+				arena_reset(p->rctx->arena);
+
 				p->tree->printprompt(p, p->mode);
 
 				p->rctx->state = STATE_NEW;
 				return 0;
 			}
-
-			free(src);
 		}
 
-		p->rctx->fields = p->rctx->t->command->fields;
+		p->rctx->fields = p->rctx->t->command->usage[0]->fields;
 		p->rctx->values = NULL;
 		p->rctx->state  = STATE_FIELD;
 
@@ -329,7 +375,25 @@ getc_main(struct cl_peer *p, const struct cl_event *event)
 	case STATE_FIELD:
 		cl_printf(p, "\n");
 
-		p->rctx->values->value = edit_release(p->ectx);
+		{
+			const char *line;
+			size_t n;
+
+			line = edit_line(p->ectx, &n);
+
+			if (line == NULL) {
+				p->rctx->values->value = NULL;
+			} else {
+				p->rctx->values->value = arena_alloc(p->rctx->arena, n + 1);
+				if (p->rctx->values->value == NULL) {
+					return -1;
+				}
+
+				memcpy(p->rctx->values->value, line, n + 1);
+			}
+
+			edit_clear(p->ectx);
+		}
 
 		/* TODO: call validate callback here */
 
@@ -338,31 +402,41 @@ getc_main(struct cl_peer *p, const struct cl_event *event)
 firstfield:
 
 		if (p->rctx->fields == 0) {
+			int r;
+
 			/* TODO: re-set EDIT_ECHO */
 
-			p->rctx->t->command->callback(p, p->rctx->t->command->command,
-				p->mode, p->rctx->argc, p->rctx->argv);
+			filter_begin(p->fctx);
+
+			p->rctx->t->command->usage[0]->callback(p,
+				p->rctx->t->command->usage[0]->command,
+				p->mode, p->rctx->argc, p->rctx->argv, p->rctx->argl);
+
+			r = filter_end(p);
 
-			/* TODO: free .values list */
-			/* TODO: free argv etc */
+			arena_reset(p->rctx->arena);
+			p->rctx->values = NULL;
 
 			p->tree->printprompt(p, p->mode);
 
-			if (p->rctx->argc > 0) {
-				free(p->rctx->argv);
+			/* one write for the command's response */
+			if (-1 == cl_flush(p)) {
+				r = -1;
+			}
+
+			if (cl_pending_output(p) > p->tree->output_limit) {
+				p->stalled = 1;
 			}
 
 			p->rctx->state = STATE_NEW;
-			return 0;
+			return r;
 		}
 
 		{
 			struct value *new;
 
-			new = malloc(sizeof *new);
+			new = arena_alloc(p->rctx->arena, sizeof *new);
 			if (new == NULL) {
-				/* TODO: free .values list */
-				/* TODO: free argv etc */
 				return -1;
 			}
 
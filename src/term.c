@@ -12,15 +12,53 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 
 #include "internal.h"
 
+/*
+ * Parsed capabilities are shared between peers of the same terminal type,
+ * so that terminfo is searched for and parsed once per type rather than
+ * once per peer. Entries are reference counted, and freed with their last
+ * peer. The cache is process-wide and unlocked; like the rest of libcl,
+ * peers are expected to be created and closed from one thread.
+ */
 struct termctx {
-	unibi_term *ut;
+	char *name;
+	unsigned refs;
+	unibi_term *ut;   /* NULL for the built-in entries */
+	struct cl_term term;
+
+	struct termctx *next;
 };
 
-struct termctx *
-term_create(struct cl_term *term, const char *name)
+/*
+ * The common terminals are compiled in, and never looked for on disk.
+ * These are the capabilities ecma48 uses, as given by terminfo, but
+ * without vt100's padding, which means nothing over a network.
+ */
+static struct termctx builtin[] = {
+	{ "xterm", 0, NULL,
+	  { "\b", "\033[P", "\033[K", "\0337", "\0338",
+	    "\033[%p1%dD", "\033[%p1%dP", "\033[%p1%dX" }, NULL },
+	{ "xterm-256color", 0, NULL,
+	  { "\b", "\033[P", "\033[K", "\0337", "\0338",
+	    "\033[%p1%dD", "\033[%p1%dP", "\033[%p1%dX" }, NULL },
+	{ "screen", 0, NULL,
+	  { "\b", "\033[P", "\033[K", "\0337", "\0338",
+	    "\033[%p1%dD", "\033[%p1%dP", NULL }, NULL },
+	{ "vt102", 0, NULL,
+	  { "\b", "\033[P", "\033[K", "\0337", "\0338",
+	    "\033[%p1%dD", NULL, NULL }, NULL },
+	{ "vt100", 0, NULL,
+	  { "\b", NULL, "\033[K", "\0337", "\0338",
+	    "\033[%p1%dD", NULL, NULL }, NULL }
+};
+
+static struct termctx *cache;
+
+static struct termctx *
+term_load(const char *name)
 {
 	struct termctx *new;
 	size_t i;
@@ -34,18 +72,22 @@ term_create(struct cl_term *term, const char *name)
 		{ 0, unibi_delete_character, offsetof(struct cl_term, dch1) },
 		{ 0, unibi_clr_eol,          offsetof(struct cl_term,   el) },
 		{ 0, unibi_save_cursor,      offsetof(struct cl_term,   sc) },
-		{ 0, unibi_restore_cursor,   offsetof(struct cl_term,   rc) }
+		{ 0, unibi_restore_cursor,   offsetof(struct cl_term,   rc) },
+		{ 0, unibi_parm_left_cursor, offsetof(struct cl_term,  cub) },
+		{ 0, unibi_parm_dch,         offsetof(struct cl_term,  dch) },
+		{ 0, unibi_erase_chars,      offsetof(struct cl_term,  ech) }
 	};
 
-	assert(term != NULL);
 	assert(name != NULL);
-	assert(strlen(name) > 0);
 
-	new = malloc(sizeof *new);
+	new = malloc(sizeof *new + strlen(name) + 1);
 	if (new == NULL) {
 		return NULL;
 	}
 
+	new->name = strcpy((char *) new + sizeof *new, name);
+	new->refs = 0;
+
 	new->ut = unibi_from_term(name);
 	if (new->ut == NULL) {
 		free(new);
@@ -53,7 +95,7 @@ term_create(struct cl_term *term, const char *name)
 	}
 
 	for (i = 0; i < sizeof a / sizeof *a; i++) {
-		const char **p = (const char **) ((char *) term + a[i].offset);
+		const char **p = (const char **) ((char *) &new->term + a[i].offset);
 
 		*p = unibi_get_str(new->ut, a[i].id);
 
@@ -67,14 +109,101 @@ term_create(struct cl_term *term, const char *name)
 	return new;
 }
 
+struct termctx *
+term_create(struct cl_term *term, const char *name)
+{
+	struct termctx *t;
+	size_t i;
+
+	assert(term != NULL);
+	assert(name != NULL);
+	assert(strlen(name) > 0);
+
+	for (i = 0; i < sizeof builtin / sizeof *builtin; i++) {
+		if (0 == strcmp(builtin[i].name, name)) {
+			*term = builtin[i].term;
+			return &builtin[i];
+		}
+	}
+
+	for (t = cache; t != NULL; t = t->next) {
+		if (0 == strcmp(t->name, name)) {
+			break;
+		}
+	}
+
+	if (t == NULL) {
+		t = term_load(name);
+		if (t == NULL) {
+			return NULL;
+		}
+
+		t->next = cache;
+		cache = t;
+	}
+
+	t->refs++;
+
+	*term = t->term;
+
+	return t;
+}
+
 void
 term_destroy(struct termctx *tctx)
 {
+	struct termctx **t;
+
 	assert(tctx != NULL);
-	assert(tctx->ut != NULL);
+
+	if (tctx->ut == NULL) {
+		return;
+	}
+
+	assert(tctx->refs > 0);
+
+	if (--tctx->refs > 0) {
+		return;
+	}
+
+	for (t = &cache; *t != tctx; t = &(*t)->next) {
+		assert(*t != NULL);
+	}
+
+	*t = tctx->next;
 
 	unibi_destroy(tctx->ut);
 
 	free(tctx);
 }
 
+
+/*
+ * Expand a capability taking a single numeric parameter into buf.
+ * Returns the length of the expansion, or 0 if it does not fit.
+ */
+size_t
+term_param(char *buf, size_t bufsz, const char *cap, unsigned n)
+{
+	unibi_var_t v[9];
+	size_t i, r;
+
+	assert(buf != NULL);
+	assert(cap != NULL);
+
+	if (n > INT_MAX) {
+		return 0;
+	}
+
+	v[0] = unibi_var_from_num(n);
+	for (i = 1; i < sizeof v / sizeof *v; i++) {
+		v[i] = unibi_var_from_num(0);
+	}
+
+	r = unibi_run(cap, v, buf, bufsz);
+	if (r >= bufsz) {
+		return 0;
+	}
+
+	return r;
+}
@@ -6,6 +6,7 @@
 
 #include <assert.h>
 #include <limits.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -13,211 +14,911 @@
 
 #include "internal.h"
 
-struct trie *
-trie_add(struct trie **trie, const char *s, const struct cl_command *command)
+/*
+ * The trie is path-compressed: each node is reached by an edge labelled
+ * with one or more characters, and only the edges which exist are stored.
+ * All nodes live in a single array, with the edges for each node stored
+ * contiguously, in order of their first character. Labels point into the
+ * command strings themselves and are not copied.
+ *
+ * A space is always an edge to itself, and other labels never contain a
+ * space. This keeps each word boundary at a node of its own, so that any
+ * position part-way along a label behaves exactly as the node at the end
+ * of that label; there is no branching or command in between.
+ */
+
+struct build {
+	struct cl_trie *node;
+	struct cl_trie_command *command;
+	size_t node_count;
+	size_t command_count;
+	size_t word_count;
+};
+
+static int
+cmp(const void *a, const void *b)
 {
-	assert(trie != NULL);
-	assert(s != NULL);
-	assert(*s == '\0' || strcspn(s, "\t\v\f\r\n") != 0);
-	assert(command != NULL);
+	const struct cl_command * const *pa = a;
+	const struct cl_command * const *pb = b;
+	int r;
 
-	if (*trie == NULL) {
-		size_t i;
+	r = strcmp((*pa)->command, (*pb)->command);
+	if (r != 0) {
+		return r;
+	}
+
+	/* preserve the user's ordering for multiple usages of the same command */
+	return (*pa > *pb) - (*pa < *pb);
+}
 
-		*trie = malloc(sizeof **trie);
-		if (*trie == NULL) {
-			return NULL;	
+static size_t
+group(const struct cl_command **a, size_t count, size_t depth)
+{
+	size_t i;
+
+	assert(count > 0);
+
+	for (i = 1; i < count; i++) {
+		if (a[i]->command[depth] != a[0]->command[depth]) {
+			break;
 		}
+	}
 
-		(*trie)->command = NULL;
+	return i;
+}
 
-		/* TODO: assert(SIZE_MAX > UCHAR_MAX); */
+static size_t
+label(const char *first, const char *last)
+{
+	size_t i;
 
-		for (i = 0; i < sizeof (*trie)->edge / sizeof *(*trie)->edge; i++) {
-			(*trie)->edge[i] = NULL;
+	if (*first == ' ') {
+		return 1;
+	}
+
+	/* first and last are the sorted extremes; everything between shares their prefix */
+	for (i = 0; first[i] != '\0' && first[i] != ' '; i++) {
+		if (first[i] != last[i]) {
+			break;
 		}
 	}
 
-	if (*s == '\0') {
+	assert(i > 0);
+
+	return i;
+}
+
+/*
+ * A word ends at a node with a command, or at a node followed by a space.
+ * For a position within a word, the endings reachable without crossing a
+ * space are the candidates for completing that word.
+ */
+static const struct cl_trie *
+trie_space(const struct cl_trie *trie)
+{
+	assert(trie != NULL);
+
+	/* ' ' orders before any other printable character */
+	if (trie->count > 0 && trie->edge[0].label[0] == ' ') {
+		return &trie->edge[0];
+	}
+
+	return NULL;
+}
+
+static int
+trie_ends(const struct cl_trie *trie)
+{
+	const struct cl_trie *space;
+	int modes;
+
+	assert(trie != NULL);
+
+	modes = 0;
+
+	if (trie->command != NULL) {
+		modes |= trie->command->modes;
+	}
+
+	space = trie_space(trie);
+	if (space != NULL) {
+		modes |= space->modes;
+	}
+
+	return modes;
+}
+
+/*
+ * Populate the per-mode tables for a node whose edges are complete.
+ * Modes are tallied per bit as "exactly one ending" and "more than one",
+ * which is all trie_run() needs to know.
+ */
+static void
+tally(struct cl_trie *n)
+{
+	size_t i;
+
+	assert(n != NULL);
+
+	n->modes = n->command != NULL ? n->command->modes : 0;
+	n->once  = trie_ends(n);
+	n->many  = 0;
+
+	for (i = 0; i < n->count; i++) {
+		const struct cl_trie *e = &n->edge[i];
+
+		n->modes |= e->modes;
+
+		if (e->label[0] == ' ') {
+			continue;
+		}
+
+		n->many |= e->many | (n->once & e->once);
+		n->once  = (n->once | e->once) & ~n->many;
+	}
+}
+
+/*
+ * Commands are sorted, so those sharing a prefix are adjacent, and any which
+ * end at this depth sort first. With no storage given (b->node == NULL),
+ * this just counts the nodes and commands required.
+ */
+static void
+build(struct build *b, struct cl_trie *n, const struct cl_command **a, size_t count,
+	size_t depth)
+{
+	struct cl_trie *edge;
+	size_t i, j, k;
+
+	assert(b != NULL);
+	assert(b->node == NULL || n != NULL);
+
+	for (i = 0; i < count && a[i]->command[depth] == '\0'; i++)
+		;
+
+	if (i > 0) {
+		b->command_count++;
+	}
+
+	if (i > 0 || (i < count && a[i]->command[depth] == ' ')) {
+		b->word_count++;
+	}
+
+	if (i > 0 && b->node != NULL) {
+		struct cl_trie_command *c;
+
+		c = b->command++;
+
+		/* a[] is the sorted array held by the trie, so these are adjacent */
+		c->usage = a;
+		c->count = i;
+		c->modes = 0;
+
 		/*
-		 * A command may be already populated within the trie in the case of
-		 * different usages given for the same path. If so, these are required
-		 * to have the same callback and fields, and modes which do not overlap
-		 * so that we may intersect our incoming command with what is present.
+		 * A command may be given several times in the case of different
+		 * usages given for the same path. If so, these are required to have
+		 * the same callback and fields, and modes which do not overlap.
 		 */
-		if ((*trie)->command == NULL) {
-			(*trie)->command = malloc(sizeof *(*trie)->command);
-			if ((*trie)->command == NULL) {
-				return NULL;
-			}
+		for (j = 0; j < i; j++) {
+			assert(0 == (c->modes & a[j]->modes));
+			assert(a[0]->callback == a[j]->callback);
+			assert(a[0]->fields   == a[j]->fields);
 
-			(*trie)->command->command  = command->command;
-			(*trie)->command->modes    = 0;
-			(*trie)->command->fields   = command->fields;
-			(*trie)->command->callback = command->callback;
+			c->modes |= a[j]->modes;
 		}
 
-		assert(0 == strcmp((*trie)->command->command, command->command)); /* by definition */
-		assert(0 == ((*trie)->command->modes & command->modes));
-		assert((*trie)->command->callback == command->callback);
-		assert((*trie)->command->fields   == command->fields);
+		n->command = c;
+	}
 
-		(*trie)->command->modes |= command->modes;
+	for (k = 0, j = i; j < count; k++) {
+		j += group(a + j, count - j, depth);
+	}
+
+	assert(k <= UCHAR_MAX + 1);
+
+	b->node_count += k;
+
+	edge = NULL;
+
+	if (b->node != NULL) {
+		edge = b->node;
+		b->node += k;
 
-		return *trie;
+		n->edge  = edge;
+		n->count = k;
 	}
 
-	return trie_add(&(*trie)->edge[(unsigned char) *s], s + 1, command);
+	for (j = i; j < count; j += k) {
+		size_t len;
+
+		k = group(a + j, count - j, depth);
+
+		len = label(a[j]->command + depth, a[j + k - 1]->command + depth);
+
+		assert(len <= USHRT_MAX);
+
+		if (edge != NULL) {
+			edge->label      = a[j]->command + depth;
+			edge->len        = len;
+			edge->count      = 0;
+			edge->edge       = NULL;
+			edge->command    = NULL;
+			edge->word       = NULL;
+			edge->word_count = 0;
+		}
+
+		build(b, edge, a + j, k, depth + len);
+
+		if (edge != NULL) {
+			edge++;
+		}
+	}
+
+	if (b->node != NULL) {
+		tally(n);
+	}
+}
+
+/* the text of some command at or beneath a node */
+static const char *
+text(const struct cl_trie *trie)
+{
+	assert(trie != NULL);
+
+	while (trie->command == NULL) {
+		assert(trie->count > 0);
+		trie = &trie->edge[0];
+	}
+
+	return trie->command->usage[0]->command;
+}
+
+static void region(struct cl_trie *n, struct cl_trie_word **w, size_t depth);
+
+/*
+ * Each word has a region of the words array listing its endings, in
+ * depth-first order. So the endings beneath any node within the word are
+ * a contiguous run of its region.
+ */
+static void
+within(struct cl_trie *n, struct cl_trie_word **w, size_t depth, size_t start)
+{
+	size_t i;
+
+	assert(n != NULL);
+	assert(w != NULL && *w != NULL);
+
+	n->word = *w;
+
+	if (n->command != NULL || trie_space(n) != NULL) {
+		(*w)->end = n;
+		(*w)->s   = text(n) + start;
+		(*w)->len = depth - start;
+		(*w)++;
+	}
+
+	for (i = 0; i < n->count; i++) {
+		struct cl_trie *e = (struct cl_trie *) &n->edge[i];
+
+		if (e->label[0] == ' ') {
+			continue;
+		}
+
+		within(e, w, depth + e->len, start);
+	}
+
+	n->word_count = *w - n->word;
+}
+
+/* the regions for words following this one */
+static void
+spaces(struct cl_trie *n, struct cl_trie_word **w, size_t depth)
+{
+	size_t i;
+
+	assert(n != NULL);
+
+	for (i = 0; i < n->count; i++) {
+		struct cl_trie *e = (struct cl_trie *) &n->edge[i];
+
+		if (e->label[0] == ' ') {
+			region(e, w, depth + e->len);
+		} else {
+			spaces(e, w, depth + e->len);
+		}
+	}
+}
+
+static void
+region(struct cl_trie *n, struct cl_trie_word **w, size_t depth)
+{
+	assert(n != NULL);
+
+	within(n, w, depth, depth);
+	spaces(n, w, depth);
+}
+
+struct cl_trie *
+trie_create(size_t count, const struct cl_command *commands)
+{
+	const struct cl_command **a;
+	const struct cl_command **usage;
+	struct cl_trie_word *word, *end;
+	struct build b;
+	struct cl_trie *root;
+	size_t i, words;
+
+	assert(count == 0 || commands != NULL);
+
+	a = malloc(sizeof *a * (count + 1));
+	if (a == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < count; i++) {
+		/* things to assert about .command: does not start with space;
+		 * all alnum or ' '; all isprint; no non-' ' whitespace; is not empty */
+		assert(commands[i].command != NULL);
+		assert(commands[i].command[0] != '\0');
+		assert(commands[i].command[0] != ' ');
+		assert(strcspn(commands[i].command, "\t\v\f\r\n") == strlen(commands[i].command));
+		assert(strstr(commands[i].command, "  ") == NULL);
+
+		a[i] = &commands[i];
+	}
+
+	qsort(a, count, sizeof *a, cmp);
+
+	b.node          = NULL;
+	b.command       = NULL;
+	b.node_count    = 1;
+	b.command_count = 0;
+	b.word_count    = 0;
+
+	build(&b, NULL, a, count, 0);
+
+	/* one allocation for everything; commands follow the nodes, then words and usages */
+	root = malloc(sizeof *root * b.node_count
+		+ sizeof *b.command * b.command_count
+		+ sizeof *word * b.word_count
+		+ sizeof *usage * count);
+	if (root == NULL) {
+		free(a);
+		return NULL;
+	}
+
+	b.node    = root + 1;
+	b.command = (struct cl_trie_command *) (root + b.node_count);
+
+	word  = (struct cl_trie_word *) (b.command + b.command_count);
+	usage = (const struct cl_command **) (word + b.word_count);
+	memcpy(usage, a, sizeof *usage * count);
+
+	words = b.word_count;
+
+	b.node_count    = 1;
+	b.command_count = 0;
+	b.word_count    = 0;
+
+	root->label      = "";
+	root->len        = 0;
+	root->count      = 0;
+	root->edge       = NULL;
+	root->command    = NULL;
+	root->word       = NULL;
+	root->word_count = 0;
+
+	build(&b, root, usage, count, 0);
+
+	end = word;
+	region(root, &end, 0);
+
+	assert(end == word + words);
+
+	assert(b.node == root + b.node_count);
+	assert(b.command == (struct cl_trie_command *) (root + b.node_count) + b.command_count);
+
+	free(a);
+
+	return root;
+}
+
+void
+trie_destroy(struct cl_trie *trie)
+{
+	free(trie);
+}
+
+static const struct cl_trie *
+trie_edge(const struct cl_trie *trie, char c)
+{
+	size_t i;
+
+	assert(trie != NULL);
+
+	for (i = 0; i < trie->count; i++) {
+		if (trie->edge[i].label[0] == c) {
+			return &trie->edge[i];
+		}
+	}
+
+	return NULL;
 }
 
-const struct trie *
-trie_walk(const struct trie *trie, const char *s, size_t len)
+const struct cl_trie *
+trie_walk(const struct cl_trie *trie, const char *s, size_t len)
 {
 	assert(trie != NULL);
 	assert(s != NULL);
 	assert(len > 0);
 
+	/*
+	 * Walking may end part-way along a label. Since there is nothing to
+	 * distinguish that position from the node at the end of the label,
+	 * we return the node.
+	 */
+
 	do {
-		trie = trie->edge[(unsigned char) *s];
+		size_t n;
+
+		trie = trie_edge(trie, *s);
 		if (trie == NULL) {
 			return NULL;
 		}
 
-		s++;
-		len--;
+		n = trie->len < len ? trie->len : len;
+
+		if (0 != memcmp(trie->label, s, n)) {
+			return NULL;
+		}
+
+		s   += n;
+		len -= n;
 	} while (len > 0);
 
 	return trie;
 }
 
-static const struct trie *
-trie_next(struct cl_peer *p, const struct trie *trie, int mode, char c,
-	const struct trie **prev)
+static const struct cl_trie *
+trie_end(struct cl_peer *p, const struct cl_trie *trie, int mode)
+{
+	assert(p != NULL);
+	assert(trie != NULL);
+
+	if (trie->command != NULL && p->tree->visible(p, mode, trie->command->modes)) {
+		return trie;
+	}
+
+	return trie_space(trie);
+}
+
+/* any visible command at or beneath trie */
+static int
+trie_any(struct cl_peer *p, const struct cl_trie *trie, int mode)
 {
 	size_t i;
 
+	assert(p != NULL);
 	assert(trie != NULL);
-	assert(p->tree->visible != NULL);
-	assert(prev != NULL);
 
 	if (trie->command != NULL && p->tree->visible(p, mode, trie->command->modes)) {
-		assert(trie->command->command != NULL);
-
-		if (*prev == NULL) {
-			return trie;
-		}
+		return 1;
+	}
 
-		if (*prev == trie) {
-			*prev = NULL;
+	for (i = 0; i < trie->count; i++) {
+		if (trie_any(p, &trie->edge[i], mode)) {
+			return 1;
 		}
 	}
 
-	/* TODO: assert(SIZE_MAX > UCHAR_MAX); */
+	return 0;
+}
+
+/*
+ * Count visible endings within this word, stopping at two. This is the
+ * general case for an arbitrary visible() callback, which may depend on
+ * the peer and so cannot be tabulated ahead of time.
+ */
+static unsigned
+trie_count(struct cl_peer *p, const struct cl_trie *trie, int mode,
+	const struct cl_trie **end)
+{
+	const struct cl_trie *space;
+	unsigned n;
+	size_t i;
 
-	for (i = 0; i < sizeof trie->edge / sizeof *trie->edge; i++) {
-		const struct trie *next;
+	assert(p != NULL);
+	assert(trie != NULL);
+	assert(end != NULL);
 
-		if (trie->edge[i] == NULL) {
-			continue;
-		}
+	n = 0;
 
-		/* TODO: i don't like that this has knowledge of a specific char */
-		if (i == c) {
-			assert(trie->edge[i] != NULL);
+	space = trie_space(trie);
 
-			return trie->edge[i];
-		}
+	if ((trie->command != NULL && p->tree->visible(p, mode, trie->command->modes))
+	 || (space != NULL && trie_any(p, space, mode))) {
+		*end = trie;
+		n++;
+	}
 
-		next = trie_next(p, trie->edge[i], mode, c, prev);
-		if (next != NULL) {
-			return next;
+	for (i = 0; i < trie->count && n < 2; i++) {
+		if (&trie->edge[i] == space) {
+			continue;
 		}
+
+		n += trie_count(p, &trie->edge[i], mode, end);
 	}
 
-	return NULL;
+	return n;
 }
 
-const struct trie *
-trie_cycle(struct cl_peer *p, const struct trie *trie, int mode, char c,
-	const struct trie *prev)
+/*
+ * A word given in full is taken as-is, even where it is also the prefix
+ * of some longer word. Returns the command or space at which it ends, or
+ * NULL if neither is visible.
+ */
+const struct cl_trie *
+trie_exact(struct cl_peer *p, const struct cl_trie *trie, int mode)
 {
-	const struct trie *next;
+	const struct cl_trie *space;
 
 	assert(p != NULL);
 	assert(p->tree != NULL);
 	assert(p->tree->visible != NULL);
 	assert(trie != NULL);
 
-	next = trie_next(p, trie, mode, c, &prev);
-	if (next != NULL) {
-		return next;
+	if (trie->command != NULL && p->tree->visible(p, mode, trie->command->modes)) {
+		return trie;
 	}
 
-	return trie_next(p, trie, mode, c, &next);
+	space = trie_space(trie);
+	if (space == NULL) {
+		return NULL;
+	}
+
+	if (p->tree->visible == cl_visible && mode != 0) {
+		return (space->modes & mode) ? space : NULL;
+	}
+
+	return trie_any(p, space, mode) ? space : NULL;
 }
 
-const struct trie *
-trie_run(struct cl_peer *p, const struct trie *trie, int mode, char c)
+const struct cl_trie *
+trie_run(struct cl_peer *p, const struct cl_trie *trie, int mode, char c)
 {
+	const struct cl_trie *end;
+
 	assert(p != NULL);
+	assert(p->tree != NULL);
+	assert(p->tree->visible != NULL);
 	assert(trie != NULL);
 
 	(void) c;
 
-	trie = trie_cycle(p, trie, mode, ' ', NULL);
-	if (trie == NULL) {
-		return NULL;
+	/*
+	 * For cl_visible() and a single-bit mode, visibility is just a mask,
+	 * so the tables from tally() answer for us. Each node along the way
+	 * has exactly one ending for this mode, so there is one edge to follow.
+	 */
+	if (p->tree->visible == cl_visible && mode != 0 && (mode & (mode - 1)) == 0) {
+		for (;;) {
+			size_t i;
+
+			if ((trie->many & mode) || (~trie->once & mode)) {
+				return NULL;
+			}
+
+			if (trie_ends(trie) & mode) {
+				return trie_end(p, trie, mode);
+			}
+
+			for (i = 0; i < trie->count; i++) {
+				if (trie->edge[i].label[0] != ' ' && (trie->edge[i].once & mode)) {
+					break;
+				}
+			}
+
+			assert(i < trie->count);
+
+			trie = &trie->edge[i];
+		}
 	}
 
-	if (trie->command != NULL && trie != trie_cycle(p, trie, mode, ' ', trie)) {
+	if (trie_count(p, trie, mode, &end) != 1) {
 		return NULL;
 	}
 
-	return trie;
+	return trie_end(p, end, mode);
 }
 
-void
-trie_help(struct cl_peer *p, const struct trie *trie, int mode)
+struct buf {
+	char *s;
+	size_t len;
+	size_t size;
+};
+
+static int
+appendf(struct buf *b, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	assert(b != NULL);
+	assert(b->s != NULL);
+	assert(fmt != NULL);
+
+	for (;;) {
+		char *tmp;
+
+		va_start(ap, fmt);
+		n = fmt_vsnprintf(b->s + b->len, b->size - b->len, fmt, ap);
+		va_end(ap);
+
+		if (n < 0) {
+			return -1;
+		}
+
+		if ((size_t) n < b->size - b->len) {
+			b->len += n;
+			return 0;
+		}
+
+		tmp = realloc(b->s, b->size * 2 + n);
+		if (tmp == NULL) {
+			return -1;
+		}
+
+		b->s     = tmp;
+		b->size  = b->size * 2 + n;
+	}
+}
+
+static int
+render(struct cl_peer *p, struct buf *b, const struct cl_trie *trie, int mode)
 {
 	size_t i;
 
 	assert(p != NULL);
 	assert(p->tree != NULL);
-	assert(p->tree->commands != NULL);
+	assert(b != NULL);
 	assert(trie != NULL);
 
 	if (trie->command != NULL) {
-		size_t i;
+		for (i = 0; i < trie->command->count; i++) {
+			const struct cl_command *u = trie->command->usage[i];
 
-		for (i = 0; i < p->tree->command_count; i++) {
-			assert(trie->command->command != NULL);
-			assert(p->tree->commands[i].command != NULL);
+			assert(u->command != NULL);
 
-			if (0 != strcmp(p->tree->commands[i].command, trie->command->command)) {
+			if (!p->tree->visible(p, mode, u->modes)) {
 				continue;
 			}
 
-			if (!p->tree->visible(p, mode, p->tree->commands[i].modes)) {
-				continue;
+			if (u->usage == NULL) {
+				if (-1 == appendf(b, "  %-18s\n", u->command)) {
+					return -1;
+				}
+			} else {
+				if (-1 == appendf(b, "  %-18s - %s\n", u->command, u->usage)) {
+					return -1;
+				}
 			}
+		}
+	}
 
-			if (p->tree->commands[i].usage == NULL) {
-				cl_printf(p, "  %-18s\n", p->tree->commands[i].command);
-			} else {
-				cl_printf(p, "  %-18s - %s\n", p->tree->commands[i].command,
-					p->tree->commands[i].usage);
+	for (i = 0; i < trie->count; i++) {
+		if (-1 == render(p, b, &trie->edge[i], mode)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Help is rendered once into a single buffer, and written in one call.
+ * For cl_visible(), the text depends only on the node and the mode, so
+ * it is kept for next time; otherwise visible() may depend on the peer,
+ * and the text is rendered afresh.
+ */
+int
+trie_help(struct cl_peer *p, const struct cl_trie *trie, int mode)
+{
+	struct helpcache *h;
+	struct buf b;
+
+	assert(p != NULL);
+	assert(p->tree != NULL);
+	assert(p->tree->root != NULL);
+	assert(trie != NULL);
+
+	h = NULL;
+
+	if (p->tree->visible == cl_visible) {
+		size_t i;
+
+		i = (size_t) (trie - p->tree->root) * 31 + (unsigned) mode;
+		h = &p->tree->help[i % (sizeof p->tree->help / sizeof *p->tree->help)];
+
+		if (h->s != NULL && h->trie == trie && h->mode == mode) {
+			goto print;
+		}
+	}
+
+	b.len  = 0;
+	b.size = 256;
+	b.s    = malloc(b.size);
+	if (b.s == NULL) {
+		return -1;
+	}
+
+	if (-1 == render(p, &b, trie, mode)) {
+		free(b.s);
+		return -1;
+	}
+
+	if (h == NULL) {
+		ssize_t n;
+
+		n = cl_write(p, b.s, b.len);
+
+		free(b.s);
+
+		return n == -1 ? -1 : 0;
+	}
+
+	free(h->s);
+
+	h->trie = trie;
+	h->mode = mode;
+	h->s    = b.s;
+	h->len  = b.len;
+
+print:
+
+	if (-1 == cl_write(p, h->s, h->len)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Whether a word is visible, either as a command in its own right, or
+ * as the beginning of a visible command. If it is a command, *usage is
+ * set to the text of its first visible usage, or "" for none.
+ */
+static int
+trie_word(struct cl_peer *p, const struct cl_trie_word *w, int mode,
+	const char **usage)
+{
+	const struct cl_trie *space;
+	size_t i;
+
+	assert(p != NULL);
+	assert(p->tree != NULL);
+	assert(p->tree->visible != NULL);
+	assert(w != NULL);
+	assert(usage != NULL);
+
+	*usage = NULL;
+
+	if (w->end->command != NULL) {
+		for (i = 0; i < w->end->command->count; i++) {
+			const struct cl_command *u = w->end->command->usage[i];
+
+			if (p->tree->visible(p, mode, u->modes)) {
+				*usage = u->usage != NULL ? u->usage : "";
+				return 1;
 			}
 		}
 	}
 
-	/* TODO: assert(SIZE_MAX > UCHAR_MAX); */
+	space = trie_space(w->end);
+	if (space == NULL) {
+		return 0;
+	}
+
+	if (p->tree->visible == cl_visible && mode != 0) {
+		return space->modes & mode;
+	}
+
+	return trie_any(p, space, mode);
+}
+
+/*
+ * List just the words which may follow the current position, rather than
+ * every command beneath it. The endings for each position are tabulated
+ * by within(), so this costs only as much as the words listed.
+ */
+int
+trie_words(struct cl_peer *p, const struct cl_trie *trie, int mode)
+{
+	struct buf b;
+	size_t i;
+	int n;
+
+	assert(p != NULL);
+	assert(trie != NULL);
+
+	b.len  = 0;
+	b.size = 256;
+	b.s    = malloc(b.size);
+	if (b.s == NULL) {
+		return -1;
+	}
+
+	for (i = 0; i < trie->word_count; i++) {
+		const struct cl_trie_word *w = &trie->word[i];
+		const char *usage;
 
-	for (i = 0; i < sizeof trie->edge / sizeof *trie->edge; i++) {
-		if (trie->edge[i] == NULL) {
+		if (!trie_word(p, w, mode, &usage)) {
 			continue;
 		}
 
-		trie_help(p, trie->edge[i], mode);
+		assert(w->len <= INT_MAX);
+
+		if (usage == NULL || *usage == '\0') {
+			n = appendf(&b, "  %-18.*s\n", (int) w->len, w->s);
+		} else {
+			n = appendf(&b, "  %-18.*s - %s\n", (int) w->len, w->s, usage);
+		}
+
+		if (n == -1) {
+			free(b.s);
+			return -1;
+		}
 	}
+
+	n = cl_write(p, b.s, b.len) == -1 ? -1 : 0;
+
+	free(b.s);
+
+	return n;
 }
 
+/*
+ * The longest prefix shared by the visible words ending at or beneath
+ * a position, for completion. The prefix is given from the start of the
+ * word, and *s is set to point to it. Returns the number of such words.
+ */
+size_t
+trie_prefix(struct cl_peer *p, const struct cl_trie *trie, int mode,
+	const char **s, size_t *len)
+{
+	size_t i, j, n;
+
+	assert(p != NULL);
+	assert(trie != NULL);
+	assert(s != NULL);
+	assert(len != NULL);
+
+	n = 0;
+
+	*s   = NULL;
+	*len = 0;
+
+	for (i = 0; i < trie->word_count; i++) {
+		const struct cl_trie_word *w = &trie->word[i];
+		const char *usage;
+
+		if (!trie_word(p, w, mode, &usage)) {
+			continue;
+		}
+
+		if (n++ == 0) {
+			*s   = w->s;
+			*len = w->len;
+			continue;
+		}
+
+		for (j = 0; j < *len && j < w->len; j++) {
+			if ((*s)[j] != w->s[j]) {
+				break;
+			}
+		}
+
+		*len = j;
+	}
+
+	return n;
+}
@@ -0,0 +1,164 @@
+/*
+ * Copyright 2012-2017 Katherine Flavel
+ *
+ * See LICENCE for the full copyright terms.
+ */
+
+#include <sys/types.h>
+
+#include <cl/tree.h>
+
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Filtered output is to reach the peer as the same bytes as unfiltered
+ * output. The same command is run over telnet both as it is, and through
+ * a filter which passes every line, and what each sends while the command
+ * runs must be identical, newline translation and IAC escaping included.
+ */
+
+#define TEXT "alpha\nbeta\r\ngamma \377 delta\n\nepsilon\n"
+
+static char out[4096];
+static size_t len;
+
+/* where the command's own output begins and ends in out[] */
+static size_t start, end;
+
+static ssize_t
+peerwrite(struct cl_peer *p, const void *data, size_t n)
+{
+	(void) p;
+
+	if (n > sizeof out - len) {
+		n = sizeof out - len;
+	}
+
+	memcpy(out + len, data, n);
+	len += n;
+
+	return n;
+}
+
+static int
+printprompt(struct cl_peer *p, int mode)
+{
+	(void) mode;
+
+	return cl_printf(p, "> ");
+}
+
+static void
+cmd_show(struct cl_peer *p, const char *cmd, int mode,
+	int argc, const char *argv[], const size_t argl[])
+{
+	(void) cmd;
+	(void) mode;
+	(void) argc;
+	(void) argv;
+	(void) argl;
+
+	cl_flush(p);
+	start = len;
+
+	cl_printf(p, "%s", TEXT);
+
+	cl_flush(p);
+	end = len;
+}
+
+static const struct cl_command commands[] = {
+	{ "show", ~0, 0, cmd_show, NULL }
+};
+
+static void
+show(const char *name, const char *s, size_t n)
+{
+	size_t i;
+
+	fprintf(stderr, "%s:", name);
+
+	for (i = 0; i < n; i++) {
+		fprintf(stderr, " %02x", (unsigned char) s[i]);
+	}
+
+	fprintf(stderr, "\n");
+}
+
+/* the bytes sent while the command ran, for the given line */
+static int
+run(struct cl_tree *t, const char *line, char *buf, size_t *n)
+{
+	static const char wont_ttype[] = "\377\374\030";
+	struct cl_peer *p;
+
+	len   = 0;
+	start = 0;
+	end   = 0;
+
+	p = cl_accept(t, CL_TELNET);
+	if (p == NULL) {
+		perror("cl_accept");
+		return -1;
+	}
+
+	cl_set_mode(p, 1);
+
+	if (-1 == cl_ready(p)
+	|| -1 == cl_read(p, wont_ttype, sizeof wont_ttype - 1)
+	|| -1 == cl_read(p, line, strlen(line))) {
+		perror("cl_read");
+		cl_close(p);
+		return -1;
+	}
+
+	cl_close(p);
+
+	if (end <= start) {
+		fprintf(stderr, "%s: the command did not run\n", line);
+		return -1;
+	}
+
+	*n = end - start;
+	memcpy(buf, out + start, *n);
+
+	return 0;
+}
+
+int
+main(void)
+{
+	static char plain[sizeof out], filtered[sizeof out];
+	struct cl_tree *t;
+	size_t a, b;
+
+	t = cl_create(sizeof commands / sizeof *commands, commands, 0, NULL,
+		NULL, NULL, printprompt, cl_visible, NULL);
+	if (t == NULL) {
+		perror("cl_create");
+		return EXIT_FAILURE;
+	}
+
+	cl_set_write(t, peerwrite);
+
+	if (-1 == run(t, "show\r\n", plain, &a)
+	|| -1 == run(t, "show | include .*\r\n", filtered, &b)) {
+		cl_destroy(t);
+		return EXIT_FAILURE;
+	}
+
+	cl_destroy(t);
+
+	if (a != b || 0 != memcmp(plain, filtered, a)) {
+		show("plain", plain, a);
+		show("filtered", filtered, b);
+		return EXIT_FAILURE;
+	}
+
+	printf("%lu bytes, filtered output identical\n", (unsigned long) a);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,192 @@
+/*
+ * Copyright 2012-2017 Katherine Flavel
+ *
+ * See LICENCE for the full copyright terms.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* for the static lex(), which takes either path */
+#include "../../src/lexer.c"
+
+/*
+ * A differential test of the lexer: every input is lexed both with runs
+ * skipped a word at a time, and one character at a time, and the two must
+ * agree on every token, as to its type, its extent in the source, and the
+ * text written for it.
+ *
+ * Inputs are drawn from an alphabet of the characters which mean something
+ * to the lexer, along with a plain letter; all inputs up to a short length
+ * are tried exhaustively, and then longer ones at random, so that tokens
+ * and strings fall either side of a block boundary.
+ */
+
+static const char alphabet[] = "a \'\"|\\nt";
+
+#define EXHAUSTIVE 6
+#define RANDOM     200000
+#define LONGEST    (4 * sizeof (unsigned long) + 3)
+
+static unsigned long seed = 1;
+
+/* a fixed sequence, so that a failure is repeatable */
+static unsigned
+rnd(unsigned n)
+{
+	seed = seed * 1103515245UL + 12345UL;
+
+	return (unsigned) (seed >> 16) % n;
+}
+
+static void
+show(const char *s, size_t n)
+{
+	size_t i;
+
+	fprintf(stderr, "input \"");
+
+	for (i = 0; i < n; i++) {
+		if (s[i] == '\"' || s[i] == '\\') {
+			fprintf(stderr, "\\%c", s[i]);
+		} else {
+			fprintf(stderr, "%c", s[i]);
+		}
+	}
+
+	fprintf(stderr, "\" (%lu bytes)\n", (unsigned long) n);
+}
+
+static int
+agree(const char *src, const char *dst1, const char *dst2,
+	const struct lex_tok *a, const struct lex_tok *b)
+{
+	if (a == NULL || b == NULL) {
+		return a == b;
+	}
+
+	if (a->type != b->type) {
+		return 0;
+	}
+
+	if (a->src.start - src != b->src.start - src || a->src.end - src != b->src.end - src) {
+		return 0;
+	}
+
+	if (a->dst.start - dst1 != b->dst.start - dst2 || a->dst.end - dst1 != b->dst.end - dst2) {
+		return 0;
+	}
+
+	return 0 == memcmp(a->dst.start, b->dst.start, a->dst.end - a->dst.start);
+}
+
+/* lex the whole input both ways; returns 0 on disagreement */
+static int
+check(const char *s, size_t n)
+{
+	char *src, *dst1, *dst2, *d1, *d2;
+	const char *s1, *s2, *end;
+	struct lex_tok t1, t2, *r1, *r2;
+	int ok;
+
+	/* exactly sized, so that a read past the end is caught under ASan */
+	src  = malloc(n + 1);
+	dst1 = malloc(2 * n + 2);
+	dst2 = malloc(2 * n + 2);
+	if (src == NULL || dst1 == NULL || dst2 == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	memcpy(src, s, n);
+	src[n] = '\0';
+
+	memset(dst1, 'X', 2 * n + 2);
+	memset(dst2, 'Y', 2 * n + 2);
+
+	end = src + n;
+	s1  = src;
+	s2  = src;
+	d1  = dst1;
+	d2  = dst2;
+
+	do {
+		r1 = lex(&t1, &s1, end, &d1, 1);
+		r2 = lex(&t2, &s2, end, &d2, 0);
+
+		ok = agree(src, dst1, dst2, r1, r2)
+			&& s1 - src == s2 - src
+			&& (r1 == NULL || d1 - dst1 == d2 - dst2);
+	} while (ok && r1 != NULL && r1->type != TOK_ERROR);
+
+	if (!ok) {
+		show(s, n);
+
+		if (r1 != NULL && r2 != NULL) {
+			fprintf(stderr, "blocks: type %d src %ld-%ld dst \"%.*s\"\n",
+				(int) r1->type, (long) (r1->src.start - src), (long) (r1->src.end - src),
+				(int) (r1->dst.end - r1->dst.start), r1->dst.start);
+			fprintf(stderr, "single: type %d src %ld-%ld dst \"%.*s\"\n",
+				(int) r2->type, (long) (r2->src.start - src), (long) (r2->src.end - src),
+				(int) (r2->dst.end - r2->dst.start), r2->dst.start);
+		} else {
+			fprintf(stderr, "blocks: %s, single: %s\n",
+				r1 == NULL ? "end" : "token", r2 == NULL ? "end" : "token");
+		}
+	}
+
+	free(src);
+	free(dst1);
+	free(dst2);
+
+	return ok;
+}
+
+int
+main(void)
+{
+	char s[LONGEST + 1];
+	unsigned long i, total;
+	size_t n, k;
+	int failed;
+
+	failed = 0;
+	total  = 0;
+
+	for (n = 0; n <= EXHAUSTIVE; n++) {
+		unsigned long count;
+
+		for (count = 1, k = 0; k < n; k++) {
+			count *= sizeof alphabet - 1;
+		}
+
+		for (i = 0; i < count; i++) {
+			unsigned long x;
+
+			for (x = i, k = 0; k < n; k++) {
+				s[k] = alphabet[x % (sizeof alphabet - 1)];
+				x /= sizeof alphabet - 1;
+			}
+
+			total++;
+			failed += !check(s, n);
+		}
+	}
+
+	for (i = 0; i < RANDOM; i++) {
+		n = rnd(LONGEST + 1);
+
+		/* mostly plain text, so that runs are long enough to skip */
+		for (k = 0; k < n; k++) {
+			s[k] = rnd(4) != 0 ? alphabet[rnd(2)] : alphabet[rnd(sizeof alphabet - 1)];
+		}
+
+		total++;
+		failed += !check(s, n);
+	}
+
+	printf("%lu inputs, %d disagreements\n", total, failed);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}